@@ -0,0 +1,106 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+#include "arena.h"
+#include "sqon.h"
+
+#define BLOCK_SIZE 65536
+#define ALIGN _Alignof (max_align_t)
+
+struct arena_block
+{
+  struct arena_block *next;
+  size_t used;
+  size_t cap;
+  max_align_t data[];
+};
+
+static struct arena_block *
+new_block (size_t cap)
+{
+  struct arena_block *block;
+
+  if (cap > SIZE_MAX - sizeof (struct arena_block))
+    return NULL;
+
+  block = sqon_malloc (sizeof (struct arena_block) + cap);
+  if (NULL == block)
+    return NULL;
+
+  block->used = 0;
+  block->cap = cap;
+  return block;
+}
+
+void
+arena_init (struct arena *a)
+{
+  a->head = NULL;
+}
+
+void *
+arena_alloc (struct arena *a, size_t n)
+{
+  struct arena_block *block = a->head;
+  char *out;
+
+  if (n > SIZE_MAX - ALIGN)
+    return NULL;
+
+  n = (n + ALIGN - 1) & ~(ALIGN - 1);
+
+  if (NULL == block || block->cap - block->used < n)
+    {
+      /* large requests get a block of their own, behind the current one,
+	 so its free space is not wasted */
+      if (n > BLOCK_SIZE / 4 && block)
+	{
+	  struct arena_block *big = new_block (n);
+	  if (NULL == big)
+	    return NULL;
+
+	  big->used = n;
+	  big->next = block->next;
+	  block->next = big;
+	  return big->data;
+	}
+
+      block = new_block (n > BLOCK_SIZE ? n : BLOCK_SIZE);
+      if (NULL == block)
+	return NULL;
+
+      block->next = a->head;
+      a->head = block;
+    }
+
+  out = (char *) block->data + block->used;
+  block->used += n;
+  return out;
+}
+
+void
+arena_free (struct arena *a)
+{
+  while (a->head)
+    {
+      struct arena_block *next = a->head->next;
+      sqon_free (a->head);
+      a->head = next;
+    }
+}
@@ -0,0 +1,41 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DELWINK_SQON_ARENA_H
+#define DELWINK_SQON_ARENA_H
+
+#include <stddef.h>
+
+struct arena_block;
+
+/* Bump allocator for memory which lives as long as one query's result is
+   being built; everything is released at once by arena_free(). */
+struct arena
+{
+  struct arena_block *head;
+};
+
+void
+arena_init (struct arena *a);
+
+void *
+arena_alloc (struct arena *a, size_t n);
+
+void
+arena_free (struct arena *a);
+
+#endif
@@ -0,0 +1,177 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "async.h"
+#include "backend.h"
+#include "result.h"
+#include "sqon.h"
+
+static char *
+copy_str (const char *s)
+{
+  char *out;
+
+  if (NULL == s)
+    return NULL;
+
+  out = sqon_malloc ((strlen (s) + 1) * sizeof (char));
+  if (out)
+    strcpy (out, s);
+
+  return out;
+}
+
+static void
+complete (sqon_Async *q)
+{
+  char *out = NULL;
+  int rc = q->rc;
+
+  if (!rc)
+    {
+      if (NULL == q->res)
+	rc = res_empty (&out);
+      else
+	rc = res_to_json (q->srv->type, q->res, &out, q->pk,
+			  q->srv->output);
+    }
+
+  q->be->async_clear (q);
+  sqon_close (q->srv);
+  q->state = ASYNC_DONE;
+
+  q->cb (rc, out, q->userdata);
+}
+
+int
+sqon_query_async (sqon_DatabaseServer *srv, const char *query,
+		  const char *primary_key, sqon_AsyncCallback cb,
+		  void *userdata, sqon_Async **out)
+{
+  int rc;
+  sqon_Async *q;
+  const struct backend *be = backend_get (srv->type);
+
+  if (NULL == be || NULL == be->async_send)
+    return SQON_UNSUPPORTED;
+
+  q = sqon_malloc (sizeof (sqon_Async));
+  if (NULL == q)
+    return SQON_MEMORYERROR;
+
+  q->srv = srv;
+  q->be = be;
+  q->query = copy_str (query);
+  q->pk = copy_str (primary_key);
+  q->cb = cb;
+  q->userdata = userdata;
+  /* nothing to clean up on the connection until it is open */
+  q->state = ASYNC_DONE;
+  q->wait = 0;
+  q->flushing = false;
+  q->rc = 0;
+  q->res = NULL;
+
+  if (NULL == q->query || (primary_key && NULL == q->pk))
+    {
+      rc = SQON_MEMORYERROR;
+      goto fail;
+    }
+
+  rc = sqon_connect (srv);
+  if (rc)
+    goto fail;
+
+  q->state = ASYNC_QUERY;
+
+  rc = be->async_send (q);
+  if (rc)
+    {
+      sqon_close (srv);
+      q->state = ASYNC_DONE;
+      goto fail;
+    }
+
+  *out = q;
+  return 0;
+
+fail:
+  sqon_async_free (q);
+  return rc;
+}
+
+int
+sqon_async_fd (const sqon_Async *q)
+{
+  return q->be->async_fd (q->srv);
+}
+
+int
+sqon_async_events (const sqon_Async *q)
+{
+  if (q->state >= ASYNC_READY)
+    return 0;
+
+  return q->be->async_events (q);
+}
+
+bool
+sqon_async_advance (sqon_Async *q, int events)
+{
+  if (ASYNC_DONE == q->state)
+    return true;
+
+  if (q->state < ASYNC_READY)
+    q->be->async_step (q, events);
+
+  if (ASYNC_READY != q->state)
+    return false;
+
+  /* without a callback, the result is kept for async_result() */
+  if (q->cb)
+    complete (q);
+
+  return true;
+}
+
+int
+async_result (const sqon_Async *q, void **res)
+{
+  *res = q->res;
+  return q->rc;
+}
+
+void
+sqon_async_free (sqon_Async *q)
+{
+  if (q->state != ASYNC_DONE)
+    {
+      q->be->async_drain (q);
+      q->be->async_clear (q);
+      sqon_close (q->srv);
+    }
+
+  if (q->query)
+    sqon_free (q->query);
+
+  if (q->pk)
+    sqon_free (q->pk);
+
+  sqon_free (q);
+}
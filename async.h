@@ -0,0 +1,59 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DELWINK_SQON_ASYNC_H
+#define DELWINK_SQON_ASYNC_H
+
+#include <stdbool.h>
+
+#include "sqon.h"
+
+enum async_state
+{
+  ASYNC_QUERY,
+  ASYNC_STORE,
+  ASYNC_READY,
+  ASYNC_DONE
+};
+
+struct backend;
+
+/* The backend steps a query through its states; wait and flushing are for
+   it to keep what it is waiting on. */
+struct sqon_async
+{
+  sqon_DatabaseServer *srv;
+  const struct backend *be;
+  char *query;
+  char *pk;
+  sqon_AsyncCallback cb;
+  void *userdata;
+  enum async_state state;
+  int wait;
+  bool flushing;
+  int rc;
+  void *res;
+};
+
+/* For a query started by sqon_query_async() with a NULL callback, which
+   serializes nothing: once sqon_async_advance() has returned true, gives
+   the query's error, or 0 with *res set to its MYSQL_RES or PGresult (NULL
+   if there was no result set). The result is freed with the query. */
+int
+async_result (const sqon_Async *q, void **res);
+
+#endif
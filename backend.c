@@ -0,0 +1,37 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "backend.h"
+
+const struct backend *
+backend_get (uint8_t type)
+{
+  switch (type)
+    {
+    case SQON_DBCONN_MYSQL:
+      return &mysql_backend;
+
+    case SQON_DBCONN_POSTGRES:
+      return &postgres_backend;
+
+    case SQON_DBCONN_SQLITE:
+      return &sqlite_backend;
+
+    default:
+      return NULL;
+    }
+}
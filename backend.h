@@ -0,0 +1,149 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DELWINK_SQON_BACKEND_H
+#define DELWINK_SQON_BACKEND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "async.h"
+#include "bulk.h"
+#include "meta.h"
+#include "result.h"
+#include "sqon.h"
+
+/* Everything libsqon does differently for each kind of database. The
+   connection-level functions are called with srv->com open, except open,
+   which opens it; errors are returned the way sqon.h documents them. */
+struct backend
+{
+  /* Opens srv->com; on failure, srv->com may be left for close to free. */
+  int (*open) (sqon_DatabaseServer *srv);
+
+  void (*close) (sqon_DatabaseServer *srv);
+
+  /* Zero if the session is still usable */
+  int (*ping) (sqon_DatabaseServer *srv);
+
+  /* Runs the query on a connected srv, writing its result through w (the
+     empty result if there is no result set), or reading the result and
+     throwing it away if w is NULL */
+  int (*query) (sqon_DatabaseServer *srv, const char *query,
+		struct result_writer *w);
+
+  /* As sqon_query_stream(), writing through w and handing its buffer to cb
+     every chunk_rows rows */
+  int (*stream) (sqon_DatabaseServer *srv, const char *query,
+		 struct result_writer *w, sqon_StreamCallback cb,
+		 void *userdata, size_t chunk_rows);
+
+  /* Writes in, escaped for a string literal but not quoted, to out, which
+     has room for twice its length plus one. */
+  int (*escape) (sqon_DatabaseServer *srv, const char *in, char *out);
+
+  /* Catalog query taking the escaped table name; its rows are read by
+     load_meta into m, whose table is already set. */
+  const char *meta_query;
+  int (*load_meta) (sqon_DatabaseServer *srv, const char *query,
+		    struct table_meta *m);
+
+  /* Sets *lag_ms to how far a replica's data is behind its primary's: 0 on
+     a server which is not a replica, or -1 if replication has stopped.
+     NULL if the engine has no replicas. */
+  int (*replica_lag) (sqon_DatabaseServer *srv, int64_t *lag_ms);
+
+  /* Quotes an identifier, such as a column name, doubled within it */
+  char ident_quote;
+
+  /* How JSON false and true are written for the engine to read */
+  const char *booleans[2];
+
+  /* Loads every row of b into table's columns, given as a parenthesized
+     list, the fastest way the engine has; SQON_UNSUPPORTED, having read no
+     rows, for them to be inserted instead. NULL if there is no such way. */
+  int (*bulk_load) (sqon_DatabaseServer *srv, const char *table,
+		    const char *columns, struct bulk *b);
+
+  /* Cursors for sqon_cursor_open(): cursor_open starts the query and sets
+     *cur to what cursor_fetch needs to write up to n more rows through w,
+     as a whole result, setting *rows to how many it read; cursor_close
+     frees cur, ending the query. */
+  int (*cursor_open) (sqon_DatabaseServer *srv, const char *query,
+		      void **cur);
+  int (*cursor_fetch) (sqon_DatabaseServer *srv, void *cur,
+		       struct result_writer *w, size_t n, size_t *rows);
+  void (*cursor_close) (sqon_DatabaseServer *srv, void *cur);
+
+  /* Prepared statements for the statement cache: prepare sets *stmt to
+     what execute needs to run sql, prepared under name, with nparams text
+     values, writing its result to *out unless out is NULL; release frees
+     stmt, and if drop is set, the server's copy. NULL if the engine cannot
+     prepare statements. */
+  int (*prepare) (sqon_DatabaseServer *srv, const char *name,
+		  const char *sql, void **stmt);
+  int (*execute) (sqon_DatabaseServer *srv, void *stmt, size_t nparams,
+		  const char *const *values, const size_t *lengths,
+		  char **out, const char *pk);
+  void (*release) (sqon_DatabaseServer *srv, void *stmt, bool drop);
+
+  /* As sqon_query_batch(), with outs already cleared; NULL for the queries
+     to be run one at a time through query. */
+  int (*batch) (sqon_DatabaseServer *srv, const char *const *queries,
+		size_t n, char **outs, const char *const *primary_keys);
+
+  /* Queries for sqon_query_async(), on a connected q->srv: async_send
+     starts q's query; async_step moves it on as far as it goes without
+     blocking, given the SQON_WAIT_ events seen, until q->state is
+     ASYNC_READY with q->rc or q->res set; async_events gives the events it
+     waits for on the socket from async_fd; async_drain blocks until the
+     server is done with the query; async_clear frees q->res and leaves the
+     connection ready for other queries. NULL if the engine has no
+     asynchronous queries. */
+  int (*async_send) (sqon_Async *q);
+  void (*async_step) (sqon_Async *q, int events);
+  int (*async_fd) (sqon_DatabaseServer *srv);
+  int (*async_events) (const sqon_Async *q);
+  void (*async_drain) (sqon_Async *q);
+  void (*async_clear) (sqon_Async *q);
+
+  /* Result sets, as fed to a result_writer */
+  const char *(*field_name) (union fields fields, size_t i);
+  int (*plan_column) (struct result_writer *w, union fields fields, size_t i,
+		      struct column *c);
+  int (*write_row) (struct result_writer *w, union fields fields,
+		    union row row, const unsigned long *lengths);
+
+  /* Writes the columns and every row of a whole result, as res_to_json()
+     is given it */
+  int (*write_result) (struct result_writer *w, void *res);
+};
+
+extern const struct backend mysql_backend;
+extern const struct backend postgres_backend;
+extern const struct backend sqlite_backend;
+
+/* NULL if type is not a known sqon_database_type */
+const struct backend *
+backend_get (uint8_t type);
+
+/* memset() which is not optimized out, for wiping secrets */
+void *
+safe_memset (void *v, int c, size_t n);
+
+#endif
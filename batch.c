@@ -0,0 +1,77 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "backend.h"
+#include "result.h"
+#include "sqon.h"
+
+/* Where there is no round trip to save, the queries simply run in turn,
+   stopping at the first which fails. */
+static int
+batch_sequential (sqon_DatabaseServer *srv, const char *const *queries,
+		  size_t n, char **outs, const char *const *primary_keys)
+{
+  int rc = 0;
+  size_t i;
+
+  for (i = 0; i < n && !rc; ++i)
+    rc = res_query (srv, queries[i], outs ? &outs[i] : NULL,
+		    primary_keys ? primary_keys[i] : NULL);
+
+  return rc;
+}
+
+int
+sqon_query_batch (sqon_DatabaseServer *srv, const char *const *queries,
+		  size_t n, char **outs, const char *const *primary_keys)
+{
+  int rc;
+  size_t i;
+  const struct backend *be;
+
+  if (outs)
+    for (i = 0; i < n; ++i)
+      outs[i] = NULL;
+
+  if (!n)
+    return 0;
+
+  rc = sqon_connect (srv);
+  if (rc)
+    return rc;
+
+  be = backend_get (srv->type);
+  if (be->batch)
+    rc = be->batch (srv, queries, n, outs, primary_keys);
+  else
+    rc = batch_sequential (srv, queries, n, outs, primary_keys);
+
+  sqon_close (srv);
+
+  if (rc && outs)
+    {
+      for (i = 0; i < n; ++i)
+	{
+	  if (outs[i])
+	    sqon_free (outs[i]);
+
+	  outs[i] = NULL;
+	}
+    }
+
+  return rc;
+}
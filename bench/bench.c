@@ -0,0 +1,511 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Measures the result serializer and the JSON string escaper on result sets
+   made up in memory, so no database server is needed. Each benchmark runs in
+   a child process of its own and prints one JSON object per line; its
+   peak_rss_growth_kb is how far the child's peak RSS rose above what it
+   inherited. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "escape.h"
+#include "result.h"
+#include "sqon.h"
+
+struct shape
+{
+  size_t rows;
+  size_t cols;
+  size_t value_len;
+  unsigned int null_pct;
+  unsigned int escape_pct;
+  unsigned int iterations;
+};
+
+/* A result set as both backends would hand it over: a PGresult, and the
+   MYSQL_FIELD array and rows which mysql_store_result() would give. Column
+   0 holds a unique key. */
+struct fake_result
+{
+  PGresult *postgres;
+  MYSQL_FIELD *fields;
+  char ***rows;
+  unsigned long **lengths;
+  size_t bytes;
+};
+
+/* A MYSQL_RES as the client functions below see it */
+struct fake_mysql_res
+{
+  const struct fake_result *r;
+  size_t cols;
+  size_t rows;
+  size_t next;
+};
+
+struct bench
+{
+  const char *name;
+  int (*run) (const struct bench *, const struct fake_result *,
+	      const struct shape *);
+  uint8_t type;
+  const char *pk;
+  bool vector;
+};
+
+static unsigned long long allocations;
+
+/* Peak RSS of the benchmark's process when the benchmark began */
+static long rss_base;
+
+static void *
+counting_malloc (size_t n)
+{
+  ++allocations;
+  return malloc (n);
+}
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint32_t
+rng (void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (uint32_t) (rng_state >> 32);
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long
+peak_rss_kb (void)
+{
+  struct rusage ru;
+
+  getrusage (RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+/* Mostly letters; escape_pct percent of the characters are quotes,
+   backslashes, control characters or two-byte UTF-8 sequences. */
+static char *
+make_value (size_t len, unsigned int escape_pct)
+{
+  static const char *specials[] = {
+    "\"", "\\", "\n", "\t", "\x01", "\xC3\xA9"
+  };
+  char *s = malloc (len + 1);
+  size_t i = 0;
+
+  while (i < len)
+    {
+      if (rng () % 100 < escape_pct)
+	{
+	  const char *sp = specials[rng () % 6];
+	  size_t n = strlen (sp);
+
+	  if (i + n > len)
+	    break;
+
+	  memcpy (s + i, sp, n);
+	  i += n;
+	}
+      else
+	{
+	  s[i++] = 'a' + rng () % 26;
+	}
+    }
+
+  s[i] = '\0';
+  return s;
+}
+
+static void
+fake_result_init (struct fake_result *r, const struct shape *sh)
+{
+  size_t i, j;
+  char name[32];
+  PGresAttDesc *attrs = calloc (sh->cols, sizeof (PGresAttDesc));
+
+  r->postgres = PQmakeEmptyPGresult (NULL, PGRES_TUPLES_OK);
+  r->fields = calloc (sh->cols, sizeof (MYSQL_FIELD));
+  r->rows = malloc (sh->rows * sizeof (char **));
+  r->lengths = malloc (sh->rows * sizeof (unsigned long *));
+  r->bytes = 0;
+
+  for (j = 0; j < sh->cols; ++j)
+    {
+      snprintf (name, sizeof name, "c%zu", j);
+      r->fields[j].name = strdup (name);
+      r->fields[j].type = MYSQL_TYPE_VAR_STRING;
+      attrs[j].name = r->fields[j].name;
+      attrs[j].typid = 25;
+      attrs[j].typlen = -1;
+      attrs[j].atttypmod = -1;
+    }
+
+  PQsetResultAttrs (r->postgres, (int) sh->cols, attrs);
+  free (attrs);
+
+  for (i = 0; i < sh->rows; ++i)
+    {
+      r->rows[i] = malloc (sh->cols * sizeof (char *));
+      r->lengths[i] = malloc (sh->cols * sizeof (unsigned long));
+
+      for (j = 0; j < sh->cols; ++j)
+	{
+	  char *v;
+
+	  if (!j)
+	    {
+	      snprintf (name, sizeof name, "%zu", i);
+	      v = strdup (name);
+	    }
+	  else if (rng () % 100 < sh->null_pct)
+	    {
+	      v = NULL;
+	    }
+	  else
+	    {
+	      v = make_value (sh->value_len, sh->escape_pct);
+	    }
+
+	  r->rows[i][j] = v;
+	  r->lengths[i][j] = v ? strlen (v) : 0;
+	  r->bytes += r->lengths[i][j];
+	  PQsetvalue (r->postgres, (int) i, (int) j, v,
+		      v ? (int) r->lengths[i][j] : -1);
+	}
+    }
+}
+
+static void
+fake_result_free (struct fake_result *r, const struct shape *sh)
+{
+  size_t i, j;
+
+  for (i = 0; i < sh->rows; ++i)
+    {
+      for (j = 0; j < sh->cols; ++j)
+	free (r->rows[i][j]);
+
+      free (r->rows[i]);
+      free (r->lengths[i]);
+    }
+
+  for (j = 0; j < sh->cols; ++j)
+    free (r->fields[j].name);
+
+  free (r->rows);
+  free (r->lengths);
+  free (r->fields);
+  PQclear (r->postgres);
+}
+
+/* The client functions mysql.c reads a stored result with, defined here so
+   that res_to_json() serializes the fake rows through the library's own
+   MySQL path. A program's definitions take precedence over the client
+   library's. */
+unsigned int
+mysql_num_fields (MYSQL_RES *res)
+{
+  return ((struct fake_mysql_res *) res)->cols;
+}
+
+MYSQL_FIELD *
+mysql_fetch_fields (MYSQL_RES *res)
+{
+  return ((struct fake_mysql_res *) res)->r->fields;
+}
+
+MYSQL_ROW
+mysql_fetch_row (MYSQL_RES *res)
+{
+  struct fake_mysql_res *m = (struct fake_mysql_res *) res;
+
+  if (m->next == m->rows)
+    return NULL;
+
+  return m->r->rows[m->next++];
+}
+
+unsigned long *
+mysql_fetch_lengths (MYSQL_RES *res)
+{
+  struct fake_mysql_res *m = (struct fake_mysql_res *) res;
+
+  return m->next ? m->r->lengths[m->next - 1] : NULL;
+}
+
+static void
+report (const char *name, const struct shape *sh, size_t rows, double bytes,
+	double seconds, unsigned long long allocs)
+{
+  printf ("{\"name\": \"%s\", \"rows\": %zu, \"cols\": %zu, "
+	  "\"value_len\": %zu, \"null_pct\": %u, \"escape_pct\": %u, "
+	  "\"iterations\": %u, \"seconds\": %.6f, \"rows_per_sec\": %.0f, "
+	  "\"bytes_per_sec\": %.0f, \"allocations\": %llu, "
+	  "\"peak_rss_growth_kb\": %ld}\n",
+	  name, rows, sh->cols, sh->value_len, sh->null_pct, sh->escape_pct,
+	  sh->iterations, seconds, rows * (double) sh->iterations / seconds,
+	  bytes * sh->iterations / seconds, allocs / sh->iterations,
+	  peak_rss_kb () - rss_base);
+  fflush (stdout);
+}
+
+/* Bytes per second are of JSON produced */
+static int
+bench_result (const struct bench *b, const struct fake_result *r,
+	      const struct shape *sh)
+{
+  unsigned int i;
+  size_t out_len = 0;
+  unsigned long long allocs;
+  double start;
+  int rc = 0;
+
+  allocations = 0;
+  start = now ();
+
+  for (i = 0; !rc && i < sh->iterations; ++i)
+    {
+      char *out;
+      struct fake_mysql_res m = { r, sh->cols, sh->rows, 0 };
+
+      if (SQON_DBCONN_POSTGRES == b->type)
+	rc = res_to_json (b->type, r->postgres, &out, b->pk, 0);
+      else
+	rc = res_to_json (b->type, &m, &out, b->pk, 0);
+
+      if (!rc)
+	{
+	  out_len = strlen (out);
+	  sqon_free (out);
+	}
+    }
+
+  allocs = allocations;
+  if (rc)
+    {
+      fprintf (stderr, "%s: error %d\n", b->name, rc);
+      return rc;
+    }
+
+  report (b->name, sh, sh->rows, out_len, now () - start, allocs);
+  return 0;
+}
+
+/* Every non-NULL value of the result escaped on its own, which is where
+   the serializer spends most of its time; bytes per second are of input */
+static int
+bench_escape (const struct bench *b, const struct fake_result *r,
+	      const struct shape *sh)
+{
+  struct buffer buf;
+  unsigned int it;
+  size_t i, j;
+  double start;
+  int rc = 0;
+
+  buffer_init (&buf);
+  allocations = 0;
+  start = now ();
+
+  for (it = 0; !rc && it < sh->iterations; ++it)
+    for (i = 0; !rc && i < sh->rows; ++i)
+      for (j = 0; !rc && j < sh->cols; ++j)
+	if (r->rows[i][j])
+	  {
+	    buf.len = 0;
+	    rc = buffer_append_json_string (&buf, r->rows[i][j],
+					    r->lengths[i][j]);
+	  }
+
+  if (!rc)
+    report (b->name, sh, sh->rows, r->bytes, now () - start, allocations);
+
+  buffer_free (&buf);
+  return rc;
+}
+
+/* Checks that the vectorized scan for clean spans stops where the scalar one
+   does, everywhere in every value. */
+static int
+check_scan (const struct fake_result *r, const struct shape *sh)
+{
+  size_t i, j;
+
+  for (i = 0; i < sh->rows; ++i)
+    for (j = 0; j < sh->cols; ++j)
+      {
+	const unsigned char *p = (const unsigned char *) r->rows[i][j];
+	const unsigned char *end = p + r->lengths[i][j];
+
+	for (; p && p < end; ++p)
+	  if (escape_scan (p, end) != escape_scan_scalar (p, end))
+	    {
+	      fprintf (stderr, "scan: vector and scalar results differ\n");
+	      return 1;
+	    }
+      }
+
+  return 0;
+}
+
+/* Times the scan for clean spans alone */
+static int
+bench_scan (const struct bench *b, const struct fake_result *r,
+	    const struct shape *sh)
+{
+  unsigned int it;
+  size_t i, j;
+  double start = now ();
+
+  for (it = 0; it < sh->iterations; ++it)
+    for (i = 0; i < sh->rows; ++i)
+      for (j = 0; j < sh->cols; ++j)
+	{
+	  const unsigned char *p = (const unsigned char *) r->rows[i][j];
+	  const unsigned char *end = p + r->lengths[i][j];
+
+	  while (p && p < end)
+	    p = (b->vector ? escape_scan (p, end)
+		 : escape_scan_scalar (p, end)) + 1;
+	}
+
+  report (b->name, sh, sh->rows, r->bytes, now () - start, 0);
+  return 0;
+}
+
+/* Runs b in a child process, so that its peak RSS is not that of the
+   benchmarks before it */
+static int
+run_forked (const struct bench *b, const struct fake_result *r,
+	    const struct shape *sh)
+{
+  pid_t pid;
+  int status;
+
+  fflush (stdout);
+  pid = fork ();
+  if (pid < 0)
+    {
+      perror ("fork");
+      return 1;
+    }
+
+  if (!pid)
+    {
+      rss_base = peak_rss_kb ();
+      status = b->run (b, r, sh);
+      fflush (stdout);
+      _exit (status ? 1 : 0);
+    }
+
+  if (waitpid (pid, &status, 0) < 0)
+    {
+      perror ("waitpid");
+      return 1;
+    }
+
+  if (!WIFEXITED (status))
+    fprintf (stderr, "%s: killed by signal %d\n", b->name,
+	     WIFSIGNALED (status) ? WTERMSIG (status) : 0);
+
+  return !WIFEXITED (status) || WEXITSTATUS (status);
+}
+
+static void
+usage (const char *prog)
+{
+  fprintf (stderr, "usage: %s [-r rows] [-c columns] [-l value_length] "
+	   "[-n null_percent] [-e escape_percent] [-i iterations]\n", prog);
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const struct bench benches[] = {
+    { "postgres_array", bench_result, SQON_DBCONN_POSTGRES, NULL, false },
+    { "postgres_pk", bench_result, SQON_DBCONN_POSTGRES, "c0", false },
+    { "mysql_array", bench_result, SQON_DBCONN_MYSQL, NULL, false },
+    { "mysql_pk", bench_result, SQON_DBCONN_MYSQL, "c0", false },
+    { "escape", bench_escape, 0, NULL, false },
+    { "scan_scalar", bench_scan, 0, NULL, false },
+    { "scan_vector", bench_scan, 0, NULL, true }
+  };
+  struct shape sh = { 10000, 8, 32, 10, 2, 20 };
+  struct fake_result r;
+  size_t i;
+  int opt, rc = 0;
+
+  while ((opt = getopt (argc, argv, "r:c:l:n:e:i:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'r': sh.rows = strtoul (optarg, NULL, 10);       break;
+	case 'c': sh.cols = strtoul (optarg, NULL, 10);       break;
+	case 'l': sh.value_len = strtoul (optarg, NULL, 10);  break;
+	case 'n': sh.null_pct = strtoul (optarg, NULL, 10);   break;
+	case 'e': sh.escape_pct = strtoul (optarg, NULL, 10); break;
+	case 'i': sh.iterations = strtoul (optarg, NULL, 10); break;
+
+	default:
+	  usage (argv[0]);
+	  return 2;
+	}
+    }
+
+  if (!sh.rows || sh.cols < 2 || !sh.iterations)
+    {
+      usage (argv[0]);
+      return 2;
+    }
+
+  sqon_init ();
+  fake_result_init (&r, &sh);
+  sqon_set_alloc_funcs (counting_malloc, free);
+
+  /* a scan that is wrong is not worth timing */
+  if (check_scan (&r, &sh))
+    rc = 1;
+  else
+    for (i = 0; i < sizeof (benches) / sizeof (benches[0]); ++i)
+      rc |= run_forked (&benches[i], &r, &sh);
+
+  fake_result_free (&r, &sh);
+  sqon_cleanup ();
+  return rc ? 1 : 0;
+}
@@ -0,0 +1,215 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "escape.h"
+#include "sqon.h"
+
+#define MIN_CAPACITY 256
+
+void
+buffer_init (struct buffer *buf)
+{
+  buf->data = NULL;
+  buf->len = 0;
+  buf->cap = 0;
+}
+
+void
+buffer_free (struct buffer *buf)
+{
+  if (buf->data)
+    sqon_free (buf->data);
+
+  buffer_init (buf);
+}
+
+int
+buffer_reserve (struct buffer *buf, size_t n)
+{
+  size_t cap = buf->cap ? buf->cap : MIN_CAPACITY;
+  char *data;
+
+  /* one extra byte is always kept for buffer_finish()'s terminator */
+  if (n >= SIZE_MAX - buf->len)
+    return SQON_OVERFLOW;
+
+  if (buf->len + n < buf->cap)
+    return 0;
+
+  while (cap <= buf->len + n)
+    {
+      if (cap > SIZE_MAX / 2)
+	return SQON_OVERFLOW;
+
+      cap *= 2;
+    }
+
+  data = sqon_malloc (cap * sizeof (char));
+  if (NULL == data)
+    return SQON_MEMORYERROR;
+
+  if (buf->data)
+    {
+      memcpy (data, buf->data, buf->len);
+      sqon_free (buf->data);
+    }
+
+  buf->data = data;
+  buf->cap = cap;
+  return 0;
+}
+
+int
+buffer_append (struct buffer *buf, const char *s, size_t n)
+{
+  int rc = buffer_reserve (buf, n);
+  if (rc)
+    return rc;
+
+  memcpy (buf->data + buf->len, s, n);
+  buf->len += n;
+  return 0;
+}
+
+int
+buffer_append_str (struct buffer *buf, const char *s)
+{
+  return buffer_append (buf, s, strlen (s));
+}
+
+int
+buffer_append_ident (struct buffer *buf, const char *name, char quote)
+{
+  int rc = buffer_append (buf, &quote, 1);
+  const char *run = name;
+
+  for (; !rc && *name; ++name)
+    {
+      if (*name == quote)
+	{
+	  /* the quote is copied with the run, and again with the next */
+	  rc = buffer_append (buf, run, name - run + 1);
+	  run = name;
+	}
+    }
+
+  if (!rc)
+    rc = buffer_append (buf, run, name - run);
+  if (!rc)
+    rc = buffer_append (buf, &quote, 1);
+
+  return rc;
+}
+
+int
+buffer_append_statement (struct buffer *buf, const char *query)
+{
+  size_t len = strlen (query);
+
+  while (len && (';' == query[len - 1]
+		 || isspace ((unsigned char) query[len - 1])))
+    --len;
+
+  if (!len)
+    return SQON_BADPARAMS;
+
+  return buffer_append (buf, query, len);
+}
+
+int
+buffer_append_json_string (struct buffer *buf, const char *s, size_t n)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  const unsigned char *p = (const unsigned char *) s;
+  const unsigned char *end = p + n;
+  int rc;
+
+  /* the common case is a string with nothing to escape */
+  rc = buffer_reserve (buf, n + 2);
+  if (rc)
+    return rc;
+
+  buf->data[buf->len++] = '"';
+
+  while (p < end)
+    {
+      const unsigned char *run = p;
+      char seq[6] = { '\\', 0, '0', '0', 0, 0 };
+      size_t len = 2;
+
+      p = escape_scan (p, end);
+
+      if (p > run)
+	{
+	  rc = buffer_append (buf, (const char *) run, p - run);
+	  if (rc)
+	    return rc;
+	}
+
+      if (p == end)
+	break;
+
+      /* the scan steps over valid multibyte sequences */
+      if (*p >= 0x80)
+	return SQON_ENCODING;
+
+      switch (*p)
+	{
+	case '"':  seq[1] = '"';  break;
+	case '\\': seq[1] = '\\'; break;
+	case '\b': seq[1] = 'b';  break;
+	case '\f': seq[1] = 'f';  break;
+	case '\n': seq[1] = 'n';  break;
+	case '\r': seq[1] = 'r';  break;
+	case '\t': seq[1] = 't';  break;
+	default:
+	  seq[1] = 'u';
+	  seq[4] = hex[*p >> 4];
+	  seq[5] = hex[*p & 0xF];
+	  len = 6;
+	  break;
+	}
+
+      rc = buffer_append (buf, seq, len);
+      ++p;
+
+      if (rc)
+	return rc;
+    }
+
+  return buffer_append (buf, "\"", 1);
+}
+
+char *
+buffer_finish (struct buffer *buf)
+{
+  char *out;
+
+  if (buffer_reserve (buf, 0))
+    return NULL;
+
+  buf->data[buf->len] = '\0';
+  out = buf->data;
+  buffer_init (buf);
+
+  return out;
+}
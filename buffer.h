@@ -0,0 +1,65 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DELWINK_SQON_BUFFER_H
+#define DELWINK_SQON_BUFFER_H
+
+#include <stddef.h>
+
+/* Growable output buffer; memory comes from sqon_malloc(). */
+struct buffer
+{
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+void
+buffer_init (struct buffer *buf);
+
+void
+buffer_free (struct buffer *buf);
+
+int
+buffer_reserve (struct buffer *buf, size_t n);
+
+int
+buffer_append (struct buffer *buf, const char *s, size_t n);
+
+int
+buffer_append_str (struct buffer *buf, const char *s);
+
+/* Appends s as a quoted JSON string; fails with SQON_ENCODING if s is not
+   valid UTF-8. */
+int
+buffer_append_json_string (struct buffer *buf, const char *s, size_t n);
+
+/* Appends name as an SQL identifier, between quotes and with any quote in it
+   doubled */
+int
+buffer_append_ident (struct buffer *buf, const char *name, char quote);
+
+/* Appends query without the blanks and semicolons ending it, so that more
+   may follow it; fails with SQON_BADPARAMS if nothing is left. */
+int
+buffer_append_statement (struct buffer *buf, const char *query);
+
+/* NUL-terminates the buffer and hands its memory to the caller. */
+char *
+buffer_finish (struct buffer *buf);
+
+#endif
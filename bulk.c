@@ -0,0 +1,980 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "backend.h"
+#include "buffer.h"
+#include "bulk.h"
+#include "sqon.h"
+
+#define READ_SIZE 16384
+#define MIN_COLUMNS 16
+
+/* INSERT statements of the fallback end at whichever comes first */
+#define BATCH_ROWS 1000
+#define BATCH_BYTES (1024 * 1024)
+
+/* Offset of the value of a column which is NULL */
+#define NO_VALUE SIZE_MAX
+
+struct field
+{
+  /* offset of the column's name in names */
+  size_t name;
+  /* offset of the value in values, or NO_VALUE */
+  size_t value;
+  /* whether the current row has named the column */
+  bool seen;
+};
+
+struct bulk
+{
+  const struct backend *be;
+  sqon_ReadCallback read;
+  void *userdata;
+  /* failure of read, reported in place of the parse error it causes */
+  int rc;
+
+  char in[READ_SIZE];
+  size_t pos;
+  size_t len;
+  bool eof;
+
+  /* while inside the array holding the rows, if there is one */
+  bool array;
+  bool closed;
+
+  /* columns in the order of the first row's keys */
+  struct field *fields;
+  size_t num_columns;
+  size_t cap_columns;
+  struct buffer names;
+
+  /* the current row, each value NUL-terminated; ready until it is used */
+  struct buffer values;
+  bool ready;
+  size_t rows;
+
+  struct buffer key;
+};
+
+/* Input for sqon_bulk_insert(), which has it all in memory */
+struct string_input
+{
+  const char *s;
+  size_t left;
+};
+
+/* Next byte of input, without consuming it, or EOF after the last */
+static int
+peek (struct bulk *b)
+{
+  size_t n;
+
+  if (b->pos == b->len && !b->eof)
+    {
+      n = b->read (b->in, sizeof b->in, b->userdata);
+      if ((size_t) -1 == n || n > sizeof b->in)
+	{
+	  b->rc = SQON_IOERROR;
+	  n = 0;
+	}
+
+      b->eof = !n;
+      b->pos = 0;
+      b->len = n;
+    }
+
+  return b->pos < b->len ? (unsigned char) b->in[b->pos] : EOF;
+}
+
+static int
+skip_space (struct bulk *b)
+{
+  int c;
+
+  while (' ' == (c = peek (b)) || '\t' == c || '\n' == c || '\r' == c)
+    ++b->pos;
+
+  return c;
+}
+
+/* Error for input which is not what should come next */
+static int
+bad_input (const struct bulk *b)
+{
+  return b->rc ? b->rc : SQON_BADPARAMS;
+}
+
+/* Consumes c, which must be next apart from whitespace. */
+static int
+expect (struct bulk *b, int c)
+{
+  if (skip_space (b) != c)
+    return bad_input (b);
+
+  ++b->pos;
+  return 0;
+}
+
+/* Consumes word, which must be next. */
+static bool
+match (struct bulk *b, const char *word)
+{
+  for (; *word; ++word, ++b->pos)
+    if (peek (b) != (unsigned char) *word)
+      return false;
+
+  return true;
+}
+
+static int
+read_hex (struct bulk *b, unsigned long *code)
+{
+  int c, i;
+
+  *code = 0;
+  for (i = 0; i < 4; ++i)
+    {
+      c = peek (b);
+      if (c >= '0' && c <= '9')
+	c -= '0';
+      else if (c >= 'a' && c <= 'f')
+	c -= 'a' - 10;
+      else if (c >= 'A' && c <= 'F')
+	c -= 'A' - 10;
+      else
+	return bad_input (b);
+
+      *code = *code << 4 | (unsigned long) c;
+      ++b->pos;
+    }
+
+  return 0;
+}
+
+/* Appends the character of a \u escape, whose \u has been read, as UTF-8 */
+static int
+read_unicode (struct bulk *b, struct buffer *out)
+{
+  int rc;
+  unsigned long code, low;
+  char utf8[4];
+  size_t n;
+
+  rc = read_hex (b, &code);
+  if (rc)
+    return rc;
+
+  if (code >= 0xD800 && code < 0xDC00)
+    {
+      /* beyond the BMP, as a surrogate pair */
+      if (!match (b, "\\u"))
+	return SQON_ENCODING;
+
+      rc = read_hex (b, &low);
+      if (rc)
+	return rc;
+
+      if (low < 0xDC00 || low > 0xDFFF)
+	return SQON_ENCODING;
+
+      code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+    }
+  else if (code >= 0xDC00 && code < 0xE000)
+    {
+      return SQON_ENCODING;
+    }
+
+  /* neither the server's input nor a C string can hold NUL */
+  if (0 == code)
+    return SQON_ENCODING;
+
+  if (code < 0x80)
+    {
+      utf8[0] = (char) code;
+      n = 1;
+    }
+  else if (code < 0x800)
+    {
+      utf8[0] = (char) (0xC0 | code >> 6);
+      utf8[1] = (char) (0x80 | (code & 0x3F));
+      n = 2;
+    }
+  else if (code < 0x10000)
+    {
+      utf8[0] = (char) (0xE0 | code >> 12);
+      utf8[1] = (char) (0x80 | (code >> 6 & 0x3F));
+      utf8[2] = (char) (0x80 | (code & 0x3F));
+      n = 3;
+    }
+  else
+    {
+      utf8[0] = (char) (0xF0 | code >> 18);
+      utf8[1] = (char) (0x80 | (code >> 12 & 0x3F));
+      utf8[2] = (char) (0x80 | (code >> 6 & 0x3F));
+      utf8[3] = (char) (0x80 | (code & 0x3F));
+      n = 4;
+    }
+
+  return buffer_append (out, utf8, n);
+}
+
+static int
+read_escape (struct bulk *b, struct buffer *out)
+{
+  int c = peek (b);
+  char ch;
+
+  if (EOF == c)
+    return bad_input (b);
+
+  ++b->pos;
+  switch (c)
+    {
+    case '"':
+    case '\\':
+    case '/':
+      ch = (char) c;
+      break;
+
+    case 'b':
+      ch = '\b';
+      break;
+
+    case 'f':
+      ch = '\f';
+      break;
+
+    case 'n':
+      ch = '\n';
+      break;
+
+    case 'r':
+      ch = '\r';
+      break;
+
+    case 't':
+      ch = '\t';
+      break;
+
+    case 'u':
+      return read_unicode (b, out);
+
+    default:
+      return SQON_BADPARAMS;
+    }
+
+  return buffer_append (out, &ch, 1);
+}
+
+/* Appends the unescaped contents of a string whose opening quote has been
+   read. */
+static int
+read_string (struct bulk *b, struct buffer *out)
+{
+  int rc, c;
+  size_t start;
+
+  for (;;)
+    {
+      /* runs of plain characters are copied at once */
+      start = b->pos;
+      while (b->pos < b->len && '"' != (c = (unsigned char) b->in[b->pos])
+	     && '\\' != c && c >= 0x20)
+	++b->pos;
+
+      rc = buffer_append (out, b->in + start, b->pos - start);
+      if (rc)
+	return rc;
+
+      c = peek (b);
+      if ('"' == c)
+	{
+	  ++b->pos;
+	  return 0;
+	}
+
+      if ('\\' == c)
+	{
+	  ++b->pos;
+	  rc = read_escape (b, out);
+	  if (rc)
+	    return rc;
+	}
+      else if (EOF == c || c < 0x20)
+	{
+	  return bad_input (b);
+	}
+    }
+}
+
+/* Consumes the next byte, which peek() has returned, and copies it to out */
+static int
+copy_byte (struct bulk *b, struct buffer *out)
+{
+  char ch = b->in[b->pos++];
+
+  return buffer_append (out, &ch, 1);
+}
+
+/* Copies a run of digits; *n is set to how many there were. */
+static int
+read_digits (struct bulk *b, struct buffer *out, size_t *n)
+{
+  int rc = 0, c;
+
+  for (*n = 0; !rc && (c = peek (b)) >= '0' && c <= '9'; ++*n)
+    rc = copy_byte (b, out);
+
+  return rc;
+}
+
+/* Numbers are passed on as written, for the server to read at whatever
+   precision the column has, so they must follow the JSON grammar exactly:
+   an optional minus, an integer part without leading zeros, then optional
+   fraction and exponent parts. */
+static int
+read_number (struct bulk *b, struct buffer *out)
+{
+  int rc = 0, c;
+  size_t n = 1;
+
+  if ('-' == peek (b))
+    rc = copy_byte (b, out);
+
+  if (!rc)
+    rc = ('0' == peek (b)) ? copy_byte (b, out) : read_digits (b, out, &n);
+  if (rc || !n)
+    return rc ? rc : bad_input (b);
+
+  if ('.' == peek (b))
+    {
+      rc = copy_byte (b, out);
+      if (!rc)
+	rc = read_digits (b, out, &n);
+      if (rc || !n)
+	return rc ? rc : bad_input (b);
+    }
+
+  c = peek (b);
+  if ('e' == c || 'E' == c)
+    {
+      rc = copy_byte (b, out);
+      c = peek (b);
+      if (!rc && ('+' == c || '-' == c))
+	rc = copy_byte (b, out);
+      if (!rc)
+	rc = read_digits (b, out, &n);
+      if (rc || !n)
+	return rc ? rc : bad_input (b);
+    }
+
+  return 0;
+}
+
+/* Copies a nested object or array as written, for a JSON column. Strings are
+   skipped and each bracket must be closed by its own kind; the server checks
+   the rest. */
+static int
+read_nested (struct bulk *b, struct buffer *out)
+{
+  int rc = 0, c;
+  bool in_string = false, escaped = false;
+  char ch;
+  /* the closing bracket each open level expects, innermost last */
+  struct buffer closers;
+
+  buffer_init (&closers);
+
+  do
+    {
+      c = peek (b);
+      if (EOF == c)
+	{
+	  rc = bad_input (b);
+	  break;
+	}
+
+      if (escaped)
+	{
+	  escaped = false;
+	}
+      else if (in_string && '\\' == c)
+	{
+	  escaped = true;
+	}
+      else if ('"' == c)
+	{
+	  in_string = !in_string;
+	}
+      else if (!in_string && ('{' == c || '[' == c))
+	{
+	  ch = ('{' == c) ? '}' : ']';
+	  rc = buffer_append (&closers, &ch, 1);
+	}
+      else if (!in_string && ('}' == c || ']' == c))
+	{
+	  if (closers.data[--closers.len] != c)
+	    rc = bad_input (b);
+	}
+
+      if (!rc)
+	rc = copy_byte (b, out);
+    }
+  while (!rc && closers.len);
+
+  buffer_free (&closers);
+  return rc;
+}
+
+static int
+read_value (struct bulk *b, struct buffer *out, bool *null)
+{
+  int c = skip_space (b);
+
+  *null = false;
+  switch (c)
+    {
+    case '"':
+      ++b->pos;
+      return read_string (b, out);
+
+    case '{':
+    case '[':
+      return read_nested (b, out);
+
+    case 't':
+      if (!match (b, "true"))
+	return bad_input (b);
+
+      return buffer_append_str (out, b->be->booleans[1]);
+
+    case 'f':
+      if (!match (b, "false"))
+	return bad_input (b);
+
+      return buffer_append_str (out, b->be->booleans[0]);
+
+    case 'n':
+      if (!match (b, "null"))
+	return bad_input (b);
+
+      *null = true;
+      return 0;
+
+    default:
+      if ('-' == c || (c >= '0' && c <= '9'))
+	return read_number (b, out);
+
+      return bad_input (b);
+    }
+}
+
+static int
+add_column (struct bulk *b)
+{
+  int rc;
+  size_t cap;
+  struct field *fields, *f;
+
+  if (b->num_columns == b->cap_columns)
+    {
+      cap = b->cap_columns ? b->cap_columns * 2 : MIN_COLUMNS;
+      fields = sqon_malloc (cap * sizeof *fields);
+      if (NULL == fields)
+	return SQON_MEMORYERROR;
+
+      if (b->fields)
+	{
+	  memcpy (fields, b->fields, b->num_columns * sizeof *fields);
+	  sqon_free (b->fields);
+	}
+
+      b->fields = fields;
+      b->cap_columns = cap;
+    }
+
+  f = &b->fields[b->num_columns];
+  f->name = b->names.len;
+  f->value = NO_VALUE;
+  f->seen = false;
+
+  rc = buffer_append (&b->names, b->key.data, b->key.len);
+  if (rc)
+    return rc;
+
+  ++b->num_columns;
+  return 0;
+}
+
+/* Index of the column named by the key just read, or num_columns if there
+   is none; rows usually list their keys in the same order, so the column
+   at hint is tried first. */
+static size_t
+find_column (const struct bulk *b, size_t hint)
+{
+  size_t i;
+
+  if (hint < b->num_columns
+      && !strcmp (b->names.data + b->fields[hint].name, b->key.data))
+    return hint;
+
+  for (i = 0; i < b->num_columns; ++i)
+    if (!strcmp (b->names.data + b->fields[i].name, b->key.data))
+      return i;
+
+  return b->num_columns;
+}
+
+/* Reads the object at the next '{' into the current row. */
+static int
+read_row (struct bulk *b)
+{
+  int rc;
+  size_t i, n, start;
+  bool null;
+  struct field *f;
+
+  ++b->pos;
+  b->values.len = 0;
+  for (i = 0; i < b->num_columns; ++i)
+    {
+      b->fields[i].value = NO_VALUE;
+      b->fields[i].seen = false;
+    }
+
+  if ('}' == skip_space (b))
+    ++b->pos;
+  else
+    for (n = 0;; ++n)
+      {
+	b->key.len = 0;
+	rc = expect (b, '"');
+	if (!rc)
+	  rc = read_string (b, &b->key);
+	if (!rc)
+	  rc = buffer_append (&b->key, "", 1);
+	if (!rc)
+	  rc = expect (b, ':');
+	if (rc)
+	  return rc;
+
+	i = find_column (b, n);
+	if (i == b->num_columns)
+	  {
+	    /* the first row decides the columns */
+	    if (b->rows)
+	      return SQON_BADPARAMS;
+
+	    rc = add_column (b);
+	    if (rc)
+	      return rc;
+	  }
+
+	f = &b->fields[i];
+	if (f->seen)
+	  return SQON_BADPARAMS;
+
+	f->seen = true;
+	start = b->values.len;
+
+	rc = read_value (b, &b->values, &null);
+	if (!rc && !null)
+	  {
+	    f->value = start;
+	    rc = buffer_append (&b->values, "", 1);
+	  }
+	if (rc)
+	  return rc;
+
+	if ('}' == skip_space (b))
+	  {
+	    ++b->pos;
+	    break;
+	  }
+
+	rc = expect (b, ',');
+	if (rc)
+	  return rc;
+      }
+
+  if (!b->num_columns)
+    return SQON_BADPARAMS;
+
+  ++b->rows;
+  b->ready = true;
+  return 0;
+}
+
+/* Makes the next row ready if it is not already: 1 if there is one, 0 after
+   the last. */
+static int
+fetch (struct bulk *b)
+{
+  int rc, c;
+
+  if (b->ready)
+    return 1;
+
+  c = skip_space (b);
+  if (b->array)
+    {
+      if (']' == c)
+	{
+	  /* only whitespace may follow */
+	  ++b->pos;
+	  b->array = false;
+	  b->closed = true;
+	  c = skip_space (b);
+	}
+      else if (b->rows)
+	{
+	  rc = expect (b, ',');
+	  if (rc)
+	    return rc;
+
+	  c = skip_space (b);
+	  if ('{' != c)
+	    return bad_input (b);
+	}
+    }
+
+  if (EOF == c)
+    {
+      if (b->rc)
+	return b->rc;
+
+      return b->array ? SQON_BADPARAMS : 0;
+    }
+
+  if ('{' != c || b->closed)
+    return bad_input (b);
+
+  rc = read_row (b);
+  return rc ? rc : 1;
+}
+
+static void
+bulk_init (struct bulk *b, const struct backend *be, sqon_ReadCallback read,
+	   void *userdata)
+{
+  b->be = be;
+  b->read = read;
+  b->userdata = userdata;
+  b->rc = 0;
+  b->pos = 0;
+  b->len = 0;
+  b->eof = false;
+  b->array = false;
+  b->closed = false;
+  b->fields = NULL;
+  b->num_columns = 0;
+  b->cap_columns = 0;
+  buffer_init (&b->names);
+  buffer_init (&b->values);
+  b->ready = false;
+  b->rows = 0;
+  buffer_init (&b->key);
+
+  /* rows come in an array, or else one object after another */
+  if ('[' == skip_space (b))
+    {
+      ++b->pos;
+      b->array = true;
+    }
+}
+
+static void
+bulk_free (struct bulk *b)
+{
+  if (b->fields)
+    sqon_free (b->fields);
+
+  buffer_free (&b->names);
+  buffer_free (&b->values);
+  buffer_free (&b->key);
+}
+
+/* Appends value with the escapes of the tab-separated format */
+static int
+append_field (struct buffer *out, const char *value)
+{
+  int rc;
+  const char *run = value;
+  char escape[2] = { '\\', '\0' };
+
+  for (; *value; ++value)
+    {
+      switch (*value)
+	{
+	case '\\':
+	  escape[1] = '\\';
+	  break;
+
+	case '\t':
+	  escape[1] = 't';
+	  break;
+
+	case '\n':
+	  escape[1] = 'n';
+	  break;
+
+	case '\r':
+	  escape[1] = 'r';
+	  break;
+
+	default:
+	  continue;
+	}
+
+      rc = buffer_append (out, run, value - run);
+      if (!rc)
+	rc = buffer_append (out, escape, 2);
+      if (rc)
+	return rc;
+
+      run = value + 1;
+    }
+
+  return buffer_append (out, run, value - run);
+}
+
+int
+bulk_read_lines (struct bulk *b, struct buffer *out, size_t min)
+{
+  int rc;
+  size_t i;
+  const struct field *f;
+
+  while (out->len < min)
+    {
+      rc = fetch (b);
+      if (rc <= 0)
+	return rc;
+
+      for (i = 0; i < b->num_columns; ++i)
+	{
+	  f = &b->fields[i];
+	  rc = i ? buffer_append (out, "\t", 1) : 0;
+	  if (!rc && NO_VALUE == f->value)
+	    rc = buffer_append (out, "\\N", 2);
+	  else if (!rc)
+	    rc = append_field (out, b->values.data + f->value);
+	  if (rc)
+	    return rc;
+	}
+
+      rc = buffer_append (out, "\n", 1);
+      if (rc)
+	return rc;
+
+      b->ready = false;
+    }
+
+  return 0;
+}
+
+/* Appends the parenthesized list of the columns, quoted as identifiers */
+static int
+append_columns (const struct bulk *b, struct buffer *out)
+{
+  int rc;
+  size_t i;
+
+  rc = buffer_append (out, "(", 1);
+  for (i = 0; !rc && i < b->num_columns; ++i)
+    {
+      if (i)
+	rc = buffer_append (out, ", ", 2);
+      if (!rc)
+	rc = buffer_append_ident (out, b->names.data + b->fields[i].name,
+				  b->be->ident_quote);
+    }
+
+  if (!rc)
+    rc = buffer_append (out, ")", 1);
+
+  return rc;
+}
+
+/* Appends the current row as a parenthesized list of string literals */
+static int
+append_values (sqon_DatabaseServer *srv, const struct bulk *b,
+	       struct buffer *out, struct buffer *escaped)
+{
+  int rc;
+  size_t i;
+  const char *value;
+
+  rc = buffer_append (out, "(", 1);
+  for (i = 0; !rc && i < b->num_columns; ++i)
+    {
+      if (i)
+	rc = buffer_append (out, ", ", 2);
+      if (rc)
+	break;
+
+      if (NO_VALUE == b->fields[i].value)
+	{
+	  rc = buffer_append (out, "NULL", 4);
+	  continue;
+	}
+
+      value = b->values.data + b->fields[i].value;
+      rc = buffer_reserve (escaped, strlen (value) * 2 + 1);
+      if (!rc)
+	rc = b->be->escape (srv, value, escaped->data);
+      if (!rc)
+	rc = buffer_append (out, "'", 1);
+      if (!rc)
+	rc = buffer_append_str (out, escaped->data);
+      if (!rc)
+	rc = buffer_append (out, "'", 1);
+    }
+
+  if (!rc)
+    rc = buffer_append (out, ")", 1);
+
+  return rc;
+}
+
+/* Inserts the rows with multi-row INSERT statements. Each statement stands
+   alone, so the batches before a failure are kept. */
+static int
+insert_rows (sqon_DatabaseServer *srv, const char *table, const char *columns,
+	     struct bulk *b)
+{
+  int rc = 0;
+  size_t n;
+  bool more = true;
+  struct buffer sql, escaped;
+
+  buffer_init (&sql);
+  buffer_init (&escaped);
+
+  while (!rc && more)
+    {
+      sql.len = 0;
+      rc = buffer_append_str (&sql, "INSERT INTO ");
+      if (!rc)
+	rc = buffer_append_str (&sql, table);
+      if (!rc)
+	rc = buffer_append (&sql, " ", 1);
+      if (!rc)
+	rc = buffer_append_str (&sql, columns);
+      if (!rc)
+	rc = buffer_append_str (&sql, " VALUES ");
+
+      for (n = 0; !rc && n < BATCH_ROWS && sql.len < BATCH_BYTES; ++n)
+	{
+	  rc = fetch (b);
+	  if (rc <= 0)
+	    {
+	      more = false;
+	      break;
+	    }
+
+	  rc = n ? buffer_append (&sql, ", ", 2) : 0;
+	  if (!rc)
+	    rc = append_values (srv, b, &sql, &escaped);
+
+	  b->ready = false;
+	}
+
+      if (!rc && n)
+	rc = buffer_append (&sql, "", 1);
+      if (!rc && n)
+	rc = b->be->query (srv, sql.data, NULL);
+    }
+
+  buffer_free (&sql);
+  buffer_free (&escaped);
+  return rc;
+}
+
+static size_t
+read_string_input (char *buf, size_t len, void *userdata)
+{
+  struct string_input *in = userdata;
+
+  if (len > in->left)
+    len = in->left;
+
+  memcpy (buf, in->s, len);
+  in->s += len;
+  in->left -= len;
+  return len;
+}
+
+int
+sqon_bulk_insert (sqon_DatabaseServer *srv, const char *table,
+		  const char *json)
+{
+  struct string_input in = { json, strlen (json) };
+
+  return sqon_bulk_insert_stream (srv, table, read_string_input, &in);
+}
+
+int
+sqon_bulk_insert_stream (sqon_DatabaseServer *srv, const char *table,
+			 sqon_ReadCallback read, void *userdata)
+{
+  int rc;
+  const struct backend *be = backend_get (srv->type);
+  struct bulk b;
+  struct buffer columns;
+
+  if (NULL == be)
+    return SQON_UNSUPPORTED;
+
+  /* the first row names the columns before anything is sent */
+  bulk_init (&b, be, read, userdata);
+  rc = fetch (&b);
+  if (rc <= 0)
+    {
+      bulk_free (&b);
+      return rc;
+    }
+
+  buffer_init (&columns);
+  rc = append_columns (&b, &columns);
+  if (!rc)
+    rc = buffer_append (&columns, "", 1);
+  if (!rc)
+    rc = sqon_connect (srv);
+
+  if (!rc)
+    {
+      rc = be->bulk_load ? be->bulk_load (srv, table, columns.data, &b)
+	: SQON_UNSUPPORTED;
+
+      /* the engine would not take the fast way, having read nothing */
+      if (SQON_UNSUPPORTED == rc)
+	rc = insert_rows (srv, table, columns.data, &b);
+
+      sqon_close (srv);
+    }
+
+  buffer_free (&columns);
+  bulk_free (&b);
+  return rc;
+}
@@ -0,0 +1,38 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DELWINK_SQON_BULK_H
+#define DELWINK_SQON_BULK_H
+
+#include <stddef.h>
+
+#include "buffer.h"
+
+/* Rows being read from JSON for sqon_bulk_insert() */
+struct bulk;
+
+/* Bytes of tab-separated text handed to the server at a time */
+#define BULK_CHUNK 65536
+
+/* Appends rows to out, one line each with fields separated by tabs, until it
+   holds at least min bytes or the rows run out; nothing is appended after
+   the last row. NULL is \N and backslash, tab, newline and carriage return
+   are escaped with a backslash, which both COPY and LOAD DATA read. */
+int
+bulk_read_lines (struct bulk *b, struct buffer *out, size_t min);
+
+#endif
@@ -0,0 +1,435 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "buffer.h"
+#include "keyset.h"
+#include "sqon.h"
+
+#define MIN_BUCKETS 64
+
+/* An entry and its key, JSON and tag are one allocation, in that order. The
+   key is the server's identity, the output flags, the query and the primary
+   key, each terminated by a NUL. */
+struct cache_entry
+{
+  uint64_t hash;
+  const char *key;
+  size_t key_len;
+  const char *query;
+  const char *json;
+  size_t json_len;
+  const char *tag;
+  int64_t expires;
+  size_t bytes;
+  struct cache_entry *chain;
+  /* most recently used first */
+  struct cache_entry *prev;
+  struct cache_entry *next;
+};
+
+struct sqon_cache
+{
+  pthread_mutex_t lock;
+  struct cache_entry **buckets;
+  size_t num_buckets;
+  size_t count;
+  struct cache_entry *head;
+  struct cache_entry *tail;
+  size_t bytes;
+  size_t max_bytes;
+  unsigned int ttl_ms;
+  /* bumped by every invalidation, so a result which was being fetched while
+     one happened is not stored */
+  uint64_t generation;
+};
+
+static int64_t
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+sqon_Cache *
+sqon_cache_new (size_t max_bytes, unsigned int ttl_ms)
+{
+  sqon_Cache *cache = sqon_malloc (sizeof (sqon_Cache));
+  if (NULL == cache)
+    return NULL;
+
+  cache->buckets = sqon_malloc (MIN_BUCKETS * sizeof (struct cache_entry *));
+  if (NULL == cache->buckets)
+    {
+      sqon_free (cache);
+      return NULL;
+    }
+
+  memset (cache->buckets, 0, MIN_BUCKETS * sizeof (struct cache_entry *));
+  cache->num_buckets = MIN_BUCKETS;
+  cache->count = 0;
+  cache->head = NULL;
+  cache->tail = NULL;
+  cache->bytes = 0;
+  cache->max_bytes = max_bytes;
+  cache->ttl_ms = ttl_ms;
+  cache->generation = 0;
+
+  pthread_mutex_init (&cache->lock, NULL);
+  return cache;
+}
+
+/* Must be called with the lock held. */
+static void
+unlink_lru (sqon_Cache *cache, struct cache_entry *e)
+{
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    cache->head = e->next;
+
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    cache->tail = e->prev;
+}
+
+/* Must be called with the lock held. */
+static void
+push_lru (sqon_Cache *cache, struct cache_entry *e)
+{
+  e->prev = NULL;
+  e->next = cache->head;
+
+  if (cache->head)
+    cache->head->prev = e;
+  else
+    cache->tail = e;
+
+  cache->head = e;
+}
+
+/* Must be called with the lock held. */
+static void
+remove_entry (sqon_Cache *cache, struct cache_entry *e)
+{
+  size_t i = e->hash & (cache->num_buckets - 1);
+  struct cache_entry **p = &cache->buckets[i];
+
+  while (*p != e)
+    p = &(*p)->chain;
+  *p = e->chain;
+
+  unlink_lru (cache, e);
+  cache->bytes -= e->bytes;
+  --cache->count;
+  sqon_free (e);
+}
+
+void
+sqon_cache_free (sqon_Cache *cache)
+{
+  while (cache->head)
+    remove_entry (cache, cache->head);
+
+  pthread_mutex_destroy (&cache->lock);
+  sqon_free (cache->buckets);
+  sqon_free (cache);
+}
+
+/* Must be called with the lock held. Failing to grow only makes the chains
+   longer. */
+static void
+grow (sqon_Cache *cache)
+{
+  size_t i, size = cache->num_buckets * 2;
+  struct cache_entry **buckets;
+
+  if (size > SIZE_MAX / sizeof (struct cache_entry *))
+    return;
+
+  buckets = sqon_malloc (size * sizeof (struct cache_entry *));
+  if (NULL == buckets)
+    return;
+
+  memset (buckets, 0, size * sizeof (struct cache_entry *));
+
+  for (i = 0; i < cache->num_buckets; ++i)
+    {
+      struct cache_entry *e = cache->buckets[i], *next;
+
+      for (; e; e = next)
+	{
+	  next = e->chain;
+	  e->chain = buckets[e->hash & (size - 1)];
+	  buckets[e->hash & (size - 1)] = e;
+	}
+    }
+
+  sqon_free (cache->buckets);
+  cache->buckets = buckets;
+  cache->num_buckets = size;
+}
+
+/* Must be called with the lock held. */
+static struct cache_entry *
+find (sqon_Cache *cache, uint64_t hash, const char *key, size_t key_len)
+{
+  struct cache_entry *e = cache->buckets[hash & (cache->num_buckets - 1)];
+
+  for (; e; e = e->chain)
+    if (e->hash == hash && e->key_len == key_len
+	&& !memcmp (e->key, key, key_len))
+      return e;
+
+  return NULL;
+}
+
+static int
+append_field (struct buffer *buf, const char *s)
+{
+  return buffer_append (buf, s ? s : "", (s ? strlen (s) : 0) + 1);
+}
+
+/* Results depend on where the query ran and on the output flags as much as
+   on its text. *query_off is set to where the query starts in the key, for
+   invalidating by prefix. */
+static int
+make_key (struct buffer *buf, const sqon_DatabaseServer *srv,
+	  const char *query, const char *pk, size_t *query_off)
+{
+  int rc;
+  char flags[sizeof srv->output + 1];
+
+  flags[0] = (char) srv->type;
+  memcpy (flags + 1, &srv->output, sizeof srv->output);
+
+  rc = buffer_append (buf, flags, sizeof flags);
+  if (!rc)
+    rc = append_field (buf, srv->host);
+  if (!rc)
+    rc = append_field (buf, srv->port);
+  if (!rc)
+    rc = append_field (buf, srv->database);
+  if (!rc)
+    rc = append_field (buf, srv->user);
+
+  *query_off = buf->len;
+  if (!rc)
+    rc = append_field (buf, query);
+  if (!rc)
+    rc = append_field (buf, pk);
+
+  return rc;
+}
+
+/* Copies a live entry's JSON to *out, if there is one. *gen is set to the
+   cache's generation, for storing the result of a miss. */
+static int
+lookup (sqon_Cache *cache, const struct buffer *key, uint64_t hash,
+	char **out, uint64_t *gen)
+{
+  int rc = 1;
+  struct cache_entry *e;
+
+  pthread_mutex_lock (&cache->lock);
+
+  *gen = cache->generation;
+
+  e = find (cache, hash, key->data, key->len);
+  if (e && e->expires && now_ms () >= e->expires)
+    {
+      remove_entry (cache, e);
+      e = NULL;
+    }
+
+  if (e)
+    {
+      unlink_lru (cache, e);
+      push_lru (cache, e);
+
+      *out = sqon_malloc (e->json_len + 1);
+      if (NULL == *out)
+	{
+	  rc = SQON_MEMORYERROR;
+	}
+      else
+	{
+	  memcpy (*out, e->json, e->json_len + 1);
+	  rc = 0;
+	}
+    }
+
+  pthread_mutex_unlock (&cache->lock);
+  return rc;
+}
+
+/* Drops the result if the cache was invalidated after gen was read, since it
+   may have been fetched before the change the invalidation was for. */
+static void
+store (sqon_Cache *cache, const struct buffer *key, uint64_t hash,
+       size_t query_off, const char *json, const char *tag,
+       unsigned int ttl_ms, uint64_t gen)
+{
+  struct cache_entry *e, *old;
+  size_t json_len = strlen (json);
+  size_t tag_len = tag ? strlen (tag) + 1 : 0;
+  size_t bytes = sizeof (struct cache_entry) + key->len + json_len + 1
+    + tag_len;
+  char *p;
+
+  if (bytes > cache->max_bytes)
+    return;
+
+  e = sqon_malloc (bytes);
+  if (NULL == e)
+    return;
+
+  p = (char *) (e + 1);
+  memcpy (p, key->data, key->len);
+  e->key = p;
+  e->key_len = key->len;
+  e->query = p + query_off;
+  p += key->len;
+
+  memcpy (p, json, json_len + 1);
+  e->json = p;
+  e->json_len = json_len;
+  p += json_len + 1;
+
+  e->tag = NULL;
+  if (tag)
+    {
+      memcpy (p, tag, tag_len);
+      e->tag = p;
+    }
+
+  e->hash = hash;
+  e->bytes = bytes;
+  e->expires = ttl_ms ? now_ms () + ttl_ms : 0;
+
+  pthread_mutex_lock (&cache->lock);
+
+  if (cache->generation != gen)
+    {
+      pthread_mutex_unlock (&cache->lock);
+      sqon_free (e);
+      return;
+    }
+
+  /* another thread may have stored the same query meanwhile */
+  old = find (cache, hash, key->data, key->len);
+  if (old)
+    remove_entry (cache, old);
+
+  while (cache->bytes + bytes > cache->max_bytes)
+    remove_entry (cache, cache->tail);
+
+  if (cache->count >= cache->num_buckets)
+    grow (cache);
+
+  e->chain = cache->buckets[hash & (cache->num_buckets - 1)];
+  cache->buckets[hash & (cache->num_buckets - 1)] = e;
+  push_lru (cache, e);
+  cache->bytes += bytes;
+  ++cache->count;
+
+  pthread_mutex_unlock (&cache->lock);
+}
+
+int
+sqon_query_cached (sqon_DatabaseServer *srv, sqon_Cache *cache,
+		   const char *query, char **out, const char *pk,
+		   const char *tag, unsigned int ttl_ms)
+{
+  int rc;
+  size_t query_off;
+  uint64_t hash, gen;
+  struct buffer key;
+
+  if (NULL == out)
+    return SQON_BADPARAMS;
+
+  buffer_init (&key);
+  rc = make_key (&key, srv, query, pk, &query_off);
+  if (rc)
+    {
+      buffer_free (&key);
+      return rc;
+    }
+
+  hash = keyset_hash (key.data, key.len);
+
+  rc = lookup (cache, &key, hash, out, &gen);
+  if (rc <= 0)
+    {
+      buffer_free (&key);
+      return rc;
+    }
+
+  rc = sqon_query (srv, query, out, pk);
+  if (!rc)
+    store (cache, &key, hash, query_off, *out, tag,
+	   ttl_ms ? ttl_ms : cache->ttl_ms, gen);
+
+  buffer_free (&key);
+  return rc;
+}
+
+void
+sqon_cache_invalidate (sqon_Cache *cache, const char *prefix)
+{
+  struct cache_entry *e, *next;
+  size_t len = prefix ? strlen (prefix) : 0;
+
+  pthread_mutex_lock (&cache->lock);
+
+  ++cache->generation;
+  for (e = cache->head; e; e = next)
+    {
+      next = e->next;
+      if (!strncmp (e->query, prefix ? prefix : "", len))
+	remove_entry (cache, e);
+    }
+
+  pthread_mutex_unlock (&cache->lock);
+}
+
+void
+sqon_cache_invalidate_tag (sqon_Cache *cache, const char *tag)
+{
+  struct cache_entry *e, *next;
+
+  pthread_mutex_lock (&cache->lock);
+
+  ++cache->generation;
+  for (e = cache->head; e; e = next)
+    {
+      next = e->next;
+      if (e->tag && !strcmp (e->tag, tag))
+	remove_entry (cache, e);
+    }
+
+  pthread_mutex_unlock (&cache->lock);
+}
@@ -0,0 +1,502 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "backend.h"
+#include "sqon.h"
+
+#define MIN_REPLICAS 4
+
+/* how often a replica's lag is measured, and how long one which could not
+   be used is passed over */
+#define CHECK_INTERVAL_MS 1000
+
+/* each query time moves a member's average latency by 1/LATENCY_WEIGHT of
+   the difference */
+#define LATENCY_WEIGHT 5
+
+struct member
+{
+  sqon_Pool *pool;
+  unsigned int in_flight;
+  /* average query time in milliseconds; 0 until one has been seen */
+  double latency_ms;
+  int64_t checked_at;
+  bool usable;
+};
+
+/* A connection handed out, and the member it came from */
+struct lease
+{
+  sqon_DatabaseServer *srv;
+  struct member *m;
+  struct lease *next;
+};
+
+struct sqon_cluster
+{
+  pthread_mutex_t lock;
+  struct member primary;
+  struct member **replicas;
+  size_t num_replicas;
+  size_t cap;
+  size_t max_size;
+  unsigned int max_lag_ms;
+  struct lease *leases;
+};
+
+static int64_t
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static double
+elapsed_ms (const struct timespec *since)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (double) (now.tv_sec - since->tv_sec) * 1000
+    + (double) (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static int
+init_member (struct member *m, const sqon_DatabaseServer *srv,
+	     size_t max_size)
+{
+  /* connections are opened as they are first needed */
+  m->pool = sqon_pool_new (srv, 0, max_size, 0);
+  if (NULL == m->pool)
+    return SQON_MEMORYERROR;
+
+  m->in_flight = 0;
+  m->latency_ms = 0;
+  m->checked_at = 0;
+  m->usable = true;
+  return 0;
+}
+
+sqon_Cluster *
+sqon_cluster_new (const sqon_DatabaseServer *primary, size_t max_size,
+		  unsigned int max_lag_ms)
+{
+  sqon_Cluster *c = sqon_malloc (sizeof (sqon_Cluster));
+  if (NULL == c)
+    return NULL;
+
+  if (init_member (&c->primary, primary, max_size))
+    {
+      sqon_free (c);
+      return NULL;
+    }
+
+  c->replicas = NULL;
+  c->num_replicas = 0;
+  c->cap = 0;
+  c->max_size = max_size;
+  c->max_lag_ms = max_lag_ms;
+  c->leases = NULL;
+
+  pthread_mutex_init (&c->lock, NULL);
+  return c;
+}
+
+void
+sqon_cluster_free (sqon_Cluster *c)
+{
+  size_t i;
+
+  for (i = 0; i < c->num_replicas; ++i)
+    {
+      sqon_pool_free (c->replicas[i]->pool);
+      sqon_free (c->replicas[i]);
+    }
+
+  if (c->replicas)
+    sqon_free (c->replicas);
+
+  sqon_pool_free (c->primary.pool);
+  pthread_mutex_destroy (&c->lock);
+  sqon_free (c);
+}
+
+int
+sqon_cluster_add_replica (sqon_Cluster *c, const sqon_DatabaseServer *replica)
+{
+  int rc;
+  struct member *m, **replicas;
+
+  m = sqon_malloc (sizeof (struct member));
+  if (NULL == m)
+    return SQON_MEMORYERROR;
+
+  rc = init_member (m, replica, c->max_size);
+  if (rc)
+    {
+      sqon_free (m);
+      return rc;
+    }
+
+  pthread_mutex_lock (&c->lock);
+
+  if (c->num_replicas == c->cap)
+    {
+      size_t cap = c->cap ? c->cap * 2 : MIN_REPLICAS;
+
+      replicas = sqon_malloc (cap * sizeof (struct member *));
+      if (NULL == replicas)
+	{
+	  pthread_mutex_unlock (&c->lock);
+	  sqon_pool_free (m->pool);
+	  sqon_free (m);
+	  return SQON_MEMORYERROR;
+	}
+
+      if (c->replicas)
+	{
+	  memcpy (replicas, c->replicas,
+		  c->num_replicas * sizeof (struct member *));
+	  sqon_free (c->replicas);
+	}
+
+      c->replicas = replicas;
+      c->cap = cap;
+    }
+
+  c->replicas[c->num_replicas++] = m;
+  pthread_mutex_unlock (&c->lock);
+  return 0;
+}
+
+/* The replica expected to answer soonest: the lowest average latency,
+   scaled by the queries already waiting on it. Must be called with the lock
+   held; NULL if none can be used. */
+static struct member *
+choose_replica (sqon_Cluster *c)
+{
+  size_t i;
+  int64_t now = now_ms ();
+  double score, best_score = 0;
+  struct member *best = NULL;
+
+  for (i = 0; i < c->num_replicas; ++i)
+    {
+      struct member *m = c->replicas[i];
+
+      if (!m->usable && now - m->checked_at < CHECK_INTERVAL_MS)
+	continue;
+
+      score = (m->latency_ms + 1) * (m->in_flight + 1);
+      if (NULL == best || score < best_score)
+	{
+	  best = m;
+	  best_score = score;
+	}
+    }
+
+  return best;
+}
+
+/* Whether a replica is close enough behind the primary to read from,
+   measured on srv if its last measurement is out of date */
+static bool
+fresh (sqon_Cluster *c, struct member *m, sqon_DatabaseServer *srv)
+{
+  int64_t lag, now = now_ms ();
+  const struct backend *b = backend_get (srv->type);
+  bool due, usable;
+
+  if (!c->max_lag_ms || NULL == b->replica_lag)
+    return true;
+
+  /* one thread measures while the others go by the last measurement */
+  pthread_mutex_lock (&c->lock);
+  due = (now - m->checked_at >= CHECK_INTERVAL_MS);
+  if (due)
+    m->checked_at = now;
+  usable = m->usable;
+  pthread_mutex_unlock (&c->lock);
+
+  if (!due)
+    return usable;
+
+  if (b->replica_lag (srv, &lag))
+    return false;
+
+  return lag >= 0 && lag <= (int64_t) c->max_lag_ms;
+}
+
+int
+sqon_cluster_acquire (sqon_Cluster *c, enum sqon_route route,
+		      sqon_DatabaseServer **out, long timeout_ms)
+{
+  int rc;
+  bool replica_ok = (SQON_ROUTE_READ == route);
+  struct member *m;
+  struct lease *l = sqon_malloc (sizeof (struct lease));
+
+  if (NULL == l)
+    return SQON_MEMORYERROR;
+
+  pthread_mutex_lock (&c->lock);
+
+  for (;;)
+    {
+      m = replica_ok ? choose_replica (c) : NULL;
+      if (NULL == m)
+	m = &c->primary;
+
+      ++m->in_flight;
+      pthread_mutex_unlock (&c->lock);
+
+      rc = sqon_pool_acquire (m->pool, out, timeout_ms);
+      if (!rc && m != &c->primary && !fresh (c, m, *out))
+	{
+	  sqon_pool_release (m->pool, *out);
+	  rc = SQON_CONNECTERR;
+	}
+
+      pthread_mutex_lock (&c->lock);
+
+      if (m != &c->primary)
+	{
+	  m->usable = !rc || SQON_TIMEOUT == rc;
+	  if (rc)
+	    m->checked_at = now_ms ();
+	}
+
+      if (!rc)
+	break;
+
+      --m->in_flight;
+
+      if (m == &c->primary)
+	{
+	  pthread_mutex_unlock (&c->lock);
+	  sqon_free (l);
+	  return rc;
+	}
+
+      /* the primary can serve any read, rather than waiting again on a
+	 busy replica */
+      if (SQON_TIMEOUT == rc)
+	replica_ok = false;
+    }
+
+  l->srv = *out;
+  l->m = m;
+  l->next = c->leases;
+  c->leases = l;
+
+  pthread_mutex_unlock (&c->lock);
+  return 0;
+}
+
+/* Hands a connection back; sample_ms is how long a query on it took, or
+   negative if it was not timed. */
+static void
+release (sqon_Cluster *c, sqon_DatabaseServer *srv, double sample_ms)
+{
+  struct lease **p, *l;
+  struct member *m;
+
+  pthread_mutex_lock (&c->lock);
+
+  for (p = &c->leases; *p && (*p)->srv != srv; p = &(*p)->next)
+    ;
+
+  l = *p;
+  if (NULL == l)
+    {
+      pthread_mutex_unlock (&c->lock);
+      return;
+    }
+
+  *p = l->next;
+  m = l->m;
+  --m->in_flight;
+
+  if (sample_ms >= 0)
+    {
+      if (m->latency_ms)
+	m->latency_ms += (sample_ms - m->latency_ms) / LATENCY_WEIGHT;
+      else
+	m->latency_ms = sample_ms;
+    }
+
+  pthread_mutex_unlock (&c->lock);
+
+  sqon_pool_release (m->pool, srv);
+  sqon_free (l);
+}
+
+void
+sqon_cluster_release (sqon_Cluster *c, sqon_DatabaseServer *srv)
+{
+  release (c, srv, -1);
+}
+
+/* Finds the next word outside quotes and comments, and moves *p past it;
+   a semicolon counts as a word. Returns 0 at the end of the query. */
+static size_t
+next_word (const char **p, const char **word)
+{
+  const char *s = *p;
+  char quote;
+
+  while (*s)
+    {
+      if ('\'' == *s || '"' == *s || '`' == *s)
+	{
+	  quote = *s++;
+	  while (*s && *s != quote)
+	    ++s;
+
+	  if (*s)
+	    ++s;
+	}
+      else if ('-' == s[0] && '-' == s[1])
+	{
+	  while (*s && *s != '\n')
+	    ++s;
+	}
+      else if ('/' == s[0] && '*' == s[1])
+	{
+	  s = strstr (s + 2, "*/");
+	  if (NULL == s)
+	    break;
+
+	  s += 2;
+	}
+      else if (isalpha ((unsigned char) *s) || '_' == *s || ';' == *s)
+	{
+	  *word = s++;
+
+	  if (';' != **word)
+	    while (isalnum ((unsigned char) *s) || '_' == *s || '$' == *s)
+	      ++s;
+
+	  *p = s;
+	  return (size_t) (s - *word);
+	}
+      else
+	{
+	  ++s;
+	}
+    }
+
+  *p = "";
+  return 0;
+}
+
+static bool
+word_in (const char *word, size_t len, const char *const *list)
+{
+  for (; *list; ++list)
+    if (strlen (*list) == len && !strncasecmp (word, *list, len))
+      return true;
+
+  return false;
+}
+
+static const char *const read_words[] = {
+  "SELECT", "SHOW", "EXPLAIN", "DESCRIBE", "DESC", "VALUES", "TABLE", "WITH",
+  NULL
+};
+
+/* words which make a statement that otherwise reads change something, or
+   take locks which only mean anything on the primary */
+static const char *const write_words[] = {
+  "INSERT", "UPDATE", "DELETE", "MERGE", "INTO", "SHARE", "LOCK", "ANALYZE",
+  "NEXTVAL", "SETVAL", NULL
+};
+
+static const char *const transaction_words[] = {
+  "BEGIN", "START", "COMMIT", "ROLLBACK", "SAVEPOINT", "END", NULL
+};
+
+/* Reads go to replicas when nothing in the statement suggests it writes;
+   anything unsure goes to the primary. */
+static enum sqon_route
+classify (const char *query)
+{
+  const char *word = "";
+  size_t len;
+  bool ended = false;
+
+  /* whether a backslash in a string escapes the next character depends on
+     the server and its settings, so where the strings end is not known */
+  if (strchr (query, '\\'))
+    return SQON_ROUTE_WRITE;
+
+  len = next_word (&query, &word);
+  if (!word_in (word, len, read_words))
+    return SQON_ROUTE_WRITE;
+
+  while ((len = next_word (&query, &word)))
+    {
+      /* a second statement */
+      if (ended || word_in (word, len, write_words))
+	return SQON_ROUTE_WRITE;
+
+      if (';' == *word)
+	ended = true;
+    }
+
+  return SQON_ROUTE_READ;
+}
+
+int
+sqon_cluster_query (sqon_Cluster *c, const char *query, char **out,
+		    const char *primary_key, enum sqon_route route)
+{
+  int rc;
+  const char *p = query, *word = "";
+  size_t len = next_word (&p, &word);
+  sqon_DatabaseServer *srv;
+  struct timespec start;
+
+  /* each query may get a different connection, so a transaction begun here
+     would be left open on one of them */
+  if (word_in (word, len, transaction_words))
+    return SQON_BADPARAMS;
+
+  if (SQON_ROUTE_AUTO == route)
+    route = classify (query);
+
+  rc = sqon_cluster_acquire (c, route, &srv, -1);
+  if (rc)
+    return rc;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  rc = sqon_query (srv, query, out, primary_key);
+
+  release (c, srv, elapsed_ms (&start));
+  return rc;
+}
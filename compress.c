@@ -0,0 +1,158 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <limits.h>
+#include <stdint.h>
+
+#include "compress.h"
+#include "sqon.h"
+
+static voidpf
+zalloc_sqon (voidpf opaque, uInt items, uInt size)
+{
+  (void) opaque;
+
+  if (size && items > SIZE_MAX / size)
+    return Z_NULL;
+
+  return sqon_malloc ((size_t) items * size);
+}
+
+static void
+zfree_sqon (voidpf opaque, voidpf address)
+{
+  (void) opaque;
+  sqon_free (address);
+}
+
+void
+compressor_clear (struct compressor *c)
+{
+  c->active = false;
+  c->out = NULL;
+}
+
+int
+compressor_init (struct compressor *c, uint8_t format, int level)
+{
+  int rc, bits;
+
+  switch (format)
+    {
+    case SQON_COMPRESS_DEFLATE:
+      bits = MAX_WBITS;
+      break;
+
+    case SQON_COMPRESS_GZIP:
+      /* zlib's way of asking for a gzip header and trailer */
+      bits = MAX_WBITS + 16;
+      break;
+
+    default:
+      return SQON_BADPARAMS;
+    }
+
+  c->out = sqon_malloc (COMPRESS_CHUNK);
+  if (NULL == c->out)
+    return SQON_MEMORYERROR;
+
+  c->z.zalloc = zalloc_sqon;
+  c->z.zfree = zfree_sqon;
+  c->z.opaque = Z_NULL;
+
+  rc = deflateInit2 (&c->z, level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY);
+  if (rc != Z_OK)
+    {
+      sqon_free (c->out);
+      c->out = NULL;
+      return Z_MEM_ERROR == rc ? SQON_MEMORYERROR : SQON_BADPARAMS;
+    }
+
+  c->active = true;
+  return 0;
+}
+
+/* Feeds one piece of input through deflate(), handing on every full output
+   chunk; with Z_FINISH, also everything after it. */
+static int
+run (struct compressor *c, const char *data, uInt len, int flush,
+     sqon_StreamCallback cb, void *userdata)
+{
+  int rc;
+  size_t n;
+
+  c->z.next_in = (Bytef *) data;
+  c->z.avail_in = len;
+
+  do
+    {
+      c->z.next_out = (Bytef *) c->out;
+      c->z.avail_out = COMPRESS_CHUNK;
+
+      if (deflate (&c->z, flush) == Z_STREAM_ERROR)
+	return SQON_MEMORYERROR;
+
+      n = COMPRESS_CHUNK - c->z.avail_out;
+      if (n)
+	{
+	  rc = cb (c->out, n, userdata);
+	  if (rc)
+	    return rc;
+	}
+    }
+  while (!c->z.avail_out);
+
+  return 0;
+}
+
+int
+compressor_write (struct compressor *c, const char *data, size_t len,
+		  sqon_StreamCallback cb, void *userdata)
+{
+  int rc;
+
+  /* zlib counts in uInt */
+  while (len > UINT_MAX)
+    {
+      rc = run (c, data, UINT_MAX, Z_NO_FLUSH, cb, userdata);
+      if (rc)
+	return rc;
+
+      data += UINT_MAX;
+      len -= UINT_MAX;
+    }
+
+  return run (c, data, (uInt) len, Z_NO_FLUSH, cb, userdata);
+}
+
+int
+compressor_finish (struct compressor *c, sqon_StreamCallback cb,
+		   void *userdata)
+{
+  return run (c, "", 0, Z_FINISH, cb, userdata);
+}
+
+void
+compressor_free (struct compressor *c)
+{
+  if (!c->active)
+    return;
+
+  deflateEnd (&c->z);
+  sqon_free (c->out);
+  compressor_clear (c);
+}
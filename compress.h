@@ -0,0 +1,59 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DELWINK_SQON_COMPRESS_H
+#define DELWINK_SQON_COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "sqon.h"
+
+/* Compresses a stream of output chunks as they are written, handing the
+   compressed bytes on to a callback in pieces of at most COMPRESS_CHUNK. */
+#define COMPRESS_CHUNK 16384
+
+struct compressor
+{
+  bool active;
+  z_stream z;
+  char *out;
+};
+
+/* Inactive until compressor_init() succeeds */
+void
+compressor_clear (struct compressor *c);
+
+/* format is an enum sqon_compression; level as for zlib's deflateInit() */
+int
+compressor_init (struct compressor *c, uint8_t format, int level);
+
+int
+compressor_write (struct compressor *c, const char *data, size_t len,
+		  sqon_StreamCallback cb, void *userdata);
+
+/* Writes out what zlib holds back and the format's trailer. */
+int
+compressor_finish (struct compressor *c, sqon_StreamCallback cb,
+		   void *userdata);
+
+void
+compressor_free (struct compressor *c);
+
+#endif
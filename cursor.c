@@ -0,0 +1,234 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "backend.h"
+#include "buffer.h"
+#include "result.h"
+#include "sqon.h"
+
+#define DEFAULT_PAGE_ROWS 1000
+
+struct sqon_cursor
+{
+  sqon_DatabaseServer *srv;
+  const struct backend *be;
+  /* the backend's own */
+  void *state;
+  /* copied, as the cursor outlives the call which names it */
+  char *pk;
+  size_t page_rows;
+  bool done;
+};
+
+int
+sqon_cursor_open (sqon_DatabaseServer *srv, const char *query,
+		  const char *primary_key, size_t page_rows,
+		  sqon_Cursor **out)
+{
+  int rc;
+  size_t pk_size = primary_key ? strlen (primary_key) + 1 : 0;
+  sqon_Cursor *cur;
+
+  *out = NULL;
+
+  cur = sqon_malloc (sizeof *cur + pk_size);
+  if (NULL == cur)
+    return SQON_MEMORYERROR;
+
+  cur->srv = srv;
+  cur->pk = primary_key ? memcpy (cur + 1, primary_key, pk_size) : NULL;
+  cur->page_rows = page_rows ? page_rows : DEFAULT_PAGE_ROWS;
+  cur->done = false;
+
+  rc = sqon_connect (srv);
+  if (rc)
+    {
+      sqon_free (cur);
+      return rc;
+    }
+
+  cur->be = backend_get (srv->type);
+  rc = cur->be->cursor_open (srv, query, &cur->state);
+  if (rc)
+    {
+      sqon_close (srv);
+      sqon_free (cur);
+      return rc;
+    }
+
+  *out = cur;
+  return 0;
+}
+
+int
+sqon_cursor_fetch (sqon_Cursor *cur, char **out)
+{
+  int rc;
+  size_t rows = 0;
+  struct result_writer w;
+
+  *out = NULL;
+  if (cur->done)
+    return 0;
+
+  result_writer_init (&w, cur->srv->type, cur->pk, cur->srv->output);
+
+  rc = cur->be->cursor_fetch (cur->srv, cur->state, &w, cur->page_rows,
+			      &rows);
+  if (!rc)
+    {
+      /* a short page is the last; stepping past it could start over */
+      cur->done = rows < cur->page_rows;
+
+      if (rows)
+	{
+	  *out = buffer_finish (&w.buf);
+	  if (NULL == *out)
+	    rc = SQON_MEMORYERROR;
+	}
+    }
+
+  result_writer_free (&w);
+  return rc;
+}
+
+void
+sqon_cursor_close (sqon_Cursor *cur)
+{
+  if (NULL == cur)
+    return;
+
+  cur->be->cursor_close (cur->srv, cur->state);
+  sqon_close (cur->srv);
+  sqon_free (cur);
+}
+
+/* Wraps query to give the rows after the key after, in order of the key,
+   and no more than page_rows of them */
+static int
+page_query (sqon_DatabaseServer *srv, const struct backend *be,
+	    const char *query, const char *key, size_t page_rows,
+	    const char *after, struct buffer *sql)
+{
+  int rc;
+  char limit[32];
+  struct buffer escaped;
+
+  buffer_init (&escaped);
+
+  rc = buffer_append_str (sql, "SELECT * FROM (");
+  if (!rc)
+    rc = buffer_append_statement (sql, query);
+  /* on a line of its own, lest a comment ending the query swallow it */
+  if (!rc)
+    rc = buffer_append_str (sql, "\n) AS sqon_page WHERE ");
+  if (!rc)
+    rc = buffer_append_ident (sql, key, be->ident_quote);
+
+  if (!rc && after)
+    {
+      rc = buffer_reserve (&escaped, strlen (after) * 2 + 1);
+      if (!rc)
+	rc = be->escape (srv, after, escaped.data);
+      if (!rc)
+	rc = buffer_append_str (sql, " > '");
+      if (!rc)
+	rc = buffer_append_str (sql, escaped.data);
+      if (!rc)
+	rc = buffer_append (sql, "'", 1);
+    }
+  else if (!rc)
+    {
+      /* rows without a key have no place in the order to continue from */
+      rc = buffer_append_str (sql, " IS NOT NULL");
+    }
+
+  if (!rc)
+    rc = buffer_append_str (sql, " ORDER BY ");
+  if (!rc)
+    rc = buffer_append_ident (sql, key, be->ident_quote);
+
+  snprintf (limit, sizeof limit, " LIMIT %zu", page_rows);
+  if (!rc)
+    rc = buffer_append (sql, limit, strlen (limit) + 1);
+
+  buffer_free (&escaped);
+  return rc;
+}
+
+int
+sqon_query_page (sqon_DatabaseServer *srv, const char *query,
+		 const char *key, size_t page_rows, const char *after,
+		 char **out, char **next)
+{
+  int rc;
+  const struct backend *be;
+  struct buffer sql;
+  struct result_writer w;
+
+  *out = NULL;
+  *next = NULL;
+
+  if (NULL == key || !strcmp (key, ""))
+    return SQON_BADPARAMS;
+
+  if (!page_rows)
+    page_rows = DEFAULT_PAGE_ROWS;
+
+  rc = sqon_connect (srv);
+  if (rc)
+    return rc;
+
+  be = backend_get (srv->type);
+  buffer_init (&sql);
+  result_writer_init (&w, srv->type, key, srv->output);
+
+  rc = page_query (srv, be, query, key, page_rows, after, &sql);
+  if (!rc)
+    rc = be->query (srv, sql.data, &w);
+
+  /* the last key of a full page is where the next one starts */
+  if (!rc && w.num_rows == page_rows)
+    {
+      *next = sqon_malloc (w.keys.last_len + 1);
+      if (NULL == *next)
+	rc = SQON_MEMORYERROR;
+      else
+	memcpy (*next, w.keys.last, w.keys.last_len + 1);
+    }
+
+  if (!rc)
+    {
+      *out = buffer_finish (&w.buf);
+      if (NULL == *out)
+	rc = SQON_MEMORYERROR;
+    }
+
+  if (rc && *next)
+    {
+      sqon_free (*next);
+      *next = NULL;
+    }
+
+  result_writer_free (&w);
+  buffer_free (&sql);
+  sqon_close (srv);
+  return rc;
+}
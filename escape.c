@@ -0,0 +1,228 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+#include "escape.h"
+
+#ifdef ESCAPE_SSE2
+# include <emmintrin.h>
+#endif
+#ifdef ESCAPE_AVX2
+# include <immintrin.h>
+#endif
+
+size_t
+escape_utf8_len (const unsigned char *s, size_t n)
+{
+  size_t len, i;
+  uint32_t cp;
+
+  if (s[0] < 0x80)
+    return 1;
+  else if (s[0] < 0xC2)
+    return 0;
+  else if (s[0] < 0xE0)
+    {
+      len = 2;
+      cp = s[0] & 0x1F;
+    }
+  else if (s[0] < 0xF0)
+    {
+      len = 3;
+      cp = s[0] & 0x0F;
+    }
+  else if (s[0] < 0xF5)
+    {
+      len = 4;
+      cp = s[0] & 0x07;
+    }
+  else
+    {
+      return 0;
+    }
+
+  if (len > n)
+    return 0;
+
+  for (i = 1; i < len; ++i)
+    {
+      if ((s[i] & 0xC0) != 0x80)
+	return 0;
+
+      cp = (cp << 6) | (s[i] & 0x3F);
+    }
+
+  if ((len == 3 && cp < 0x800) || (len == 4 && cp < 0x10000)
+      || (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF)
+    return 0;
+
+  return len;
+}
+
+/* Steps over the valid UTF-8 sequences at p; stops at the first ASCII byte
+   or invalid sequence. */
+static const unsigned char *
+skip_utf8 (const unsigned char *p, const unsigned char *end)
+{
+  size_t len;
+
+  while (p < end && *p >= 0x80 && (len = escape_utf8_len (p, end - p)))
+    p += len;
+
+  return p;
+}
+
+const unsigned char *
+escape_scan_scalar (const unsigned char *p, const unsigned char *end)
+{
+  const unsigned char *next;
+
+  while (p < end)
+    {
+      if (*p >= 0x80)
+	{
+	  next = skip_utf8 (p, end);
+	  if (next == p)
+	    break;
+
+	  p = next;
+	}
+      else if (*p >= 0x20 && *p != '"' && *p != '\\')
+	{
+	  ++p;
+	}
+      else
+	{
+	  break;
+	}
+    }
+
+  return p;
+}
+
+#ifdef ESCAPE_SSE2
+/* A signed comparison against 0x20 catches both the control characters and
+   the bytes from 0x80 up, which are negative. ASCII is cleared a block at a
+   time; a non-ASCII run is validated in place, a sequence at a time, and the
+   block scan resumes after it. */
+const unsigned char *
+escape_scan_sse2 (const unsigned char *p, const unsigned char *end)
+{
+  const __m128i quote = _mm_set1_epi8 ('"');
+  const __m128i backslash = _mm_set1_epi8 ('\\');
+  const __m128i space = _mm_set1_epi8 (0x20);
+
+  while (end - p >= 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) p);
+      __m128i special = _mm_or_si128 (
+	_mm_or_si128 (_mm_cmpeq_epi8 (v, quote),
+		      _mm_cmpeq_epi8 (v, backslash)),
+	_mm_cmplt_epi8 (v, space));
+      int mask = _mm_movemask_epi8 (special);
+
+      if (mask)
+	{
+	  const unsigned char *next;
+
+	  p += __builtin_ctz ((unsigned int) mask);
+	  if (*p < 0x80)
+	    return p;
+
+	  next = skip_utf8 (p, end);
+	  if (next == p)
+	    return p;
+
+	  p = next;
+	  continue;
+	}
+
+      p += 16;
+    }
+
+  return escape_scan_scalar (p, end);
+}
+#endif
+
+#ifdef ESCAPE_AVX2
+__attribute__ ((target ("avx2")))
+const unsigned char *
+escape_scan_avx2 (const unsigned char *p, const unsigned char *end)
+{
+  const __m256i quote = _mm256_set1_epi8 ('"');
+  const __m256i backslash = _mm256_set1_epi8 ('\\');
+  const __m256i space = _mm256_set1_epi8 (0x20);
+
+  while (end - p >= 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) p);
+      __m256i special = _mm256_or_si256 (
+	_mm256_or_si256 (_mm256_cmpeq_epi8 (v, quote),
+			 _mm256_cmpeq_epi8 (v, backslash)),
+	_mm256_cmpgt_epi8 (space, v));
+      unsigned int mask = (unsigned int) _mm256_movemask_epi8 (special);
+
+      if (mask)
+	{
+	  const unsigned char *next;
+
+	  p += __builtin_ctz (mask);
+	  if (*p < 0x80)
+	    return p;
+
+	  next = skip_utf8 (p, end);
+	  if (next == p)
+	    return p;
+
+	  p = next;
+	  continue;
+	}
+
+      p += 32;
+    }
+
+  return escape_scan_sse2 (p, end);
+}
+#endif
+
+typedef const unsigned char *(*scan_fn) (const unsigned char *,
+					 const unsigned char *);
+
+#ifdef ESCAPE_SSE2
+static scan_fn scan = escape_scan_sse2;
+#else
+static scan_fn scan = escape_scan_scalar;
+#endif
+
+#ifdef ESCAPE_AVX2
+/* Picked once at load time, before any thread can be scanning */
+__attribute__ ((constructor))
+static void
+choose_scan (void)
+{
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    scan = escape_scan_avx2;
+}
+#endif
+
+const unsigned char *
+escape_scan (const unsigned char *p, const unsigned char *end)
+{
+  return scan (p, end);
+}
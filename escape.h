@@ -0,0 +1,61 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DELWINK_SQON_ESCAPE_H
+#define DELWINK_SQON_ESCAPE_H
+
+#include <stddef.h>
+
+/* Which vector versions of the scan this build has */
+#if defined (__GNUC__) && defined (__SSE2__)
+# define ESCAPE_SSE2 1
+# if defined (__x86_64__) || defined (__i386__)
+#  define ESCAPE_AVX2 1
+# endif
+#endif
+
+/* Returns the first byte in [p, end) which cannot be copied into a JSON
+   string as it is: a quote, a backslash, a control character or the start of
+   an invalid UTF-8 sequence. Valid multibyte sequences are part of the clean
+   span. Returns end if there is none. Uses the widest vector instructions the
+   CPU has; those test ASCII bytes a block at a time, but each multibyte
+   sequence is still validated on its own. */
+const unsigned char *
+escape_scan (const unsigned char *p, const unsigned char *end);
+
+/* The same, one byte at a time; the reference for the vector versions. */
+const unsigned char *
+escape_scan_scalar (const unsigned char *p, const unsigned char *end);
+
+#ifdef ESCAPE_SSE2
+const unsigned char *
+escape_scan_sse2 (const unsigned char *p, const unsigned char *end);
+#endif
+
+/* Only to be called when the CPU supports AVX2 */
+#ifdef ESCAPE_AVX2
+const unsigned char *
+escape_scan_avx2 (const unsigned char *p, const unsigned char *end);
+#endif
+
+/* Returns the length of the UTF-8 sequence at s, of which n bytes are
+   available, or 0 if it is invalid. The rules are the same ones jansson
+   applies to json_string(). */
+size_t
+escape_utf8_len (const unsigned char *s, size_t n);
+
+#endif
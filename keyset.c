@@ -0,0 +1,171 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "keyset.h"
+#include "sqon.h"
+
+#define MIN_SLOTS 64
+
+uint64_t
+keyset_hash (const char *key, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+
+  while (len--)
+    {
+      h ^= (unsigned char) *key++;
+      h *= 1099511628211ULL;
+    }
+
+  return h;
+}
+
+void
+keyset_init (struct keyset *set, struct arena *arena)
+{
+  set->slots = NULL;
+  set->size = 0;
+  set->used = 0;
+  set->arena = arena;
+  set->last = NULL;
+  set->last_len = 0;
+}
+
+static int
+grow (struct keyset *set)
+{
+  size_t size = set->size ? set->size * 2 : MIN_SLOTS;
+  struct keyset_slot *slots;
+  size_t i;
+
+  if (size > SIZE_MAX / sizeof (struct keyset_slot))
+    return SQON_OVERFLOW;
+
+  /* the old table stays in the arena until the result is done */
+  slots = arena_alloc (set->arena, size * sizeof (struct keyset_slot));
+  if (NULL == slots)
+    return SQON_MEMORYERROR;
+
+  memset (slots, 0, size * sizeof (struct keyset_slot));
+
+  for (i = 0; i < set->size; ++i)
+    {
+      size_t j;
+
+      if (NULL == set->slots[i].key)
+	continue;
+
+      j = set->slots[i].hash & (size - 1);
+      while (slots[j].key)
+	j = (j + 1) & (size - 1);
+
+      slots[j] = set->slots[i];
+    }
+
+  set->slots = slots;
+  set->size = size;
+  return 0;
+}
+
+static const char *
+copy_key (struct keyset *set, const char *key, size_t len)
+{
+  char *out = arena_alloc (set->arena, len + 1);
+
+  if (NULL == out)
+    return NULL;
+
+  memcpy (out, key, len);
+  out[len] = '\0';
+  return out;
+}
+
+/* Adds the key with its hash already worked out */
+static int
+insert (struct keyset *set, uint64_t hash, const char *key, size_t len)
+{
+  size_t i;
+  int rc;
+
+  /* keep the load factor at or below one half */
+  if ((set->used + 1) * 2 > set->size)
+    {
+      rc = grow (set);
+      if (rc)
+	return rc;
+    }
+
+  i = hash & (set->size - 1);
+  while (set->slots[i].key)
+    {
+      if (set->slots[i].hash == hash && set->slots[i].len == len
+	  && !memcmp (set->slots[i].key, key, len))
+	return SQON_PKNOTUNIQUE;
+
+      i = (i + 1) & (set->size - 1);
+    }
+
+  set->slots[i].key = copy_key (set, key, len);
+  if (NULL == set->slots[i].key)
+    return SQON_MEMORYERROR;
+
+  set->slots[i].hash = hash;
+  set->slots[i].len = len;
+  ++set->used;
+
+  set->last = set->slots[i].key;
+  set->last_len = len;
+
+  return 0;
+}
+
+int
+keyset_add (struct keyset *set, const char *key, size_t len)
+{
+  return insert (set, keyset_hash (key, len), key, len);
+}
+
+int
+keyset_merge (struct keyset *set, const struct keyset *from)
+{
+  int rc = 0;
+  size_t i;
+  const char *last = set->last;
+  size_t last_len = set->last_len;
+
+  for (i = 0; !rc && i < from->size; ++i)
+    {
+      if (NULL == from->slots[i].key)
+	continue;
+
+      rc = insert (set, from->slots[i].hash, from->slots[i].key,
+		   from->slots[i].len);
+
+      /* the slots are not in the order the keys were added */
+      if (!rc && from->slots[i].key == from->last)
+	{
+	  last = set->last;
+	  last_len = set->last_len;
+	}
+    }
+
+  set->last = last;
+  set->last_len = last_len;
+  return rc;
+}
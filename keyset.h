@@ -0,0 +1,65 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DELWINK_SQON_KEYSET_H
+#define DELWINK_SQON_KEYSET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+struct keyset_slot
+{
+  uint64_t hash;
+  const char *key;
+  size_t len;
+};
+
+/* Set of primary key values seen in a result, used to reject duplicates
+   without building the whole result in memory. Keys are copied into the
+   arena, so the caller's row storage may be reused after keyset_add(); the
+   set's memory is released with the arena. */
+struct keyset
+{
+  struct keyset_slot *slots;
+  size_t size;
+  size_t used;
+  struct arena *arena;
+  /* copy of the key added last, such as to continue after it */
+  const char *last;
+  size_t last_len;
+};
+
+void
+keyset_init (struct keyset *set, struct arena *arena);
+
+/* Returns 0 if the key was added, SQON_PKNOTUNIQUE if it was already in the
+   set, or another negative error code on failure. */
+int
+keyset_add (struct keyset *set, const char *key, size_t len);
+
+/* Adds every key of from, which is left as it was, and its last key is
+   then the set's; fails as keyset_add() if one is already in the set. */
+int
+keyset_merge (struct keyset *set, const struct keyset *from);
+
+/* FNV-1a, as the set uses; also good enough for other tables of strings */
+uint64_t
+keyset_hash (const char *key, size_t len);
+
+#endif
@@ -0,0 +1,414 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "backend.h"
+#include "buffer.h"
+#include "meta.h"
+#include "sqon.h"
+
+/* Tables of one server, looked up by name; there are seldom enough of them
+   for a search by name to matter. */
+struct meta_cache
+{
+  struct table_meta *tables;
+  size_t count;
+  size_t cap;
+  unsigned int ttl;
+};
+
+static char *
+copy_str (const char *s)
+{
+  char *out = sqon_malloc ((strlen (s) + 1) * sizeof (char));
+
+  if (out)
+    strcpy (out, s);
+
+  return out;
+}
+
+static struct meta_cache *
+get_cache (sqon_DatabaseServer *srv)
+{
+  struct meta_cache *cache = srv->meta;
+
+  if (cache)
+    return cache;
+
+  cache = sqon_malloc (sizeof (struct meta_cache));
+  if (NULL == cache)
+    return NULL;
+
+  cache->tables = NULL;
+  cache->count = 0;
+  cache->cap = 0;
+  cache->ttl = 0;
+
+  srv->meta = cache;
+  return cache;
+}
+
+static void
+clear_meta (struct table_meta *m)
+{
+  size_t i;
+
+  for (i = 0; i < m->num_columns; ++i)
+    {
+      sqon_free (m->names[i]);
+      sqon_free (m->types[i]);
+    }
+
+  if (m->names)
+    sqon_free (m->names);
+  if (m->types)
+    sqon_free (m->types);
+  if (m->pk)
+    sqon_free (m->pk);
+  if (m->table)
+    sqon_free (m->table);
+
+  memset (m, 0, sizeof (struct table_meta));
+}
+
+int
+meta_add_column (struct table_meta *m, const char *name, const char *type,
+		 bool primary)
+{
+  size_t n = m->num_columns;
+
+  /* the arrays are sized by the caller */
+  m->names[n] = copy_str (name);
+  if (NULL == m->names[n])
+    return SQON_MEMORYERROR;
+
+  m->types[n] = copy_str (type ? type : "");
+  if (NULL == m->types[n])
+    {
+      sqon_free (m->names[n]);
+      return SQON_MEMORYERROR;
+    }
+
+  ++m->num_columns;
+
+  if (primary && NULL == m->pk)
+    return meta_set_pk (m, name);
+
+  return 0;
+}
+
+int
+meta_set_pk (struct table_meta *m, const char *name)
+{
+  if (m->pk)
+    sqon_free (m->pk);
+
+  m->pk = copy_str (name);
+  if (NULL == m->pk)
+    return SQON_MEMORYERROR;
+
+  return 0;
+}
+
+int
+meta_alloc_columns (struct table_meta *m, size_t n)
+{
+  m->names = sqon_malloc ((n ? n : 1) * sizeof (char *));
+  m->types = sqon_malloc ((n ? n : 1) * sizeof (char *));
+  if (NULL == m->names || NULL == m->types)
+    return SQON_MEMORYERROR;
+
+  return 0;
+}
+
+static int
+load_meta (sqon_DatabaseServer *srv, const char *table, struct table_meta *m)
+{
+  int rc;
+  char *query, *esc_table;
+  size_t qlen = 1;
+  const struct backend *b = backend_get (srv->type);
+  const char *fmt;
+
+  if (NULL == b)
+    return SQON_UNSUPPORTED;
+
+  fmt = b->meta_query;
+
+  rc = sqon_escape (srv, table, &esc_table, false);
+  if (rc)
+    return rc;
+
+  qlen += strlen (fmt);
+  qlen += strlen (esc_table);
+
+  query = sqon_malloc (qlen * sizeof (char));
+  if (NULL == query)
+    {
+      sqon_free (esc_table);
+      return SQON_MEMORYERROR;
+    }
+
+  rc = snprintf (query, qlen, fmt, esc_table);
+  sqon_free (esc_table);
+  if ((size_t) rc >= qlen)
+    {
+      sqon_free (query);
+      return SQON_OVERFLOW;
+    }
+
+  memset (m, 0, sizeof (struct table_meta));
+  m->table = copy_str (table);
+  if (NULL == m->table)
+    {
+      sqon_free (query);
+      return SQON_MEMORYERROR;
+    }
+
+  rc = b->load_meta (srv, query, m);
+
+  sqon_free (query);
+  if (rc)
+    clear_meta (m);
+  else
+    m->loaded = time (NULL);
+
+  return rc;
+}
+
+static struct table_meta *
+find_meta (struct meta_cache *cache, const char *table)
+{
+  size_t i;
+
+  for (i = 0; i < cache->count; ++i)
+    if (!strcmp (cache->tables[i].table, table))
+      return &cache->tables[i];
+
+  return NULL;
+}
+
+static bool
+is_fresh (const struct meta_cache *cache, const struct table_meta *m)
+{
+  return !cache->ttl || time (NULL) - m->loaded < (time_t) cache->ttl;
+}
+
+int
+meta_get (sqon_DatabaseServer *srv, const char *table,
+	  const struct table_meta **out)
+{
+  int rc;
+  struct table_meta *m;
+  struct meta_cache *cache = get_cache (srv);
+
+  if (NULL == cache)
+    return SQON_MEMORYERROR;
+
+  m = find_meta (cache, table);
+  if (m && is_fresh (cache, m))
+    {
+      *out = m;
+      return 0;
+    }
+
+  if (m)
+    {
+      /* expired; reload in place */
+      clear_meta (m);
+    }
+  else
+    {
+      if (cache->count == cache->cap)
+	{
+	  size_t cap = cache->cap ? cache->cap * 2 : 8;
+	  struct table_meta *tables = sqon_malloc (cap * sizeof (*tables));
+
+	  if (NULL == tables)
+	    return SQON_MEMORYERROR;
+
+	  if (cache->tables)
+	    {
+	      memcpy (tables, cache->tables,
+		      cache->count * sizeof (*tables));
+	      sqon_free (cache->tables);
+	    }
+
+	  cache->tables = tables;
+	  cache->cap = cap;
+	}
+
+      m = &cache->tables[cache->count++];
+    }
+
+  rc = load_meta (srv, table, m);
+  if (rc)
+    {
+      *m = cache->tables[--cache->count];
+      return rc;
+    }
+
+  *out = m;
+  return 0;
+}
+
+void
+meta_cache_free (sqon_DatabaseServer *srv)
+{
+  struct meta_cache *cache = srv->meta;
+
+  if (NULL == cache)
+    return;
+
+  sqon_invalidate_metadata (srv, NULL);
+
+  if (cache->tables)
+    sqon_free (cache->tables);
+
+  sqon_free (cache);
+  srv->meta = NULL;
+}
+
+void
+sqon_invalidate_metadata (sqon_DatabaseServer *srv, const char *table)
+{
+  struct meta_cache *cache = srv->meta;
+  size_t i = 0;
+
+  if (NULL == cache)
+    return;
+
+  while (i < cache->count)
+    {
+      if (NULL == table || !strcmp (cache->tables[i].table, table))
+	{
+	  clear_meta (&cache->tables[i]);
+	  cache->tables[i] = cache->tables[--cache->count];
+	}
+      else
+	{
+	  ++i;
+	}
+    }
+}
+
+void
+sqon_set_metadata_ttl (sqon_DatabaseServer *srv, unsigned int seconds)
+{
+  struct meta_cache *cache = get_cache (srv);
+
+  if (cache)
+    cache->ttl = seconds;
+}
+
+/* Like meta_get, but connects srv only when the table is not cached or has
+   expired, so a hit costs no session. */
+static int
+cached_meta (sqon_DatabaseServer *srv, const char *table,
+	     const struct table_meta **out)
+{
+  int rc;
+  struct table_meta *m = NULL;
+
+  if (srv->meta)
+    m = find_meta (srv->meta, table);
+
+  if (m && is_fresh (srv->meta, m))
+    {
+      *out = m;
+      return 0;
+    }
+
+  rc = sqon_connect (srv);
+  if (rc)
+    return rc;
+
+  rc = meta_get (srv, table, out);
+  sqon_close (srv);
+  return rc;
+}
+
+int
+sqon_get_primary_key (sqon_DatabaseServer *srv, const char *table, char **out)
+{
+  int rc;
+  const struct table_meta *m;
+
+  rc = cached_meta (srv, table, &m);
+  if (rc)
+    return rc;
+
+  if (NULL == m->pk)
+    return SQON_NOPK;
+
+  *out = copy_str (m->pk);
+  if (NULL == *out)
+    return SQON_MEMORYERROR;
+
+  return 0;
+}
+
+int
+sqon_get_columns (sqon_DatabaseServer *srv, const char *table, char **out)
+{
+  int rc;
+  size_t i;
+  const struct table_meta *m;
+  struct buffer buf;
+
+  rc = cached_meta (srv, table, &m);
+  if (rc)
+    return rc;
+
+  buffer_init (&buf);
+  rc = buffer_append (&buf, "[", 1);
+
+  for (i = 0; !rc && i < m->num_columns; ++i)
+    {
+      if (i)
+	rc = buffer_append (&buf, ", ", 2);
+
+      if (!rc)
+	rc = buffer_append_str (&buf, "{\"name\": ");
+      if (!rc)
+	rc = buffer_append_json_string (&buf, m->names[i],
+					strlen (m->names[i]));
+      if (!rc)
+	rc = buffer_append_str (&buf, ", \"type\": ");
+      if (!rc)
+	rc = buffer_append_json_string (&buf, m->types[i],
+					strlen (m->types[i]));
+      if (!rc)
+	rc = buffer_append (&buf, "}", 1);
+    }
+
+  if (!rc)
+    rc = buffer_append (&buf, "]", 1);
+
+  if (!rc)
+    {
+      *out = buffer_finish (&buf);
+      if (NULL == *out)
+	rc = SQON_MEMORYERROR;
+    }
+
+  buffer_free (&buf);
+  return rc;
+}
@@ -0,0 +1,60 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DELWINK_SQON_META_H
+#define DELWINK_SQON_META_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "sqon.h"
+
+struct table_meta
+{
+  char *table;
+  char *pk;
+  size_t num_columns;
+  char **names;
+  char **types;
+  time_t loaded;
+};
+
+/* Looks up a table's metadata, loading it from the catalog if it is not
+   cached or has expired; srv must be connected. The result is valid until
+   the next call on srv. */
+int
+meta_get (sqon_DatabaseServer *srv, const char *table,
+	  const struct table_meta **out);
+
+void
+meta_cache_free (sqon_DatabaseServer *srv);
+
+/* For a backend's load_meta: sizes m's arrays for n columns, which are then
+   added in order. The first key column added becomes m's pk, unless the
+   backend names it with meta_set_pk(). */
+int
+meta_alloc_columns (struct table_meta *m, size_t n);
+
+int
+meta_add_column (struct table_meta *m, const char *name, const char *type,
+		 bool primary);
+
+int
+meta_set_pk (struct table_meta *m, const char *name);
+
+#endif
@@ -0,0 +1,1117 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <mysql/errmsg.h>
+#include <mysql/mysql.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backend.h"
+#include "buffer.h"
+#include "bulk.h"
+#include "meta.h"
+#include "result.h"
+#include "sqon.h"
+
+/* LOAD DATA LOCAL INFILE in progress; the server names a file, but the
+   rows come from sqon_bulk_insert() */
+struct infile
+{
+  struct bulk *b;
+  struct buffer buf;
+  size_t pos;
+  int rc;
+  bool opened;
+};
+
+static int
+infile_init (void **ptr, const char *filename, void *userdata)
+{
+  struct infile *f = userdata;
+
+  (void) filename;
+  *ptr = f;
+
+  /* outside sqon_bulk_insert(), the server is never sent a file */
+  if (NULL == f)
+    return 1;
+
+  f->opened = true;
+  return 0;
+}
+
+static int
+infile_read (void *ptr, char *buf, unsigned int len)
+{
+  struct infile *f = ptr;
+  size_t n;
+
+  if (f->pos == f->buf.len)
+    {
+      f->buf.len = 0;
+      f->pos = 0;
+      f->rc = bulk_read_lines (f->b, &f->buf, BULK_CHUNK);
+      if (f->rc)
+	return -1;
+    }
+
+  n = f->buf.len - f->pos;
+  if (n > len)
+    n = len;
+
+  memcpy (buf, f->buf.data + f->pos, n);
+  f->pos += n;
+  return (int) n;
+}
+
+static void
+infile_end (void *ptr)
+{
+  (void) ptr;
+}
+
+static int
+infile_error (void *ptr, char *msg, unsigned int len)
+{
+  snprintf (msg, len, "%s", ptr ? "bad input to sqon_bulk_insert()"
+	    : "LOAD DATA LOCAL INFILE is only used by sqon_bulk_insert()");
+  return CR_UNKNOWN_ERROR;
+}
+
+static void
+set_infile (MYSQL *conn, struct infile *f)
+{
+  mysql_set_local_infile_handler (conn, infile_init, infile_read, infile_end,
+				  infile_error, f);
+}
+
+static int
+open_mysql (sqon_DatabaseServer *srv)
+{
+  const char *real_end = srv->port + strlen (srv->port);
+  char *end;
+  unsigned long port;
+  unsigned int local_infile = 1;
+
+  srv->com = mysql_init (NULL);
+  if (NULL == srv->com)
+    return SQON_MEMORYERROR;
+
+  mysql_options (srv->com, MYSQL_OPT_LOCAL_INFILE, &local_infile);
+  set_infile (srv->com, NULL);
+
+  /* the client counts whole seconds */
+  if (srv->connect_timeout_ms)
+    {
+      unsigned int seconds = srv->connect_timeout_ms / 1000
+	+ (srv->connect_timeout_ms % 1000 != 0);
+
+      mysql_options (srv->com, MYSQL_OPT_CONNECT_TIMEOUT, &seconds);
+    }
+
+#ifdef MYSQL_WAIT_READ
+  /* lets sqon_query_async() drive the same handle */
+  mysql_options (srv->com, MYSQL_OPT_NONBLOCK, 0);
+#endif
+
+  port = strtoul (srv->port, &end, 10);
+  if (end != real_end)
+    return SQON_CONNECTERR;
+
+  if (NULL == mysql_real_connect (srv->com, srv->host, srv->user,
+				  srv->passwd, srv->database, port, NULL,
+				  CLIENT_MULTI_STATEMENTS))
+    return (int) mysql_errno (srv->com);
+
+  return 0;
+}
+
+static void
+close_mysql (sqon_DatabaseServer *srv)
+{
+  mysql_close (srv->com);
+}
+
+static int
+ping_mysql (sqon_DatabaseServer *srv)
+{
+  if (mysql_ping (srv->com))
+    return (int) mysql_errno (srv->com);
+
+  return 0;
+}
+
+/* Reads and throws away the results of any statements after the first, as
+   the session may be used again; gives rc, or the first error among them if
+   rc is zero. */
+static int
+skip_results (MYSQL *conn, int rc)
+{
+  int status;
+  MYSQL_RES *res;
+
+  while (!(status = mysql_next_result (conn)))
+    {
+      res = mysql_store_result (conn);
+      if (res)
+	mysql_free_result (res);
+      else if (!rc && mysql_field_count (conn))
+	rc = (int) mysql_errno (conn);
+    }
+
+  if (status > 0 && !rc)
+    rc = (int) mysql_errno (conn);
+
+  return rc;
+}
+
+static int
+query_mysql (sqon_DatabaseServer *srv, const char *query,
+	     struct result_writer *w)
+{
+  int rc;
+  MYSQL_RES *res;
+
+  if (mysql_query (srv->com, query))
+    return (int) mysql_errno (srv->com);
+
+  /* the result is read even if unwanted, or the connection could not be
+     used again */
+  res = mysql_store_result (srv->com);
+  if (NULL == res)
+    {
+      rc = (int) mysql_errno (srv->com);
+      if (!rc && w)
+	rc = buffer_append (&w->buf, SQON_EMPTY_RESULT,
+			    SQON_EMPTY_RESULT_LEN);
+
+      return skip_results (srv->com, rc);
+    }
+
+  rc = w ? result_writer_result (w, res) : 0;
+
+  mysql_free_result (res);
+  return skip_results (srv->com, rc);
+}
+
+static int
+stream_mysql (sqon_DatabaseServer *srv, const char *query,
+	      struct result_writer *w, sqon_StreamCallback cb, void *userdata,
+	      size_t chunk_rows)
+{
+  int rc;
+  size_t n = 0;
+  MYSQL_RES *res;
+  union fields fields;
+  union row row;
+
+  if (mysql_query (srv->com, query))
+    return mysql_errno (srv->com);
+
+  res = mysql_use_result (srv->com);
+  if (NULL == res)
+    {
+      rc = (int) mysql_errno (srv->com);
+      if (rc)
+	return rc;
+
+      rc = skip_results (srv->com,
+			 buffer_append (&w->buf, SQON_EMPTY_RESULT,
+					SQON_EMPTY_RESULT_LEN));
+      if (!rc)
+	rc = result_writer_flush (w, cb, userdata);
+      return rc;
+    }
+
+  fields.mysql = mysql_fetch_fields (res);
+  rc = result_writer_begin (w);
+  if (!rc)
+    rc = result_writer_fields (w, fields, mysql_num_fields (res));
+
+  while (!rc && (row.mysql = mysql_fetch_row (res)))
+    {
+      rc = result_writer_row (w, fields, row, mysql_fetch_lengths (res));
+      if (!rc && ++n % chunk_rows == 0)
+	rc = result_writer_flush (w, cb, userdata);
+    }
+
+  /* mysql_fetch_row() also returns NULL if the connection failed */
+  if (!rc)
+    rc = (int) mysql_errno (srv->com);
+
+  if (!rc)
+    rc = result_writer_end (w);
+
+  /* the rest of the rows are read by mysql_free_result() */
+  mysql_free_result (res);
+  rc = skip_results (srv->com, rc);
+
+  if (!rc)
+    rc = result_writer_flush (w, cb, userdata);
+
+  return rc;
+}
+
+static int
+escape_mysql (sqon_DatabaseServer *srv, const char *in, char *out)
+{
+  mysql_real_escape_string (srv->com, out, in, strlen (in));
+  return 0;
+}
+
+static int
+load_pk_mysql (sqon_DatabaseServer *srv, struct table_meta *m)
+{
+  static const char *fmt = "SHOW KEYS FROM %s WHERE Key_name = 'PRIMARY'";
+  int rc;
+  char *query, *esc_table;
+  size_t qlen;
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+
+  esc_table = sqon_malloc ((strlen (m->table) * 2 + 1) * sizeof (char));
+  if (NULL == esc_table)
+    return SQON_MEMORYERROR;
+
+  escape_mysql (srv, m->table, esc_table);
+
+  qlen = strlen (fmt) + strlen (esc_table) + 1;
+  query = sqon_malloc (qlen * sizeof (char));
+  if (NULL == query)
+    {
+      sqon_free (esc_table);
+      return SQON_MEMORYERROR;
+    }
+
+  snprintf (query, qlen, fmt, esc_table);
+  sqon_free (esc_table);
+
+  rc = mysql_query (srv->com, query);
+  sqon_free (query);
+  if (rc)
+    return (int) mysql_errno (srv->com);
+
+  res = mysql_store_result (srv->com);
+  if (NULL == res)
+    return (int) mysql_errno (srv->com);
+
+  /* Table, Non_unique, Key_name, Seq_in_index, Column_name, ...; the rows
+     come in Seq_in_index order, and none leaves m without a pk */
+  row = mysql_fetch_row (res);
+  if (row && row[4])
+    rc = meta_set_pk (m, row[4]);
+  else
+    rc = (int) mysql_errno (srv->com);
+
+  mysql_free_result (res);
+  return rc;
+}
+
+static int
+load_mysql (sqon_DatabaseServer *srv, const char *query, struct table_meta *m)
+{
+  int rc;
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+
+  if (mysql_query (srv->com, query))
+    return (int) mysql_errno (srv->com);
+
+  res = mysql_store_result (srv->com);
+  if (NULL == res)
+    {
+      rc = (int) mysql_errno (srv->com);
+      return rc ? rc : SQON_NOCOLUMNS;
+    }
+
+  /* Field, Type, Null, Key, Default, Extra; Key says PRI for the columns
+     of a composite key in table order, and for a UNIQUE NOT NULL column
+     when there is no primary key, so the key is looked up on its own */
+  rc = meta_alloc_columns (m, mysql_num_rows (res));
+  while (!rc && (row = mysql_fetch_row (res)))
+    rc = meta_add_column (m, row[0], row[1], false);
+
+  mysql_free_result (res);
+  if (rc)
+    return rc;
+
+  return load_pk_mysql (srv, m);
+}
+
+static int
+lag_mysql (sqon_DatabaseServer *srv, int64_t *lag_ms)
+{
+  int rc;
+  unsigned int i, num_fields;
+  MYSQL_RES *res;
+  MYSQL_FIELD *fields;
+  MYSQL_ROW row;
+
+  /* the old name is all that servers before MySQL 8.0.22 and MariaDB 10.5
+     understand */
+  if (mysql_query (srv->com, "SHOW REPLICA STATUS")
+      && mysql_query (srv->com, "SHOW SLAVE STATUS"))
+    return (int) mysql_errno (srv->com);
+
+  res = mysql_store_result (srv->com);
+  if (NULL == res)
+    {
+      rc = (int) mysql_errno (srv->com);
+      return rc ? rc : SQON_NOCOLUMNS;
+    }
+
+  /* no row if the server is not a replica */
+  *lag_ms = 0;
+  row = mysql_fetch_row (res);
+  if (row)
+    {
+      *lag_ms = -1;
+      num_fields = mysql_num_fields (res);
+      fields = mysql_fetch_fields (res);
+
+      for (i = 0; i < num_fields; ++i)
+	{
+	  if (strcmp (fields[i].name, "Seconds_Behind_Source")
+	      && strcmp (fields[i].name, "Seconds_Behind_Master"))
+	    continue;
+
+	  if (row[i])
+	    *lag_ms = (int64_t) strtoll (row[i], NULL, 10) * 1000;
+	  break;
+	}
+    }
+
+  mysql_free_result (res);
+  return 0;
+}
+
+static int
+bulk_mysql (sqon_DatabaseServer *srv, const char *table, const char *columns,
+	    struct bulk *b)
+{
+  int rc;
+  struct buffer sql;
+  struct infile f;
+
+  buffer_init (&sql);
+  rc = buffer_append_str (&sql, "LOAD DATA LOCAL INFILE 'sqon' INTO TABLE ");
+  if (!rc)
+    rc = buffer_append_str (&sql, table);
+  if (!rc)
+    rc = buffer_append_str (&sql, " CHARACTER SET utf8mb4 "
+			    "FIELDS TERMINATED BY '\\t' ESCAPED BY '\\\\' "
+			    "LINES TERMINATED BY '\\n' ");
+  if (!rc)
+    rc = buffer_append_str (&sql, columns);
+  if (rc)
+    {
+      buffer_free (&sql);
+      return rc;
+    }
+
+  f.b = b;
+  buffer_init (&f.buf);
+  f.pos = 0;
+  f.rc = 0;
+  f.opened = false;
+
+  set_infile (srv->com, &f);
+  if (mysql_real_query (srv->com, sql.data, sql.len))
+    {
+      rc = (int) mysql_errno (srv->com);
+      if (f.rc)
+	rc = f.rc;
+      /* refused before asking for the rows, such as with local_infile off
+	 on the server */
+      else if (!f.opened)
+	rc = SQON_UNSUPPORTED;
+    }
+  set_infile (srv->com, NULL);
+
+  buffer_free (&f.buf);
+  buffer_free (&sql);
+  return rc;
+}
+
+static int
+cursor_open_mysql (sqon_DatabaseServer *srv, const char *query, void **cur)
+{
+  int rc;
+
+  if (mysql_query (srv->com, query))
+    return (int) mysql_errno (srv->com);
+
+  /* the rows are left on the server until fetched */
+  *cur = mysql_use_result (srv->com);
+  if (NULL == *cur)
+    {
+      rc = (int) mysql_errno (srv->com);
+      return rc ? rc : SQON_NOCOLUMNS;
+    }
+
+  return 0;
+}
+
+static int
+cursor_fetch_mysql (sqon_DatabaseServer *srv, void *cur,
+		    struct result_writer *w, size_t n, size_t *rows)
+{
+  int rc;
+  MYSQL_RES *res = cur;
+  union fields fields;
+  union row row;
+
+  fields.mysql = mysql_fetch_fields (res);
+  rc = result_writer_begin (w);
+  if (!rc)
+    rc = result_writer_fields (w, fields, mysql_num_fields (res));
+
+  for (*rows = 0; !rc && *rows < n; ++*rows)
+    {
+      row.mysql = mysql_fetch_row (res);
+      if (NULL == row.mysql)
+	{
+	  /* also the end if the connection failed */
+	  rc = (int) mysql_errno (srv->com);
+	  break;
+	}
+
+      rc = result_writer_row (w, fields, row, mysql_fetch_lengths (res));
+    }
+
+  if (!rc)
+    rc = result_writer_end (w);
+
+  return rc;
+}
+
+/* MySQL cannot stop sending a result, so the rows not fetched are read and
+   thrown away. */
+static void
+cursor_close_mysql (sqon_DatabaseServer *srv, void *cur)
+{
+  (void) srv;
+  mysql_free_result (cur);
+}
+
+static const char *
+field_name_mysql (union fields fields, size_t i)
+{
+  return fields.mysql[i].name;
+}
+
+static value_writer
+mysql_writer (const MYSQL_FIELD *field)
+{
+  switch (field->type)
+    {
+    case MYSQL_TYPE_TINY:
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_INT24:
+    case MYSQL_TYPE_LONGLONG:
+    case MYSQL_TYPE_YEAR:
+    case MYSQL_TYPE_FLOAT:
+    case MYSQL_TYPE_DOUBLE:
+    case MYSQL_TYPE_DECIMAL:
+    case MYSQL_TYPE_NEWDECIMAL:
+      return res_write_number;
+
+    case MYSQL_TYPE_BIT:
+      return 1 == field->length ? res_write_bool_bits : res_write_string;
+
+    case MYSQL_TYPE_JSON:
+      return res_write_raw;
+
+    default:
+      return res_write_string;
+    }
+}
+
+static int
+plan_mysql (struct result_writer *w, union fields fields, size_t i,
+	    struct column *c)
+{
+  c->index = i;
+  c->decode = NULL;
+  c->write = (w->flags & SQON_OUTPUT_TYPED) ? mysql_writer (&fields.mysql[i])
+    : res_write_string;
+
+  return 0;
+}
+
+static int
+row_mysql (struct result_writer *w, union fields fields, union row row,
+	   const unsigned long *lengths)
+{
+  const struct column *c, *end = w->columns + w->num_columns;
+  size_t key = w->key.index;
+  int rc;
+
+  (void) fields;
+
+  if (w->arr)
+    {
+      rc = result_writer_open_row (w, NULL, 0);
+    }
+  else
+    {
+      /* a NULL key cannot be represented in an object, so the row is left
+	 out */
+      if (NULL == row.mysql[key])
+	return 0;
+
+      rc = result_writer_open_row (w, row.mysql[key], lengths[key]);
+    }
+
+  for (c = w->columns; !rc && c < end; ++c)
+    rc = result_writer_value (w, c, row.mysql[c->index], lengths[c->index]);
+
+  if (!rc)
+    rc = result_writer_close_row (w);
+
+  return rc;
+}
+
+static int
+result_mysql (struct result_writer *w, void *res)
+{
+  int rc;
+  union fields fields;
+  union row row;
+
+  fields.mysql = mysql_fetch_fields (res);
+  rc = result_writer_fields (w, fields, mysql_num_fields (res));
+
+  while (!rc && (row.mysql = mysql_fetch_row (res)))
+    rc = result_writer_row (w, fields, row, mysql_fetch_lengths (res));
+
+  return rc;
+}
+
+#define STMT_BUFFER_SIZE 256
+
+/* Output bindings for a prepared statement; every column is fetched as text,
+   which the client library converts from the binary protocol the same way
+   the server would have. All of it lives in the result's arena. */
+struct stmt_row
+{
+  MYSQL_BIND *binds;
+  char **values;
+  unsigned long *lengths;
+  size_t num_fields;
+  struct arena *arena;
+};
+
+static int
+stmt_row_init (struct stmt_row *r, size_t num_fields, struct arena *arena)
+{
+  size_t i;
+
+  r->num_fields = num_fields;
+  r->arena = arena;
+  r->binds = arena_alloc (arena, num_fields * sizeof (MYSQL_BIND));
+  r->values = arena_alloc (arena, num_fields * sizeof (char *));
+  r->lengths = arena_alloc (arena, num_fields * sizeof (unsigned long));
+  if (NULL == r->binds || NULL == r->values || NULL == r->lengths)
+    return SQON_MEMORYERROR;
+
+  memset (r->binds, 0, num_fields * sizeof (MYSQL_BIND));
+  for (i = 0; i < num_fields; ++i)
+    {
+      r->binds[i].buffer_type = MYSQL_TYPE_STRING;
+      r->binds[i].buffer = arena_alloc (arena, STMT_BUFFER_SIZE);
+      r->binds[i].buffer_length = STMT_BUFFER_SIZE;
+      if (NULL == r->binds[i].buffer)
+	return SQON_MEMORYERROR;
+    }
+
+  return 0;
+}
+
+/* Refetches the columns of the current row which did not fit their
+   buffers, growing the buffers for the rows that follow. */
+static int
+stmt_row_refetch (MYSQL_STMT *stmt, struct stmt_row *r)
+{
+  size_t i;
+
+  for (i = 0; i < r->num_fields; ++i)
+    {
+      MYSQL_BIND *bind = &r->binds[i];
+      unsigned long len = bind->length_value;
+      char *buf;
+
+      if (!bind->error_value)
+	continue;
+
+      buf = arena_alloc (r->arena, len + 1);
+      if (NULL == buf)
+	return SQON_MEMORYERROR;
+
+      bind->buffer = buf;
+      bind->buffer_length = len + 1;
+
+      if (mysql_stmt_fetch_column (stmt, bind, i, 0))
+	return (int) mysql_stmt_errno (stmt);
+    }
+
+  if (mysql_stmt_bind_result (stmt, r->binds))
+    return (int) mysql_stmt_errno (stmt);
+
+  return 0;
+}
+
+static int
+stmt_rows (MYSQL_STMT *stmt, struct stmt_row *r, struct result_writer *w,
+	   union fields fields)
+{
+  int rc = 0, status;
+  size_t i;
+  union row row;
+
+  if (mysql_stmt_bind_result (stmt, r->binds))
+    return (int) mysql_stmt_errno (stmt);
+
+  row.mysql = r->values;
+  while (!rc && (status = mysql_stmt_fetch (stmt)) != MYSQL_NO_DATA)
+    {
+      if (1 == status)
+	return (int) mysql_stmt_errno (stmt);
+
+      if (MYSQL_DATA_TRUNCATED == status)
+	{
+	  rc = stmt_row_refetch (stmt, r);
+	  if (rc)
+	    break;
+	}
+
+      for (i = 0; i < r->num_fields; ++i)
+	{
+	  row.mysql[i] = r->binds[i].is_null_value ? NULL
+	    : r->binds[i].buffer;
+	  r->lengths[i] = r->binds[i].length_value;
+	}
+
+      rc = result_writer_row (w, fields, row, r->lengths);
+    }
+
+  return rc;
+}
+
+/* Serializes the rows of an executed statement; meta is its result
+   metadata. */
+static int
+stmt_to_json (MYSQL_STMT *stmt, MYSQL_RES *meta, char **out, const char *pk,
+	      unsigned int flags)
+{
+  int rc;
+  union fields fields;
+  struct stmt_row r;
+  struct result_writer w;
+
+  result_writer_init (&w, SQON_DBCONN_MYSQL, pk, flags);
+  fields.mysql = mysql_fetch_fields (meta);
+
+  rc = stmt_row_init (&r, mysql_num_fields (meta), &w.arena);
+
+  if (!rc)
+    rc = result_writer_begin (&w);
+
+  if (!rc)
+    rc = result_writer_fields (&w, fields, r.num_fields);
+
+  if (!rc)
+    rc = stmt_rows (stmt, &r, &w, fields);
+
+  if (!rc)
+    rc = result_writer_end (&w);
+
+  if (!rc)
+    {
+      *out = buffer_finish (&w.buf);
+      if (NULL == *out)
+	rc = SQON_MEMORYERROR;
+    }
+
+  result_writer_free (&w);
+  return rc;
+}
+
+static int
+prepare_mysql (sqon_DatabaseServer *srv, const char *name, const char *sql,
+	       void **stmt)
+{
+  int rc;
+  MYSQL_STMT *s;
+
+  /* MySQL statements are known by their handles */
+  (void) name;
+
+  s = mysql_stmt_init (srv->com);
+  if (NULL == s)
+    return SQON_MEMORYERROR;
+
+  if (mysql_stmt_prepare (s, sql, strlen (sql)))
+    {
+      rc = (int) mysql_stmt_errno (s);
+      mysql_stmt_close (s);
+      return rc;
+    }
+
+  *stmt = s;
+  return 0;
+}
+
+static int
+bind_mysql (MYSQL_STMT *stmt, size_t nparams, const char *const *values,
+	    const size_t *lengths)
+{
+  int rc = 0;
+  size_t i;
+  MYSQL_BIND *binds;
+
+  if (mysql_stmt_param_count (stmt) != nparams)
+    return SQON_BADPARAMS;
+
+  if (!nparams)
+    return 0;
+
+  binds = sqon_malloc (nparams * sizeof (MYSQL_BIND));
+  if (NULL == binds)
+    return SQON_MEMORYERROR;
+
+  /* the values are sent as strings, which the server converts to the types
+     of their columns */
+  memset (binds, 0, nparams * sizeof (MYSQL_BIND));
+  for (i = 0; i < nparams; ++i)
+    {
+      if (NULL == values[i])
+	{
+	  binds[i].buffer_type = MYSQL_TYPE_NULL;
+	  continue;
+	}
+
+      binds[i].buffer_type = MYSQL_TYPE_STRING;
+      binds[i].buffer = (void *) values[i];
+      binds[i].buffer_length = lengths ? lengths[i] : strlen (values[i]);
+    }
+
+  if (mysql_stmt_bind_param (stmt, binds))
+    rc = (int) mysql_stmt_errno (stmt);
+
+  sqon_free (binds);
+  return rc;
+}
+
+static int
+execute_mysql (sqon_DatabaseServer *srv, void *stmt, size_t nparams,
+	       const char *const *values, const size_t *lengths, char **out,
+	       const char *pk)
+{
+  int rc;
+  MYSQL_STMT *s = stmt;
+  MYSQL_RES *meta;
+
+  rc = bind_mysql (s, nparams, values, lengths);
+  if (rc)
+    return rc;
+
+  if (mysql_stmt_execute (s))
+    return (int) mysql_stmt_errno (s);
+
+  if (NULL == out)
+    {
+      mysql_stmt_free_result (s);
+      return 0;
+    }
+
+  meta = mysql_stmt_result_metadata (s);
+  if (NULL == meta)
+    {
+      rc = (int) mysql_stmt_errno (s);
+      if (rc)
+	return rc;
+
+      return res_empty (out);
+    }
+
+  rc = stmt_to_json (s, meta, out, pk, srv->output);
+  mysql_free_result (meta);
+
+  /* discard whatever is left of the result after an error */
+  mysql_stmt_free_result (s);
+  if (rc)
+    mysql_stmt_reset (s);
+
+  return rc;
+}
+
+static void
+release_mysql (sqon_DatabaseServer *srv, void *stmt, bool drop)
+{
+  /* closing the handle is all it takes to drop the statement */
+  (void) srv;
+  (void) drop;
+
+  mysql_stmt_close (stmt);
+}
+
+static int
+join_statements (const char *const *queries, size_t n, struct buffer *buf)
+{
+  int rc;
+  size_t i;
+
+  for (i = 0; i < n; ++i)
+    {
+      rc = buffer_append_statement (buf, queries[i]);
+      if (rc)
+	return rc;
+
+      /* on a line of its own, lest a comment ending the statement swallow
+	 it */
+      rc = buffer_append (buf, "\n;", 2);
+      if (rc)
+	return rc;
+    }
+
+  return 0;
+}
+
+/* Runs the batch as one multi-statement round trip; the server stops at the
+   first statement which fails. */
+static int
+batch_mysql (sqon_DatabaseServer *srv, const char *const *queries, size_t n,
+	     char **outs, const char *const *primary_keys)
+{
+  int rc, status;
+  size_t i;
+  struct buffer buf;
+  MYSQL *conn = srv->com;
+  MYSQL_RES *res;
+
+  buffer_init (&buf);
+
+  rc = join_statements (queries, n, &buf);
+  if (!rc && mysql_real_query (conn, buf.data, buf.len))
+    rc = (int) mysql_errno (conn);
+
+  buffer_free (&buf);
+  if (rc)
+    return rc;
+
+  /* every result is read, even after a failure, so that the connection is
+     left ready for the next query */
+  for (i = 0;; ++i)
+    {
+      res = mysql_store_result (conn);
+
+      if (i >= n)
+	{
+	  /* one of the queries held more than one statement */
+	  if (!rc)
+	    rc = SQON_BADPARAMS;
+	}
+      else if (res)
+	{
+	  if (outs && !rc)
+	    rc = res_to_json (SQON_DBCONN_MYSQL, res, &outs[i],
+			      primary_keys ? primary_keys[i] : NULL,
+			      srv->output);
+	}
+      else if (mysql_field_count (conn))
+	{
+	  if (!rc)
+	    rc = (int) mysql_errno (conn);
+	}
+      else if (outs && !rc)
+	{
+	  rc = res_empty (&outs[i]);
+	}
+
+      if (res)
+	mysql_free_result (res);
+
+      status = mysql_next_result (conn);
+      if (status > 0 && !rc)
+	rc = (int) mysql_errno (conn);
+
+      if (status)
+	break;
+    }
+
+  if (!rc && i + 1 < n)
+    rc = SQON_BADPARAMS;
+
+  return rc;
+}
+
+#ifdef MYSQL_WAIT_READ
+static int
+from_mysql_wait (int status)
+{
+  return ((status & MYSQL_WAIT_READ) ? SQON_WAIT_READ : 0)
+    | ((status & MYSQL_WAIT_WRITE) ? SQON_WAIT_WRITE : 0);
+}
+
+/* The client library resumes its coroutine with the events that woke it;
+   those the caller did not report are assumed to have happened, as the
+   caller is only meant to advance once the socket is ready. */
+static int
+to_mysql_wait (int events, int status)
+{
+  int ready = ((events & SQON_WAIT_READ) ? MYSQL_WAIT_READ : 0)
+    | ((events & SQON_WAIT_WRITE) ? MYSQL_WAIT_WRITE : 0);
+
+  ready &= status;
+  return ready ? ready : status;
+}
+
+/* Steps the query as far as it will go without blocking. */
+static void
+step_mysql (sqon_Async *q, int status)
+{
+  MYSQL *conn = q->srv->com;
+  MYSQL_RES *res = NULL;
+  int err;
+
+  if (ASYNC_QUERY == q->state)
+    {
+      status = status ? mysql_real_query_cont (&err, conn, status)
+	: mysql_real_query_start (&err, conn, q->query, strlen (q->query));
+      if (status)
+	{
+	  q->wait = status;
+	  return;
+	}
+
+      if (err)
+	{
+	  q->rc = (int) mysql_errno (conn);
+	  q->state = ASYNC_READY;
+	  return;
+	}
+
+      q->state = ASYNC_STORE;
+      status = mysql_store_result_start (&res, conn);
+    }
+  else
+    {
+      status = mysql_store_result_cont (&res, conn, status);
+    }
+
+  if (status)
+    {
+      q->wait = status;
+      return;
+    }
+
+  q->res = res;
+  if (NULL == res)
+    q->rc = (int) mysql_errno (conn);
+
+  q->state = ASYNC_READY;
+}
+
+static int
+async_send_mysql (sqon_Async *q)
+{
+  step_mysql (q, 0);
+  return 0;
+}
+
+static void
+async_step_mysql (sqon_Async *q, int events)
+{
+  step_mysql (q, to_mysql_wait (events, q->wait));
+}
+
+static int
+async_fd_mysql (sqon_DatabaseServer *srv)
+{
+  return mysql_get_socket (srv->com);
+}
+
+static int
+async_events_mysql (const sqon_Async *q)
+{
+  return from_mysql_wait (q->wait);
+}
+
+static void
+async_drain_mysql (sqon_Async *q)
+{
+  struct pollfd pfd;
+
+  while (q->state < ASYNC_READY)
+    {
+      pfd.fd = mysql_get_socket (q->srv->com);
+      pfd.events = ((q->wait & MYSQL_WAIT_READ) ? POLLIN : 0)
+	| ((q->wait & MYSQL_WAIT_WRITE) ? POLLOUT : 0);
+      poll (&pfd, 1, -1);
+
+      step_mysql (q, q->wait);
+    }
+}
+
+static void
+async_clear_mysql (sqon_Async *q)
+{
+  if (q->res)
+    mysql_free_result (q->res);
+
+  q->res = NULL;
+  skip_results (q->srv->com, 0);
+}
+#endif
+
+const struct backend mysql_backend = {
+  .open = open_mysql,
+  .close = close_mysql,
+  .ping = ping_mysql,
+  .query = query_mysql,
+  .stream = stream_mysql,
+  .escape = escape_mysql,
+  .meta_query = "SHOW COLUMNS FROM %s",
+  .load_meta = load_mysql,
+  .replica_lag = lag_mysql,
+  .ident_quote = '`',
+  .booleans = { "0", "1" },
+  .bulk_load = bulk_mysql,
+  .cursor_open = cursor_open_mysql,
+  .cursor_fetch = cursor_fetch_mysql,
+  .cursor_close = cursor_close_mysql,
+  .prepare = prepare_mysql,
+  .execute = execute_mysql,
+  .release = release_mysql,
+  .batch = batch_mysql,
+#ifdef MYSQL_WAIT_READ
+  .async_send = async_send_mysql,
+  .async_step = async_step_mysql,
+  .async_fd = async_fd_mysql,
+  .async_events = async_events_mysql,
+  .async_drain = async_drain_mysql,
+  .async_clear = async_clear_mysql,
+#endif
+  .field_name = field_name_mysql,
+  .plan_column = plan_mysql,
+  .write_row = row_mysql,
+  .write_result = result_mysql
+};
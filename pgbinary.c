@@ -0,0 +1,470 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgbinary.h"
+#include "sqon.h"
+
+/* PostgreSQL's epoch for dates and timestamps, 2000-01-01, in days after
+   1970-01-01 */
+#define POSTGRES_EPOCH_DAYS 10957
+#define USECS_PER_DAY INT64_C (86400000000)
+
+#define NUMERIC_NEG 0x4000
+#define NUMERIC_NAN 0xC000
+#define NUMERIC_PINF 0xD000
+#define NUMERIC_NINF 0xF000
+
+static uint64_t
+read_be (const char *value, size_t n)
+{
+  const unsigned char *p = (const unsigned char *) value;
+  uint64_t v = 0;
+  size_t i;
+
+  for (i = 0; i < n; ++i)
+    v = (v << 8) | p[i];
+
+  return v;
+}
+
+static int
+decode_int2 (struct buffer *out, const char *value, size_t len)
+{
+  char s[8];
+
+  if (len != 2)
+    return SQON_ENCODING;
+
+  return buffer_append (out, s, snprintf (s, sizeof s, "%d",
+					  (int16_t) read_be (value, 2)));
+}
+
+static int
+decode_int4 (struct buffer *out, const char *value, size_t len)
+{
+  char s[16];
+
+  if (len != 4)
+    return SQON_ENCODING;
+
+  return buffer_append (out, s, snprintf (s, sizeof s, "%" PRId32,
+					  (int32_t) read_be (value, 4)));
+}
+
+static int
+decode_int8 (struct buffer *out, const char *value, size_t len)
+{
+  char s[24];
+
+  if (len != 8)
+    return SQON_ENCODING;
+
+  return buffer_append (out, s, snprintf (s, sizeof s, "%" PRId64,
+					  (int64_t) read_be (value, 8)));
+}
+
+static int
+decode_oid (struct buffer *out, const char *value, size_t len)
+{
+  char s[16];
+
+  if (len != 4)
+    return SQON_ENCODING;
+
+  return buffer_append (out, s, snprintf (s, sizeof s, "%" PRIu32,
+					  (uint32_t) read_be (value, 4)));
+}
+
+static int
+append_special_float (struct buffer *out, double d)
+{
+  if (isnan (d))
+    return buffer_append_str (out, "NaN");
+
+  return buffer_append_str (out, d > 0 ? "Infinity" : "-Infinity");
+}
+
+/* Uses the fewest digits which read back as the same value, as the server
+   does since version 12; the notation may differ from the server's. */
+static int
+decode_float4 (struct buffer *out, const char *value, size_t len)
+{
+  char s[32];
+  uint32_t bits;
+  float f;
+  int p, n = 0;
+
+  if (len != 4)
+    return SQON_ENCODING;
+
+  bits = (uint32_t) read_be (value, 4);
+  memcpy (&f, &bits, sizeof f);
+
+  if (!isfinite (f))
+    return append_special_float (out, f);
+
+  for (p = 1; p <= 9; ++p)
+    {
+      n = snprintf (s, sizeof s, "%.*g", p, f);
+      if (strtof (s, NULL) == f)
+	break;
+    }
+
+  return buffer_append (out, s, n);
+}
+
+static int
+decode_float8 (struct buffer *out, const char *value, size_t len)
+{
+  char s[32];
+  uint64_t bits;
+  double d;
+  int p, n = 0;
+
+  if (len != 8)
+    return SQON_ENCODING;
+
+  bits = read_be (value, 8);
+  memcpy (&d, &bits, sizeof d);
+
+  if (!isfinite (d))
+    return append_special_float (out, d);
+
+  for (p = 1; p <= 17; ++p)
+    {
+      n = snprintf (s, sizeof s, "%.*g", p, d);
+      if (strtod (s, NULL) == d)
+	break;
+    }
+
+  return buffer_append (out, s, n);
+}
+
+static int
+decode_bool (struct buffer *out, const char *value, size_t len)
+{
+  if (len != 1)
+    return SQON_ENCODING;
+
+  return buffer_append (out, value[0] ? "t" : "f", 1);
+}
+
+/* The wire form is a header of digit count, weight of the first digit, sign
+   and display scale, followed by base 10000 digits. */
+static int
+decode_numeric (struct buffer *out, const char *value, size_t len)
+{
+  int16_t ndigits, weight;
+  uint16_t sign, dscale;
+  char s[8];
+  int rc = 0, i, d, n;
+
+  if (len < 8)
+    return SQON_ENCODING;
+
+  ndigits = (int16_t) read_be (value, 2);
+  weight = (int16_t) read_be (value + 2, 2);
+  sign = (uint16_t) read_be (value + 4, 2);
+  dscale = (uint16_t) read_be (value + 6, 2);
+
+  if (ndigits < 0 || len != 8 + 2 * (size_t) ndigits)
+    return SQON_ENCODING;
+
+  switch (sign)
+    {
+    case NUMERIC_NAN:
+      return buffer_append_str (out, "NaN");
+
+    case NUMERIC_PINF:
+      return buffer_append_str (out, "Infinity");
+
+    case NUMERIC_NINF:
+      return buffer_append_str (out, "-Infinity");
+    }
+
+#define DIGIT(i) (((i) >= 0 && (i) < ndigits) \
+		  ? (int) read_be (value + 8 + 2 * (i), 2) : 0)
+
+  if (NUMERIC_NEG == sign)
+    rc = buffer_append (out, "-", 1);
+
+  if (weight < 0)
+    {
+      if (!rc)
+	rc = buffer_append (out, "0", 1);
+    }
+  else
+    {
+      for (i = 0; !rc && i <= weight; ++i)
+	{
+	  n = snprintf (s, sizeof s, i ? "%04d" : "%d", DIGIT (i));
+	  rc = buffer_append (out, s, n);
+	}
+    }
+
+  if (!rc && dscale)
+    rc = buffer_append (out, ".", 1);
+
+  /* each digit holds four decimal places, of which dscale are shown */
+  for (i = weight + 1, d = dscale; !rc && d > 0; ++i, d -= 4)
+    {
+      n = snprintf (s, sizeof s, "%04d", DIGIT (i));
+      rc = buffer_append (out, s, d < 4 ? d : 4);
+    }
+
+#undef DIGIT
+
+  return rc;
+}
+
+/* Converts days after 1970-01-01 to a proleptic Gregorian date. */
+static void
+civil_from_days (int64_t z, int64_t *y, unsigned int *m, unsigned int *d)
+{
+  int64_t era;
+  unsigned int doe, yoe, doy, mp;
+
+  z += 719468;
+  era = (z >= 0 ? z : z - 146096) / 146097;
+  doe = (unsigned int) (z - era * 146097);
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = mp < 10 ? mp + 3 : mp - 9;
+  *y = (int64_t) yoe + era * 400 + (*m <= 2);
+}
+
+/* Writes the date in ISO style; years before 1 are written as BC, which the
+   caller appends. */
+static int
+append_date (struct buffer *out, int64_t days, bool *bc)
+{
+  char s[32];
+  int64_t y;
+  unsigned int m, d;
+
+  civil_from_days (days + POSTGRES_EPOCH_DAYS, &y, &m, &d);
+
+  *bc = y <= 0;
+  if (*bc)
+    y = 1 - y;
+
+  return buffer_append (out, s, snprintf (s, sizeof s,
+					  "%04" PRId64 "-%02u-%02u", y, m, d));
+}
+
+static int
+decode_date (struct buffer *out, const char *value, size_t len)
+{
+  int32_t days;
+  bool bc;
+  int rc;
+
+  if (len != 4)
+    return SQON_ENCODING;
+
+  days = (int32_t) read_be (value, 4);
+  if (INT32_MAX == days)
+    return buffer_append_str (out, "infinity");
+  if (INT32_MIN == days)
+    return buffer_append_str (out, "-infinity");
+
+  rc = append_date (out, days, &bc);
+  if (!rc && bc)
+    rc = buffer_append_str (out, " BC");
+
+  return rc;
+}
+
+static int
+append_timestamp (struct buffer *out, const char *value, size_t len,
+		  const char *zone)
+{
+  char s[32];
+  int64_t us, days, tod;
+  bool bc;
+  int rc, n;
+
+  if (len != 8)
+    return SQON_ENCODING;
+
+  us = (int64_t) read_be (value, 8);
+  if (INT64_MAX == us)
+    return buffer_append_str (out, "infinity");
+  if (INT64_MIN == us)
+    return buffer_append_str (out, "-infinity");
+
+  days = us / USECS_PER_DAY;
+  tod = us % USECS_PER_DAY;
+  if (tod < 0)
+    {
+      --days;
+      tod += USECS_PER_DAY;
+    }
+
+  rc = append_date (out, days, &bc);
+  if (rc)
+    return rc;
+
+  n = snprintf (s, sizeof s, " %02d:%02d:%02d",
+		(int) (tod / INT64_C (3600000000)),
+		(int) (tod / 60000000 % 60), (int) (tod / 1000000 % 60));
+
+  /* fractions are shown without their trailing zeroes */
+  if (tod % 1000000)
+    {
+      n += snprintf (s + n, sizeof s - n, ".%06d", (int) (tod % 1000000));
+      while ('0' == s[n - 1])
+	--n;
+    }
+
+  rc = buffer_append (out, s, n);
+  if (!rc)
+    rc = buffer_append_str (out, zone);
+  if (!rc && bc)
+    rc = buffer_append_str (out, " BC");
+
+  return rc;
+}
+
+static int
+decode_timestamp (struct buffer *out, const char *value, size_t len)
+{
+  return append_timestamp (out, value, len, "");
+}
+
+/* The binary form is UTC, which is how it is shown rather than in the
+   session's time zone. */
+static int
+decode_timestamptz (struct buffer *out, const char *value, size_t len)
+{
+  return append_timestamp (out, value, len, "+00");
+}
+
+static void
+hex_bytes (char *dst, const unsigned char *src, size_t n)
+{
+  static const char hex[] = "0123456789abcdef";
+  size_t i;
+
+  for (i = 0; i < n; ++i)
+    {
+      *dst++ = hex[src[i] >> 4];
+      *dst++ = hex[src[i] & 0xF];
+    }
+}
+
+static int
+decode_uuid (struct buffer *out, const char *value, size_t len)
+{
+  const unsigned char *p = (const unsigned char *) value;
+  char s[36];
+
+  if (len != 16)
+    return SQON_ENCODING;
+
+  hex_bytes (s, p, 4);
+  s[8] = '-';
+  hex_bytes (s + 9, p + 4, 2);
+  s[13] = '-';
+  hex_bytes (s + 14, p + 6, 2);
+  s[18] = '-';
+  hex_bytes (s + 19, p + 8, 2);
+  s[23] = '-';
+  hex_bytes (s + 24, p + 10, 6);
+
+  return buffer_append (out, s, sizeof s);
+}
+
+/* In the server's default hex output format */
+static int
+decode_bytea (struct buffer *out, const char *value, size_t len)
+{
+  int rc;
+
+  if (len > (SIZE_MAX - 3) / 2)
+    return SQON_OVERFLOW;
+
+  rc = buffer_reserve (out, 2 + 2 * len);
+  if (rc)
+    return rc;
+
+  out->data[out->len++] = '\\';
+  out->data[out->len++] = 'x';
+  hex_bytes (out->data + out->len, (const unsigned char *) value, len);
+  out->len += 2 * len;
+
+  return 0;
+}
+
+/* jsonb is its text form after a version number */
+static int
+decode_jsonb (struct buffer *out, const char *value, size_t len)
+{
+  if (!len || 1 != value[0])
+    return SQON_ENCODING;
+
+  return buffer_append (out, value + 1, len - 1);
+}
+
+int
+pgbinary_decoder (unsigned int oid, value_decoder *out)
+{
+  *out = NULL;
+
+  switch (oid)
+    {
+    case BOOLOID:        *out = decode_bool;        break;
+    case BYTEAOID:       *out = decode_bytea;       break;
+    case INT8OID:        *out = decode_int8;        break;
+    case INT2OID:        *out = decode_int2;        break;
+    case INT4OID:        *out = decode_int4;        break;
+    case OIDOID:         *out = decode_oid;         break;
+    case FLOAT4OID:      *out = decode_float4;      break;
+    case FLOAT8OID:      *out = decode_float8;      break;
+    case DATEOID:        *out = decode_date;        break;
+    case TIMESTAMPOID:   *out = decode_timestamp;   break;
+    case TIMESTAMPTZOID: *out = decode_timestamptz; break;
+    case NUMERICOID:     *out = decode_numeric;     break;
+    case UUIDOID:        *out = decode_uuid;        break;
+    case JSONBOID:       *out = decode_jsonb;       break;
+
+    case CHAROID:
+    case NAMEOID:
+    case TEXTOID:
+    case JSONOID:
+    case XMLOID:
+    case UNKNOWNOID:
+    case BPCHAROID:
+    case VARCHAROID:
+      break;
+
+    default:
+      return SQON_UNSUPPORTED;
+    }
+
+  return 0;
+}
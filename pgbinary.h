@@ -0,0 +1,59 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DELWINK_SQON_PGBINARY_H
+#define DELWINK_SQON_PGBINARY_H
+
+#include <stddef.h>
+
+#include "buffer.h"
+
+/* PostgreSQL type OIDs, as in the server's catalog/pg_type.h */
+#define BOOLOID 16
+#define BYTEAOID 17
+#define CHAROID 18
+#define NAMEOID 19
+#define INT8OID 20
+#define INT2OID 21
+#define INT4OID 23
+#define TEXTOID 25
+#define OIDOID 26
+#define JSONOID 114
+#define XMLOID 142
+#define FLOAT4OID 700
+#define FLOAT8OID 701
+#define UNKNOWNOID 705
+#define BPCHAROID 1042
+#define VARCHAROID 1043
+#define DATEOID 1082
+#define TIMESTAMPOID 1114
+#define TIMESTAMPTZOID 1184
+#define NUMERICOID 1700
+#define UUIDOID 2950
+#define JSONBOID 3802
+
+/* Appends the text form of a value received in binary format. */
+typedef int (*value_decoder) (struct buffer *out, const char *value,
+			      size_t len);
+
+/* Finds the decoder for a type; *out is set to NULL for types whose binary
+   form is the same as their text form. Returns SQON_UNSUPPORTED for types
+   which cannot be decoded. */
+int
+pgbinary_decoder (unsigned int oid, value_decoder *out);
+
+#endif
@@ -0,0 +1,334 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "sqon.h"
+
+struct idle_conn
+{
+  sqon_DatabaseServer *srv;
+  struct timespec since;
+  struct idle_conn *next;
+};
+
+struct sqon_pool
+{
+  pthread_mutex_t lock;
+  pthread_cond_t available;
+  sqon_DatabaseServer *proto;
+  struct idle_conn *idle;
+  size_t min_size;
+  size_t max_size;
+  size_t size;
+  unsigned int idle_timeout;
+};
+
+static sqon_DatabaseServer *
+copy_server (const sqon_DatabaseServer *srv)
+{
+  sqon_DatabaseServer *out = sqon_new_connection (srv->type, srv->host,
+						  srv->user, srv->passwd,
+						  srv->database, srv->port);
+  if (out)
+    {
+      out->output = srv->output;
+      out->compression = srv->compression;
+      out->compress_level = srv->compress_level;
+    }
+
+  return out;
+}
+
+static void
+destroy (sqon_DatabaseServer *srv)
+{
+  /* sqon_free_connection() closes it */
+  sqon_free_connection (srv);
+}
+
+/* Must be called with the lock held. */
+static void
+push_idle (sqon_Pool *pool, struct idle_conn *conn)
+{
+  clock_gettime (CLOCK_MONOTONIC, &conn->since);
+  conn->next = pool->idle;
+  pool->idle = conn;
+}
+
+/* Detaches connections which have been idle too long, oldest first, keeping
+   min_size open. Must be called with the lock held; the returned list is to
+   be destroyed after unlocking. */
+static struct idle_conn *
+take_expired (sqon_Pool *pool)
+{
+  struct idle_conn **p, *conn, *expired = NULL;
+  struct timespec now;
+  size_t n = 0;
+
+  if (!pool->idle_timeout || pool->size <= pool->min_size)
+    return NULL;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  /* the idle list is most recently used first, so the tail is oldest */
+  p = &pool->idle;
+  while (*p && now.tv_sec - (*p)->since.tv_sec < (time_t) pool->idle_timeout)
+    p = &(*p)->next;
+
+  /* when min_size keeps some open, they are the newer ones nearer the
+     head */
+  for (conn = *p; conn; conn = conn->next)
+    ++n;
+
+  for (; n > pool->size - pool->min_size; --n)
+    p = &(*p)->next;
+
+  while (*p)
+    {
+      conn = *p;
+      *p = conn->next;
+      conn->next = expired;
+      expired = conn;
+      --pool->size;
+    }
+
+  return expired;
+}
+
+static void
+destroy_list (struct idle_conn *list)
+{
+  while (list)
+    {
+      struct idle_conn *next = list->next;
+
+      destroy (list->srv);
+      sqon_free (list);
+      list = next;
+    }
+}
+
+static int
+open_conn (sqon_Pool *pool, struct idle_conn **out)
+{
+  int rc;
+  struct idle_conn *conn = sqon_malloc (sizeof (struct idle_conn));
+
+  if (NULL == conn)
+    return SQON_MEMORYERROR;
+
+  conn->srv = copy_server (pool->proto);
+  if (NULL == conn->srv)
+    {
+      sqon_free (conn);
+      return SQON_MEMORYERROR;
+    }
+
+  /* the connection stays open until the pool closes it */
+  rc = sqon_connect (conn->srv);
+  if (rc)
+    {
+      destroy (conn->srv);
+      sqon_free (conn);
+      return rc;
+    }
+
+  *out = conn;
+  return 0;
+}
+
+sqon_Pool *
+sqon_pool_new (const sqon_DatabaseServer *proto, size_t min_size,
+	       size_t max_size, unsigned int idle_timeout)
+{
+  pthread_condattr_t attr;
+  size_t i;
+
+  if (!max_size || min_size > max_size)
+    return NULL;
+
+  sqon_Pool *pool = sqon_malloc (sizeof (sqon_Pool));
+  if (NULL == pool)
+    return NULL;
+
+  pool->proto = copy_server (proto);
+  if (NULL == pool->proto)
+    {
+      sqon_free (pool);
+      return NULL;
+    }
+
+  pool->idle = NULL;
+  pool->min_size = min_size;
+  pool->max_size = max_size;
+  pool->size = 0;
+  pool->idle_timeout = idle_timeout;
+
+  pthread_mutex_init (&pool->lock, NULL);
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&pool->available, &attr);
+  pthread_condattr_destroy (&attr);
+
+  for (i = 0; i < min_size; ++i)
+    {
+      struct idle_conn *conn;
+
+      if (open_conn (pool, &conn))
+	{
+	  sqon_pool_free (pool);
+	  return NULL;
+	}
+
+      push_idle (pool, conn);
+      ++pool->size;
+    }
+
+  return pool;
+}
+
+void
+sqon_pool_free (sqon_Pool *pool)
+{
+  destroy_list (pool->idle);
+
+  pthread_cond_destroy (&pool->available);
+  pthread_mutex_destroy (&pool->lock);
+
+  sqon_free_connection (pool->proto);
+  sqon_free (pool);
+}
+
+static void
+deadline_after (struct timespec *ts, long ms)
+{
+  clock_gettime (CLOCK_MONOTONIC, ts);
+
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L)
+    {
+      ++ts->tv_sec;
+      ts->tv_nsec -= 1000000000L;
+    }
+}
+
+int
+sqon_pool_acquire (sqon_Pool *pool, sqon_DatabaseServer **out,
+		   long timeout_ms)
+{
+  int rc = 0;
+  struct timespec deadline;
+  struct idle_conn *conn, *expired;
+
+  if (timeout_ms > 0)
+    deadline_after (&deadline, timeout_ms);
+
+  pthread_mutex_lock (&pool->lock);
+
+  for (;;)
+    {
+      expired = take_expired (pool);
+      if (expired)
+	{
+	  pthread_mutex_unlock (&pool->lock);
+	  destroy_list (expired);
+	  pthread_mutex_lock (&pool->lock);
+	}
+
+      if (pool->idle)
+	{
+	  conn = pool->idle;
+	  pool->idle = conn->next;
+	  pthread_mutex_unlock (&pool->lock);
+
+	  /* a connection the server has dropped is replaced, not handed
+	     out */
+	  if (!sqon_ping (conn->srv))
+	    break;
+
+	  destroy (conn->srv);
+	  sqon_free (conn);
+
+	  pthread_mutex_lock (&pool->lock);
+	  --pool->size;
+	  continue;
+	}
+
+      if (pool->size < pool->max_size)
+	{
+	  ++pool->size;
+	  pthread_mutex_unlock (&pool->lock);
+
+	  rc = open_conn (pool, &conn);
+	  if (!rc)
+	    break;
+
+	  pthread_mutex_lock (&pool->lock);
+	  --pool->size;
+	  pthread_cond_signal (&pool->available);
+	  pthread_mutex_unlock (&pool->lock);
+	  return rc;
+	}
+
+      if (!timeout_ms)
+	rc = ETIMEDOUT;
+      else if (timeout_ms < 0)
+	rc = pthread_cond_wait (&pool->available, &pool->lock);
+      else
+	rc = pthread_cond_timedwait (&pool->available, &pool->lock,
+				     &deadline);
+
+      if (ETIMEDOUT == rc)
+	{
+	  pthread_mutex_unlock (&pool->lock);
+	  return SQON_TIMEOUT;
+	}
+    }
+
+  *out = conn->srv;
+  sqon_free (conn);
+  return 0;
+}
+
+void
+sqon_pool_release (sqon_Pool *pool, sqon_DatabaseServer *srv)
+{
+  struct idle_conn *conn = sqon_malloc (sizeof (struct idle_conn));
+
+  if (NULL == conn)
+    {
+      destroy (srv);
+      pthread_mutex_lock (&pool->lock);
+      --pool->size;
+      pthread_cond_signal (&pool->available);
+      pthread_mutex_unlock (&pool->lock);
+      return;
+    }
+
+  conn->srv = srv;
+
+  pthread_mutex_lock (&pool->lock);
+  push_idle (pool, conn);
+  pthread_cond_signal (&pool->available);
+  pthread_mutex_unlock (&pool->lock);
+}
@@ -0,0 +1,1078 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <inttypes.h>
+#include <poll.h>
+#include <postgresql/libpq-fe.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backend.h"
+#include "buffer.h"
+#include "bulk.h"
+#include "meta.h"
+#include "pgbinary.h"
+#include "result.h"
+#include "sqon.h"
+#include "workers.h"
+
+static int
+open_postgres (sqon_DatabaseServer *srv)
+{
+  int rc;
+  char timeout[16];
+  const char *const keys[] = {
+    "dbname", "host", "port", "user", "password", "connect_timeout", NULL
+  };
+  const char *values[] = {
+    srv->database, srv->host, srv->port, srv->user, srv->passwd, NULL, NULL
+  };
+
+  /* libpq counts whole seconds */
+  if (srv->connect_timeout_ms)
+    {
+      snprintf (timeout, sizeof timeout, "%u",
+		srv->connect_timeout_ms / 1000
+		+ (srv->connect_timeout_ms % 1000 != 0));
+      values[5] = timeout;
+    }
+
+  /* as with PQsetdbLogin(), a database name may hold connection options,
+     which the other arguments override unless empty */
+  srv->com = PQconnectdbParams (keys, values, 1);
+
+  if ((rc = PQstatus (srv->com)) == CONNECTION_OK)
+    rc = 0;
+
+  return rc;
+}
+
+static void
+close_postgres (sqon_DatabaseServer *srv)
+{
+  PQfinish (srv->com);
+}
+
+static int
+ping_postgres (sqon_DatabaseServer *srv)
+{
+  return PQstatus (srv->com) == CONNECTION_OK ? 0 : SQON_CONNECTERR;
+}
+
+static int
+query_postgres (sqon_DatabaseServer *srv, const char *query,
+		struct result_writer *w)
+{
+  int rc;
+  PGresult *res;
+
+  if (srv->output & SQON_OUTPUT_BINARY)
+    res = PQexecParams (srv->com, query, 0, NULL, NULL, NULL, NULL, 1);
+  else
+    res = PQexec (srv->com, query);
+
+  rc = PQresultStatus (res);
+  if (rc != PGRES_COMMAND_OK && rc != PGRES_TUPLES_OK)
+    {
+      PQclear (res);
+      return rc;
+    }
+
+  if (NULL == w)
+    rc = 0;
+  else if (PQnfields (res))
+    rc = result_writer_result (w, res);
+  else
+    rc = buffer_append (&w->buf, SQON_EMPTY_RESULT, SQON_EMPTY_RESULT_LEN);
+
+  PQclear (res);
+  return rc;
+}
+
+static void
+cancel_postgres (PGconn *conn)
+{
+  char errbuf[256];
+  PGcancel *cancel = PQgetCancel (conn);
+
+  if (NULL == cancel)
+    return;
+
+  PQcancel (cancel, errbuf, sizeof errbuf);
+  PQfreeCancel (cancel);
+}
+
+/* Opens a streamed result at the first one to have columns, as one with none
+   is written as the empty result instead. */
+static int
+begin_stream_postgres (struct result_writer *w, PGresult *res)
+{
+  union fields fields;
+  int rc = result_writer_begin (w);
+
+  fields.postgres = res;
+  if (!rc)
+    rc = result_writer_fields (w, fields, PQnfields (res));
+
+  return rc;
+}
+
+static int
+stream_postgres (sqon_DatabaseServer *srv, const char *query,
+		 struct result_writer *w, sqon_StreamCallback cb,
+		 void *userdata, size_t chunk_rows)
+{
+  int rc = 0;
+  size_t n = 0;
+  bool ended = false, empty = false;
+  PGresult *res;
+  union fields fields;
+  union row row;
+
+  if (!res_send_postgres (srv->com, query, srv->output))
+    return PGRES_FATAL_ERROR;
+
+  PQsetSingleRowMode (srv->com);
+  row.postgres = 0;
+
+  /* every result must be collected before the connection can be reused */
+  while ((res = PQgetResult (srv->com)))
+    {
+      if (!rc)
+	{
+	  fields.postgres = res;
+
+	  /* sqon_query() gives only the last result of several statements,
+	     which cannot be known until the rows of the others have been
+	     sent, so a stream takes only one */
+	  if (ended)
+	    rc = SQON_BADPARAMS;
+	  else
+	    switch (PQresultStatus (res))
+	      {
+	      case PGRES_SINGLE_TUPLE:
+		if (!w->num_fields)
+		  rc = begin_stream_postgres (w, res);
+
+		if (!rc)
+		  rc = result_writer_row (w, fields, row, NULL);
+
+		if (!rc && ++n % chunk_rows == 0)
+		  rc = result_writer_flush (w, cb, userdata);
+		break;
+
+	      case PGRES_TUPLES_OK:
+	      case PGRES_COMMAND_OK:
+		/* end of the set; also the only place to see an empty one's
+		   columns, or that there is no result set at all */
+		if (w->num_fields)
+		  ;
+		else if (PQnfields (res))
+		  rc = begin_stream_postgres (w, res);
+		else
+		  {
+		    rc = buffer_append (&w->buf, SQON_EMPTY_RESULT,
+					SQON_EMPTY_RESULT_LEN);
+		    empty = true;
+		  }
+		ended = true;
+		break;
+
+	      default:
+		rc = PQresultStatus (res);
+		break;
+	      }
+
+	  if (rc)
+	    cancel_postgres (srv->com);
+	}
+
+      PQclear (res);
+    }
+
+  if (!rc && !empty)
+    rc = result_writer_end (w);
+
+  if (!rc)
+    rc = result_writer_flush (w, cb, userdata);
+
+  return rc;
+}
+
+static int
+escape_postgres (sqon_DatabaseServer *srv, const char *in, char *out)
+{
+  char *quoted = PQescapeLiteral (srv->com, in, strlen (in));
+
+  if (NULL == quoted)
+    return SQON_MEMORYERROR;
+
+  /* the literal may be written E'...' when it holds backslashes */
+  quoted[strlen (quoted) - 1] = '\0';
+  strcpy (out, strstr (quoted, "'") + 1);
+
+  safe_memset (quoted, 0, strlen (quoted));
+  PQfreemem (quoted);
+  return 0;
+}
+
+static int
+load_postgres (sqon_DatabaseServer *srv, const char *query,
+	       struct table_meta *m)
+{
+  int rc;
+  int i, num_rows;
+  PGresult *res = PQexec (srv->com, query);
+
+  rc = PQresultStatus (res);
+  if (rc != PGRES_TUPLES_OK)
+    {
+      PQclear (res);
+      return rc;
+    }
+
+  num_rows = PQntuples (res);
+  rc = meta_alloc_columns (m, num_rows);
+  for (i = 0; !rc && i < num_rows; ++i)
+    rc = meta_add_column (m, PQgetvalue (res, i, 0), PQgetvalue (res, i, 1),
+			  !strcmp (PQgetvalue (res, i, 2), "t"));
+
+  PQclear (res);
+  return rc;
+}
+
+static int
+lag_postgres (sqon_DatabaseServer *srv, int64_t *lag_ms)
+{
+  int rc;
+  PGresult *res;
+
+  /* an idle primary commits nothing to replay, so a replica which has
+     replayed all it received is not behind however old its last commit */
+  res = PQexec (srv->com, "SELECT CASE WHEN NOT pg_is_in_recovery() "
+		  "OR pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() "
+		"THEN 0 ELSE EXTRACT(EPOCH FROM now() "
+		  "- pg_last_xact_replay_timestamp()) * 1000 END");
+
+  rc = PQresultStatus (res);
+  if (rc != PGRES_TUPLES_OK)
+    {
+      PQclear (res);
+      return rc;
+    }
+
+  if (PQntuples (res) != 1 || PQgetisnull (res, 0, 0))
+    *lag_ms = -1;
+  else
+    *lag_ms = (int64_t) strtod (PQgetvalue (res, 0, 0), NULL);
+
+  PQclear (res);
+  return 0;
+}
+
+static int
+bulk_postgres (sqon_DatabaseServer *srv, const char *table,
+	       const char *columns, struct bulk *b)
+{
+  int rc;
+  struct buffer buf;
+  PGresult *res;
+
+  buffer_init (&buf);
+  rc = buffer_append_str (&buf, "COPY ");
+  if (!rc)
+    rc = buffer_append_str (&buf, table);
+  if (!rc)
+    rc = buffer_append (&buf, " ", 1);
+  if (!rc)
+    rc = buffer_append_str (&buf, columns);
+  if (!rc)
+    rc = buffer_append (&buf, " FROM STDIN", sizeof " FROM STDIN");
+  if (rc)
+    {
+      buffer_free (&buf);
+      return rc;
+    }
+
+  res = PQexec (srv->com, buf.data);
+  rc = PQresultStatus (res);
+  PQclear (res);
+  if (rc != PGRES_COPY_IN)
+    {
+      buffer_free (&buf);
+      return rc;
+    }
+
+  /* the buffer is reused for the rows */
+  do
+    {
+      buf.len = 0;
+      rc = bulk_read_lines (b, &buf, BULK_CHUNK);
+      if (!rc && buf.len
+	  && PQputCopyData (srv->com, buf.data, (int) buf.len) != 1)
+	rc = SQON_CONNECTERR;
+    }
+  while (!rc && buf.len);
+
+  buffer_free (&buf);
+
+  /* failing the copy rolls back the rows already sent */
+  if (PQputCopyEnd (srv->com, rc ? "bad input to sqon_bulk_insert()" : NULL)
+      != 1 && !rc)
+    rc = SQON_CONNECTERR;
+
+  while ((res = PQgetResult (srv->com)))
+    {
+      if (!rc && PQresultStatus (res) != PGRES_COMMAND_OK)
+	rc = PQresultStatus (res);
+
+      PQclear (res);
+    }
+
+  return rc;
+}
+
+/* A cursor lives in a transaction, which is begun for it unless one is
+   already open. */
+struct cursor_postgres
+{
+  char name[32];
+  bool began;
+};
+
+static int
+command_postgres (PGconn *conn, const char *command)
+{
+  int rc;
+  PGresult *res = PQexec (conn, command);
+
+  rc = PQresultStatus (res);
+  PQclear (res);
+  return PGRES_COMMAND_OK == rc ? 0 : rc;
+}
+
+static int
+cursor_open_postgres (sqon_DatabaseServer *srv, const char *query, void **cur)
+{
+  int rc;
+  struct cursor_postgres *c;
+  struct buffer sql;
+
+  c = sqon_malloc (sizeof *c);
+  if (NULL == c)
+    return SQON_MEMORYERROR;
+
+  /* named for its address, which no other open cursor can share */
+  snprintf (c->name, sizeof c->name, "sqon_cursor_%" PRIxPTR,
+	    (uintptr_t) c);
+  c->began = PQTRANS_IDLE == PQtransactionStatus (srv->com);
+
+  buffer_init (&sql);
+  rc = buffer_append_str (&sql, "DECLARE ");
+  if (!rc)
+    rc = buffer_append_str (&sql, c->name);
+  if (!rc)
+    rc = buffer_append_str (&sql, " NO SCROLL CURSOR FOR ");
+  if (!rc)
+    rc = buffer_append (&sql, query, strlen (query) + 1);
+
+  if (!rc && c->began)
+    rc = command_postgres (srv->com, "BEGIN");
+
+  if (!rc)
+    {
+      rc = command_postgres (srv->com, sql.data);
+      if (rc && c->began)
+	command_postgres (srv->com, "ROLLBACK");
+    }
+
+  buffer_free (&sql);
+  if (rc)
+    {
+      sqon_free (c);
+      return rc;
+    }
+
+  *cur = c;
+  return 0;
+}
+
+static int
+cursor_fetch_postgres (sqon_DatabaseServer *srv, void *cur,
+		       struct result_writer *w, size_t n, size_t *rows)
+{
+  int rc;
+  char fetch[64];
+  struct cursor_postgres *c = cur;
+  PGresult *res;
+
+  snprintf (fetch, sizeof fetch, "FETCH FORWARD %zu FROM %s", n, c->name);
+
+  if (srv->output & SQON_OUTPUT_BINARY)
+    res = PQexecParams (srv->com, fetch, 0, NULL, NULL, NULL, NULL, 1);
+  else
+    res = PQexec (srv->com, fetch);
+
+  rc = PQresultStatus (res);
+  if (rc != PGRES_TUPLES_OK)
+    {
+      PQclear (res);
+      return rc;
+    }
+
+  *rows = (size_t) PQntuples (res);
+  rc = result_writer_result (w, res);
+
+  PQclear (res);
+  return rc;
+}
+
+static void
+cursor_close_postgres (sqon_DatabaseServer *srv, void *cur)
+{
+  char sql[64];
+  struct cursor_postgres *c = cur;
+
+  /* after an error, both fail but for ending the transaction */
+  snprintf (sql, sizeof sql, "CLOSE %s", c->name);
+  command_postgres (srv->com, sql);
+
+  if (c->began)
+    command_postgres (srv->com, "COMMIT");
+
+  sqon_free (c);
+}
+
+static const char *
+field_name_postgres (union fields fields, size_t i)
+{
+  return PQfname (fields.postgres, i);
+}
+
+static value_writer
+postgres_writer (const PGresult *res, size_t i)
+{
+  switch (PQftype (res, i))
+    {
+    case INT2OID:
+    case INT4OID:
+    case INT8OID:
+    case OIDOID:
+    case FLOAT4OID:
+    case FLOAT8OID:
+    case NUMERICOID:
+      return res_write_number;
+
+    case BOOLOID:
+      return res_write_bool_text;
+
+    case JSONOID:
+    case JSONBOID:
+      return res_write_raw;
+
+    default:
+      return res_write_string;
+    }
+}
+
+static int
+plan_postgres (struct result_writer *w, union fields fields, size_t i,
+	       struct column *c)
+{
+  c->index = i;
+  c->decode = NULL;
+  c->write = (w->flags & SQON_OUTPUT_TYPED)
+    ? postgres_writer (fields.postgres, i) : res_write_string;
+
+  /* columns sent in binary format are turned back into text before being
+     written */
+  if (PQfformat (fields.postgres, i) == 1)
+    return pgbinary_decoder (PQftype (fields.postgres, i), &c->decode);
+
+  return 0;
+}
+
+static int
+row_postgres (struct result_writer *w, union fields fields, union row row,
+	      const unsigned long *lengths)
+{
+  const PGresult *res = fields.postgres;
+  const struct column *c, *end = w->columns + w->num_columns;
+  const char *value = NULL;
+  size_t len = 0;
+  int rc = 0;
+
+  (void) lengths;
+
+  if (!w->arr)
+    {
+      int key = (int) w->key.index;
+
+      /* PostgreSQL reports a NULL key as the empty string */
+      value = PQgetvalue (res, row.postgres, key);
+      len = PQgetlength (res, row.postgres, key);
+      if (!PQgetisnull (res, row.postgres, key))
+	rc = result_writer_decode (w, &w->key, &value, &len);
+    }
+
+  if (!rc)
+    rc = result_writer_open_row (w, value, len);
+
+  for (c = w->columns; !rc && c < end; ++c)
+    {
+      int i = (int) c->index;
+
+      value = PQgetvalue (res, row.postgres, i);
+      len = PQgetlength (res, row.postgres, i);
+      if ('\0' == *value && PQgetisnull (res, row.postgres, i))
+	value = NULL;
+      else
+	rc = result_writer_decode (w, c, &value, &len);
+
+      if (!rc)
+	rc = result_writer_value (w, c, value, len);
+    }
+
+  if (!rc)
+    rc = result_writer_close_row (w);
+
+  return rc;
+}
+
+/* A range of rows serialized on one thread of the worker pool */
+struct part
+{
+  struct result_writer *w;
+  struct result_writer own;
+  PGresult *res;
+  int first;
+  int last;
+  int rc;
+};
+
+static int
+write_rows (struct result_writer *w, PGresult *res, int first, int last)
+{
+  int rc = 0;
+  union fields fields;
+  union row row;
+
+  fields.postgres = res;
+
+  for (row.postgres = first; !rc && row.postgres < last; ++row.postgres)
+    rc = result_writer_row (w, fields, row, NULL);
+
+  return rc;
+}
+
+static void
+write_part (void *arg, size_t i)
+{
+  struct part *p = (struct part *) arg + i;
+
+  p->rc = write_rows (p->w, p->res, p->first, p->last);
+}
+
+/* A PGresult can be read from any row and any thread, so a large one is cut
+   into ranges written side by side; the first is written by w itself, and
+   the others are joined onto it in order. */
+static int
+write_parallel (struct result_writer *w, PGresult *res, int num_rows,
+		size_t num_parts)
+{
+  int rc = 0;
+  size_t i;
+  struct part *parts = sqon_malloc (num_parts * sizeof (struct part));
+
+  if (NULL == parts)
+    return SQON_MEMORYERROR;
+
+  for (i = 0; i < num_parts; ++i)
+    {
+      struct part *p = &parts[i];
+
+      p->res = res;
+      p->first = (int) ((size_t) num_rows * i / num_parts);
+      p->last = (int) ((size_t) num_rows * (i + 1) / num_parts);
+
+      if (i)
+	{
+	  result_writer_fork (&p->own, w, (size_t) p->first);
+	  p->w = &p->own;
+	}
+      else
+	{
+	  p->w = w;
+	}
+    }
+
+  workers_run (write_part, parts, num_parts);
+
+  for (i = 0; i < num_parts; ++i)
+    {
+      if (!rc)
+	rc = parts[i].rc;
+
+      if (i)
+	{
+	  if (!rc)
+	    rc = result_writer_join (w, &parts[i].own);
+
+	  result_writer_free (&parts[i].own);
+	}
+    }
+
+  sqon_free (parts);
+  return rc;
+}
+
+static int
+result_postgres (struct result_writer *w, void *res)
+{
+  int rc;
+  int num_rows = PQntuples (res);
+  size_t num_parts = workers_parts ((size_t) num_rows);
+  union fields fields;
+
+  fields.postgres = res;
+  rc = result_writer_fields (w, fields, PQnfields (res));
+  if (rc)
+    return rc;
+
+  if (num_parts > 1)
+    return write_parallel (w, res, num_rows, num_parts);
+
+  return write_rows (w, res, 0, num_rows);
+}
+
+/* A statement prepared in the session, with the number of its
+   placeholders, which libpq cannot tell without asking */
+struct stmt_postgres
+{
+  int nparams;
+  char name[];
+};
+
+static int
+prepare_postgres (sqon_DatabaseServer *srv, const char *name,
+		  const char *sql, void **stmt)
+{
+  int rc;
+  PGresult *res;
+  struct stmt_postgres *s;
+
+  res = PQprepare (srv->com, name, sql, 0, NULL);
+  rc = PQresultStatus (res);
+  PQclear (res);
+
+  if (PGRES_COMMAND_OK != rc)
+    return rc;
+
+  res = PQdescribePrepared (srv->com, name);
+  rc = PQresultStatus (res);
+  if (PGRES_COMMAND_OK != rc)
+    {
+      PQclear (res);
+      return rc;
+    }
+
+  s = sqon_malloc (sizeof (struct stmt_postgres) + strlen (name) + 1);
+  if (NULL == s)
+    {
+      PQclear (res);
+      return SQON_MEMORYERROR;
+    }
+
+  s->nparams = PQnparams (res);
+  strcpy (s->name, name);
+  PQclear (res);
+
+  *stmt = s;
+  return 0;
+}
+
+static int
+execute_postgres (sqon_DatabaseServer *srv, void *stmt, size_t nparams,
+		  const char *const *values, const size_t *lengths,
+		  char **out, const char *pk)
+{
+  int rc;
+  struct stmt_postgres *s = stmt;
+  PGresult *res;
+
+  /* text parameters are read up to their terminator, so lengths are not
+     needed */
+  (void) lengths;
+
+  if (nparams != (size_t) s->nparams)
+    return SQON_BADPARAMS;
+
+  res = PQexecPrepared (srv->com, s->name, (int) nparams, values, NULL, NULL,
+			res_format (srv->output));
+
+  rc = PQresultStatus (res);
+  if (rc != PGRES_COMMAND_OK && rc != PGRES_TUPLES_OK)
+    {
+      PQclear (res);
+      return rc;
+    }
+
+  rc = 0;
+  if (NULL != out)
+    rc = res_to_json (SQON_DBCONN_POSTGRES, res, out, pk, srv->output);
+
+  PQclear (res);
+  return rc;
+}
+
+static void
+release_postgres (sqon_DatabaseServer *srv, void *stmt, bool drop)
+{
+  struct stmt_postgres *s = stmt;
+  char *name, *query;
+  size_t qlen;
+
+  if (drop)
+    {
+      name = PQescapeIdentifier (srv->com, s->name, strlen (s->name));
+      if (name)
+	{
+	  qlen = strlen (name) + sizeof "DEALLOCATE ";
+	  query = sqon_malloc (qlen * sizeof (char));
+	  if (query)
+	    {
+	      snprintf (query, qlen, "DEALLOCATE %s", name);
+	      PQclear (PQexec (srv->com, query));
+	      sqon_free (query);
+	    }
+
+	  PQfreemem (name);
+	}
+    }
+
+  sqon_free (s);
+}
+
+static int
+store_postgres (PGresult *res, char **out, const char *primary_key,
+		unsigned int flags)
+{
+  int rc = PQresultStatus (res);
+
+  switch (rc)
+    {
+    case PGRES_TUPLES_OK:
+      return out ? res_to_json (SQON_DBCONN_POSTGRES, res, out, primary_key,
+				flags) : 0;
+
+    case PGRES_COMMAND_OK:
+      return out ? res_empty (out) : 0;
+
+    default:
+      return rc;
+    }
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+/* Sends what the nonblocking conn has buffered, taking in whatever results
+   arrive meanwhile, lest the server stop reading the batch while it waits
+   for room to write them. */
+static int
+flush_pipeline (PGconn *conn)
+{
+  int rc;
+  struct pollfd pfd;
+
+  pfd.fd = PQsocket (conn);
+  pfd.events = POLLIN | POLLOUT;
+
+  while (1 == (rc = PQflush (conn)))
+    {
+      if (poll (&pfd, 1, -1) < 0)
+	continue;
+
+      if ((pfd.revents & ~POLLOUT) && !PQconsumeInput (conn))
+	return SQON_CONNECTERR;
+    }
+
+  return rc ? SQON_CONNECTERR : 0;
+}
+
+/* Sends the whole batch before reading any result. Everything up to the
+   single sync point runs in one implicit transaction, so a failure rolls the
+   earlier queries back and the server skips the later ones. */
+static int
+batch_postgres (sqon_DatabaseServer *srv, const char *const *queries,
+		size_t n, char **outs, const char *const *primary_keys)
+{
+  int rc = 0;
+  PGconn *conn = srv->com;
+  unsigned int flags = srv->output;
+  size_t i, sent;
+  PGresult *res;
+
+  if (!PQenterPipelineMode (conn))
+    return SQON_CONNECTERR;
+
+  if (PQsetnonblocking (conn, 1))
+    {
+      PQexitPipelineMode (conn);
+      return SQON_CONNECTERR;
+    }
+
+  for (sent = 0; !rc && sent < n; ++sent)
+    {
+      if (!PQsendQueryParams (conn, queries[sent], 0, NULL, NULL, NULL, NULL,
+			      res_format (flags)))
+	{
+	  rc = SQON_CONNECTERR;
+	  break;
+	}
+
+      rc = flush_pipeline (conn);
+    }
+
+  if (!PQpipelineSync (conn) || flush_pipeline (conn))
+    {
+      PQsetnonblocking (conn, 0);
+      PQexitPipelineMode (conn);
+      return SQON_CONNECTERR;
+    }
+
+  /* all of it is sent, so the results can be waited for */
+  PQsetnonblocking (conn, 0);
+
+  for (i = 0; i < sent; ++i)
+    {
+      while ((res = PQgetResult (conn)) != NULL)
+	{
+	  /* queries after a failed one come back as PGRES_PIPELINE_ABORTED,
+	     which is not the error worth reporting */
+	  if (!rc && PQresultStatus (res) != PGRES_PIPELINE_ABORTED)
+	    rc = store_postgres (res, outs ? &outs[i] : NULL,
+				 primary_keys ? primary_keys[i] : NULL, flags);
+
+	  PQclear (res);
+	}
+    }
+
+  res = PQgetResult (conn);
+  if (PQresultStatus (res) != PGRES_PIPELINE_SYNC && !rc)
+    rc = SQON_CONNECTERR;
+  PQclear (res);
+
+  PQexitPipelineMode (conn);
+  return rc;
+}
+#else
+/* Without pipelining each query is its own round trip, but they still run
+   in one transaction, so a failure rolls back the earlier ones as it would
+   in a pipeline. A transaction the caller already has open is left to the
+   caller. */
+static int
+batch_postgres (sqon_DatabaseServer *srv, const char *const *queries,
+		size_t n, char **outs, const char *const *primary_keys)
+{
+  int rc = 0;
+  PGconn *conn = srv->com;
+  unsigned int flags = srv->output;
+  size_t i;
+  PGresult *res;
+  bool own = PQTRANS_IDLE == PQtransactionStatus (conn);
+
+  if (own)
+    {
+      rc = command_postgres (conn, "BEGIN");
+      if (rc)
+	return rc;
+    }
+
+  for (i = 0; i < n && !rc; ++i)
+    {
+      if (flags & SQON_OUTPUT_BINARY)
+	res = PQexecParams (conn, queries[i], 0, NULL, NULL, NULL, NULL, 1);
+      else
+	res = PQexec (conn, queries[i]);
+      rc = store_postgres (res, outs ? &outs[i] : NULL,
+			   primary_keys ? primary_keys[i] : NULL, flags);
+      PQclear (res);
+    }
+
+  if (own && rc)
+    command_postgres (conn, "ROLLBACK");
+  else if (own)
+    rc = command_postgres (conn, "COMMIT");
+
+  return rc;
+}
+#endif
+
+static int
+async_send_postgres (sqon_Async *q)
+{
+  PGconn *conn = q->srv->com;
+
+  if (PQsetnonblocking (conn, 1)
+      || !res_send_postgres (conn, q->query, q->srv->output))
+    {
+      PQsetnonblocking (conn, 0);
+      return PGRES_FATAL_ERROR;
+    }
+
+  q->flushing = true;
+  return 0;
+}
+
+/* Reads whatever has arrived; the last result is kept, unless an earlier one
+   was an error. */
+static void
+async_step_postgres (sqon_Async *q, int events)
+{
+  PGconn *conn = q->srv->com;
+  PGresult *res;
+  int rc;
+
+  /* libpq finds out for itself what is ready */
+  (void) events;
+
+  if (!PQconsumeInput (conn))
+    {
+      q->rc = PGRES_FATAL_ERROR;
+      q->flushing = false;
+    }
+
+  if (q->flushing)
+    {
+      rc = PQflush (conn);
+      if (1 == rc)
+	return;
+
+      q->flushing = false;
+      if (rc)
+	q->rc = PGRES_FATAL_ERROR;
+    }
+
+  while (!PQisBusy (conn))
+    {
+      res = PQgetResult (conn);
+      if (NULL == res)
+	{
+	  q->state = ASYNC_READY;
+	  return;
+	}
+
+      rc = PQresultStatus (res);
+      if (q->rc || (rc != PGRES_COMMAND_OK && rc != PGRES_TUPLES_OK))
+	{
+	  if (!q->rc)
+	    q->rc = rc;
+
+	  PQclear (res);
+	  continue;
+	}
+
+      if (q->res)
+	PQclear (q->res);
+
+      /* as for MySQL, a statement with no result set leaves none, which
+	 completes as the empty result */
+      if (PQnfields (res))
+	q->res = res;
+      else
+	{
+	  PQclear (res);
+	  q->res = NULL;
+	}
+    }
+
+  /* a broken connection never stops being busy */
+  if (q->rc && PQstatus (conn) != CONNECTION_OK)
+    q->state = ASYNC_READY;
+}
+
+static int
+async_fd_postgres (sqon_DatabaseServer *srv)
+{
+  return PQsocket (srv->com);
+}
+
+static int
+async_events_postgres (const sqon_Async *q)
+{
+  return SQON_WAIT_READ | (q->flushing ? SQON_WAIT_WRITE : 0);
+}
+
+static void
+async_drain_postgres (sqon_Async *q)
+{
+  PGresult *res;
+
+  PQsetnonblocking (q->srv->com, 0);
+  PQflush (q->srv->com);
+  while ((res = PQgetResult (q->srv->com)))
+    PQclear (res);
+}
+
+static void
+async_clear_postgres (sqon_Async *q)
+{
+  if (q->res)
+    PQclear (q->res);
+
+  PQsetnonblocking (q->srv->com, 0);
+  q->res = NULL;
+}
+
+const struct backend postgres_backend = {
+  .open = open_postgres,
+  .close = close_postgres,
+  .ping = ping_postgres,
+  .query = query_postgres,
+  .stream = stream_postgres,
+  .escape = escape_postgres,
+  .meta_query = "SELECT a.attname, format_type(a.atttypid, a.atttypmod), "
+      "i.indisprimary IS NOT NULL "
+    "FROM pg_attribute a "
+    "LEFT JOIN pg_index i ON i.indrelid = a.attrelid "
+      "AND i.indisprimary AND a.attnum = ANY(i.indkey) "
+    "WHERE a.attrelid = '%s'::regclass "
+      "AND a.attnum > 0 AND NOT a.attisdropped "
+    "ORDER BY a.attnum",
+  .load_meta = load_postgres,
+  .replica_lag = lag_postgres,
+  .ident_quote = '"',
+  .booleans = { "false", "true" },
+  .bulk_load = bulk_postgres,
+  .cursor_open = cursor_open_postgres,
+  .cursor_fetch = cursor_fetch_postgres,
+  .cursor_close = cursor_close_postgres,
+  .prepare = prepare_postgres,
+  .execute = execute_postgres,
+  .release = release_postgres,
+  .batch = batch_postgres,
+  .async_send = async_send_postgres,
+  .async_step = async_step_postgres,
+  .async_fd = async_fd_postgres,
+  .async_events = async_events_postgres,
+  .async_drain = async_drain_postgres,
+  .async_clear = async_clear_postgres,
+  .field_name = field_name_postgres,
+  .plan_column = plan_postgres,
+  .write_row = row_postgres,
+  .write_result = result_postgres
+};
@@ -18,224 +18,590 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <jansson.h>
 
+#include "backend.h"
+#include "buffer.h"
+#include "keyset.h"
 #include "result.h"
 #include "sqon.h"
 
-static const char *
-get_field_name (uint8_t type, union fields fields, const size_t i)
+int
+res_write_string (struct buffer *buf, const char *value, size_t len)
+{
+  return buffer_append_json_string (buf, value, len);
+}
+
+static size_t
+skip_digits (const char *s, const char *end)
+{
+  const char *p = s;
+
+  while (p < end && *p >= '0' && *p <= '9')
+    ++p;
+
+  return p - s;
+}
+
+/* Whether s is a number in JSON's grammar; databases also print things like
+   NaN, Infinity and zero-filled integers, which are not. */
+static bool
+is_json_number (const char *s, size_t len)
 {
-  switch (type)
+  const char *end = s + len;
+  size_t n;
+
+  if (s < end && '-' == *s)
+    ++s;
+
+  n = skip_digits (s, end);
+  if (!n || (n > 1 && '0' == *s))
+    return false;
+  s += n;
+
+  if (s < end && '.' == *s)
     {
-    case SQON_DBCONN_MYSQL:
-      return fields.mysql[i].name;
+      n = skip_digits (++s, end);
+      if (!n)
+	return false;
+      s += n;
+    }
 
-    case SQON_DBCONN_POSTGRES:
-      return PQfname (fields.postgres, i);
+  if (s < end && ('e' == *s || 'E' == *s))
+    {
+      if (++s < end && ('+' == *s || '-' == *s))
+	++s;
 
-    default:
-      return NULL;
+      n = skip_digits (s, end);
+      if (!n)
+	return false;
+      s += n;
     }
+
+  return s == end;
 }
 
-static int
-check_pk (uint8_t type, union fields fields, size_t num_fields, const char *pk)
+int
+res_write_number (struct buffer *buf, const char *value, size_t len)
+{
+  if (!is_json_number (value, len))
+    return buffer_append_json_string (buf, value, len);
+
+  return buffer_append (buf, value, len);
+}
+
+int
+res_write_bool_text (struct buffer *buf, const char *value, size_t len)
+{
+  (void) len;
+
+  if ('t' == value[0])
+    return buffer_append (buf, "true", 4);
+
+  return buffer_append (buf, "false", 5);
+}
+
+int
+res_write_bool_bits (struct buffer *buf, const char *value, size_t len)
 {
-  int rc = 0;
   size_t i;
 
-  for (i = 0; i < num_fields; ++i)
-    {
-      const char *field_name = get_field_name (type, fields, i);
+  for (i = 0; i < len; ++i)
+    if (value[i])
+      return buffer_append (buf, "true", 4);
 
-      if (NULL == field_name)
-	{
-	  rc = SQON_UNSUPPORTED;
-	  break;
-	}
-      else if (strcmp (field_name, pk) != 0)
-	{
-	  rc = SQON_NOPK;
-	}
-      else
-	{
-	  rc = 0;
-	  break;
-	}
-    }
+  return buffer_append (buf, "false", 5);
+}
 
-  return rc;
+int
+res_write_bool_int (struct buffer *buf, const char *value, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; ++i)
+    if (value[i] >= '1' && value[i] <= '9')
+      return buffer_append (buf, "true", 4);
+
+  return buffer_append (buf, "false", 5);
 }
 
-static json_t *
-row_string (const char *str)
+int
+res_write_raw (struct buffer *buf, const char *value, size_t len)
 {
-  return NULL == str ? json_null () : json_string (str);
+  return buffer_append (buf, value, len);
 }
 
+/* Escapes the separator and key written ahead of a column's value, so that
+   rows only copy them. */
 static int
-make_json_row (uint8_t type, union fields fields, union row row, json_t *root,
-	       bool arr, size_t num_fields, const char *pk)
+plan_prefix (struct result_writer *w, struct column *c, const char *name,
+	     bool first)
+{
+  int rc;
+  char *prefix;
+  size_t skip = first ? 2 : 0;
+
+  w->scratch.len = 0;
+  rc = buffer_append (&w->scratch, ", ", 2);
+
+  if (!rc && !(w->flags & SQON_OUTPUT_COLUMNAR))
+    {
+      rc = buffer_append_json_string (&w->scratch, name, strlen (name));
+      if (!rc)
+	rc = buffer_append (&w->scratch, ": ", 2);
+    }
+
+  if (rc)
+    return rc;
+
+  prefix = arena_alloc (&w->arena, w->scratch.len);
+  if (NULL == prefix)
+    return SQON_MEMORYERROR;
+
+  memcpy (prefix, w->scratch.data, w->scratch.len);
+  c->prefix = prefix + skip;
+  c->prefix_len = w->scratch.len - skip;
+  return 0;
+}
+
+/* Index among the columns planned so far of the one named name, or
+   w->num_columns if there is none */
+static size_t
+find_planned (const struct result_writer *w, union fields fields,
+	      const char *name)
 {
-  int rc = 0;
   size_t i;
-  char *vpk = NULL;
-  json_t *jsonrow = json_object ();
 
-  if (NULL == jsonrow)
+  for (i = 0; i < w->num_columns; ++i)
+    if (!strcmp (w->backend->field_name (fields, w->columns[i].index), name))
+      break;
+
+  return i;
+}
+
+/* Builds everything about the columns which does not depend on the row, once
+   per result: which column is the key, and how each of the others is
+   written. A name repeated in the result, as in a join, is written once, as
+   JSON objects allow; like jansson's json_object_set() it keeps the place of
+   the first column so named and the value of the last, and the key is the
+   last column named as the primary key. */
+static int
+build_plan (struct result_writer *w, union fields fields)
+{
+  int rc;
+  size_t i, j;
+  bool found = w->arr;
+
+  w->columns = arena_alloc (&w->arena,
+			    w->num_fields * sizeof (struct column));
+  if (NULL == w->columns)
     return SQON_MEMORYERROR;
 
-  switch (type)
+  w->num_columns = 0;
+
+  for (i = 0; i < w->num_fields; ++i)
     {
-    case SQON_DBCONN_MYSQL:
-      for (i = 0; i < num_fields; ++i)
-	{
-	  const char *field_name = get_field_name (type, fields, i);
+      const char *field_name = w->backend->field_name (fields, i);
+      struct column *c = &w->columns[w->num_columns];
 
-	  if (arr || strcmp (field_name, pk) != 0)
-	    rc = json_object_set_new (jsonrow, field_name,
-				      row_string (row.mysql[i]));
-	  else
-	    vpk = row.mysql[i];
+      if (NULL == field_name)
+	return SQON_UNSUPPORTED;
 
+      if (!w->arr && !strcmp (field_name, w->pk))
+	{
+	  found = true;
+	  rc = w->backend->plan_column (w, fields, i, &w->key);
 	  if (rc)
-	    {
-	      rc = SQON_MEMORYERROR;
-	      break;
-	    }
+	    return rc;
+
+	  continue;
 	}
-      break;
 
-    case SQON_DBCONN_POSTGRES:
-      for (i = 0; i < num_fields; ++i)
+      j = find_planned (w, fields, field_name);
+      if (j < w->num_columns)
 	{
-	  const char *field_name = get_field_name (type, fields, i);
-	  char *value = PQgetvalue (fields.postgres, row.postgres, i);
-
-	  if (arr || strcmp (field_name, pk) != 0)
-	    {
-	      if (!strcmp (value, "") && PQgetisnull (fields.postgres,
-						      row.postgres, i))
-		value = NULL;
-
-	      rc = json_object_set_new (jsonrow, field_name,
-					row_string (value));
-	    }
-	  else
-	    {
-	      vpk = value;
-	    }
+	  const char *prefix = w->columns[j].prefix;
+	  size_t prefix_len = w->columns[j].prefix_len;
 
+	  rc = w->backend->plan_column (w, fields, i, &w->columns[j]);
+	  w->columns[j].prefix = prefix;
+	  w->columns[j].prefix_len = prefix_len;
 	  if (rc)
-	    {
-	      rc = SQON_MEMORYERROR;
-	      break;
-	    }
+	    return rc;
+
+	  continue;
 	}
-      break;
 
-    default:
-      rc = SQON_UNSUPPORTED;
-      break;
+      rc = w->backend->plan_column (w, fields, i, c);
+      if (!rc)
+	rc = plan_prefix (w, c, field_name, !w->num_columns);
+      if (rc)
+	return rc;
+
+      ++w->num_columns;
     }
 
+  return found ? 0 : SQON_NOPK;
+}
+
+int
+result_writer_decode (struct result_writer *w, const struct column *c,
+		      const char **value, size_t *len)
+{
+  int rc;
+
+  if (NULL == c->decode)
+    return 0;
+
+  w->scratch.len = 0;
+  rc = c->decode (&w->scratch, *value, *len);
+  if (rc)
+    return rc;
+
+  *value = w->scratch.len ? w->scratch.data : "";
+  *len = w->scratch.len;
+  return 0;
+}
+
+static int
+row_key (struct result_writer *w, const char *value, size_t len)
+{
+  int rc = keyset_add (&w->keys, value, len);
+  if (rc)
+    return rc;
+
+  rc = buffer_append_json_string (&w->buf, value, len);
+  if (rc)
+    return rc;
+
+  return buffer_append (&w->buf, ": ", 2);
+}
+
+int
+result_writer_open_row (struct result_writer *w, const char *key,
+			size_t key_len)
+{
+  int rc = 0;
+
+  if (w->num_rows++)
+    rc = buffer_append (&w->buf, ", ", 2);
+
+  if (!rc && !w->arr)
+    rc = row_key (w, key, key_len);
+
   if (!rc)
+    rc = buffer_append (&w->buf,
+			(w->flags & SQON_OUTPUT_COLUMNAR) ? "[" : "{", 1);
+
+  return rc;
+}
+
+int
+result_writer_close_row (struct result_writer *w)
+{
+  return buffer_append (&w->buf,
+			(w->flags & SQON_OUTPUT_COLUMNAR) ? "]" : "}", 1);
+}
+
+int
+result_writer_value (struct result_writer *w, const struct column *c,
+		     const char *value, size_t len)
+{
+  int rc = buffer_append (&w->buf, c->prefix, c->prefix_len);
+  if (rc)
+    return rc;
+
+  if (NULL == value)
+    return buffer_append (&w->buf, "null", 4);
+
+  return c->write (&w->buf, value, len);
+}
+
+static void
+init_writer (struct result_writer *w, const struct backend *backend,
+	     const char *pk, unsigned int flags)
+{
+  w->backend = backend;
+  w->arr = (NULL == pk || !strcmp (pk, ""));
+  w->pk = pk;
+  w->flags = flags;
+  w->columns = NULL;
+  w->num_columns = 0;
+  w->num_fields = 0;
+  w->num_rows = 0;
+  arena_init (&w->arena);
+  buffer_init (&w->buf);
+  buffer_init (&w->scratch);
+  keyset_init (&w->keys, &w->arena);
+  compressor_clear (&w->compress);
+}
+
+void
+result_writer_init (struct result_writer *w, uint8_t type, const char *pk,
+		    unsigned int flags)
+{
+  init_writer (w, backend_get (type), pk, flags);
+}
+
+void
+result_writer_fork (struct result_writer *part,
+		    const struct result_writer *w, size_t first_row)
+{
+  init_writer (part, w->backend, w->pk, w->flags);
+
+  part->columns = w->columns;
+  part->num_columns = w->num_columns;
+  part->key = w->key;
+  part->num_fields = w->num_fields;
+  part->num_rows = first_row;
+}
+
+int
+result_writer_join (struct result_writer *w, const struct result_writer *part)
+{
+  int rc = 0;
+
+  if (!w->arr)
+    rc = keyset_merge (&w->keys, &part->keys);
+
+  if (!rc)
+    rc = buffer_append (&w->buf, part->buf.data, part->buf.len);
+
+  if (!rc)
+    w->num_rows = part->num_rows;
+
+  return rc;
+}
+
+void
+result_writer_free (struct result_writer *w)
+{
+  buffer_free (&w->buf);
+  buffer_free (&w->scratch);
+  arena_free (&w->arena);
+  compressor_free (&w->compress);
+}
+
+int
+result_writer_begin (struct result_writer *w)
+{
+  if (w->flags & SQON_OUTPUT_COLUMNAR)
+    return buffer_append_str (&w->buf, "{\"columns\": [");
+
+  return buffer_append (&w->buf, w->arr ? "[" : "{", 1);
+}
+
+/* Writes the header of a columnar result, which names the columns in the
+   order their values appear in each row, and opens its rows. */
+static int
+write_columns (struct result_writer *w, union fields fields)
+{
+  int rc = 0;
+  size_t i;
+
+  for (i = 0; !rc && i < w->num_columns; ++i)
     {
-      if (arr)
-	json_array_append (root, jsonrow);
-      else if (NULL == json_object_get (root, vpk))
-	json_object_set (root, vpk, jsonrow);
-      else
-	rc = SQON_PKNOTUNIQUE;
+      const char *field_name =
+	w->backend->field_name (fields, w->columns[i].index);
+
+      if (i)
+	rc = buffer_append (&w->buf, ", ", 2);
+
+      if (!rc)
+	rc = buffer_append_json_string (&w->buf, field_name,
+					strlen (field_name));
     }
 
-  json_decref (jsonrow);
+  if (!rc)
+    rc = buffer_append_str (&w->buf, w->arr ? "], \"rows\": ["
+			    : "], \"rows\": {");
+
   return rc;
 }
 
 int
-res_to_json (uint8_t type, void *res, char **out, const char *pk)
+result_writer_fields (struct result_writer *w, union fields fields,
+		      size_t num_fields)
 {
-  int rc = 0;
-  bool arr = (NULL == pk || !strcmp (pk, ""));
-  json_t *root;
-  size_t num_fields;
-  union fields fields;
-  union row row;
-
-  if (arr)
-    root = json_array ();
+  int rc;
+  bool first;
+
+  if (NULL == w->backend)
+    return SQON_UNSUPPORTED;
+
+  if (!num_fields)
+    return SQON_NOCOLUMNS;
+
+  /* the rows of a further result follow on from those already written,
+     under the same header */
+  first = (NULL == w->columns);
+  if (!first && (w->flags & SQON_OUTPUT_COLUMNAR)
+      && num_fields != w->num_fields)
+    return SQON_BADPARAMS;
+
+  w->num_fields = num_fields;
+  rc = build_plan (w, fields);
+
+  if (!rc && first && (w->flags & SQON_OUTPUT_COLUMNAR))
+    rc = write_columns (w, fields);
+
+  return rc;
+}
+
+int
+result_writer_row (struct result_writer *w, union fields fields,
+		   union row row, const unsigned long *lengths)
+{
+  return w->backend->write_row (w, fields, row, lengths);
+}
+
+int
+result_writer_end (struct result_writer *w)
+{
+  if (w->flags & SQON_OUTPUT_COLUMNAR)
+    return buffer_append (&w->buf, w->arr ? "]}" : "}}", 2);
+
+  return buffer_append (&w->buf, w->arr ? "]" : "}", 1);
+}
+
+int
+result_writer_result (struct result_writer *w, void *res)
+{
+  int rc = result_writer_begin (w);
+
+  if (!rc)
+    rc = w->backend->write_result (w, res);
+
+  if (!rc)
+    rc = result_writer_end (w);
+
+  return rc;
+}
+
+void
+result_writer_reset (struct result_writer *w)
+{
+  arena_free (&w->arena);
+  arena_init (&w->arena);
+  keyset_init (&w->keys, &w->arena);
+  w->buf.len = 0;
+  w->columns = NULL;
+  w->num_columns = 0;
+  w->num_fields = 0;
+  w->num_rows = 0;
+}
+
+int
+result_writer_compress (struct result_writer *w, uint8_t format, int level)
+{
+  if (SQON_COMPRESS_NONE == format)
+    return 0;
+
+  return compressor_init (&w->compress, format, level);
+}
+
+int
+result_writer_flush (struct result_writer *w, sqon_StreamCallback cb,
+		     void *userdata)
+{
+  int rc;
+
+  if (!w->buf.len)
+    return 0;
+
+  if (w->compress.active)
+    rc = compressor_write (&w->compress, w->buf.data, w->buf.len, cb,
+			   userdata);
   else
-    root = json_object ();
+    rc = cb (w->buf.data, w->buf.len, userdata);
 
-  if (NULL == root)
-    return SQON_MEMORYERROR;
+  /* keep the allocation, so memory stays bounded by the chunk size */
+  w->buf.len = 0;
+  return rc;
+}
 
-  switch (type)
-    {
-    case SQON_DBCONN_MYSQL:
-      num_fields = mysql_num_fields (res);
-      if (!num_fields)
-	{
-	  rc = SQON_NOCOLUMNS;
-	  break;
-	}
+int
+result_writer_finish (struct result_writer *w, sqon_StreamCallback cb,
+		      void *userdata)
+{
+  int rc = result_writer_flush (w, cb, userdata);
 
-      fields.mysql = mysql_fetch_fields (res);
-      if (!arr)
-	{
-	  rc = check_pk (type, fields, num_fields, pk);
-	  if (rc)
-	    break;
-	}
+  if (!rc && w->compress.active)
+    rc = compressor_finish (&w->compress, cb, userdata);
 
-      while ((row.mysql = mysql_fetch_row (res)))
-	{
-	  rc = make_json_row (type, fields, row, root, arr, num_fields, pk);
-	  if (rc)
-	    break;
-	}
-      break;
+  return rc;
+}
 
-    case SQON_DBCONN_POSTGRES:
-      num_fields = PQnfields (res);
-      if (!num_fields)
-	{
-	  rc = SQON_NOCOLUMNS;
-	  break;
-	}
+int
+res_format (unsigned int flags)
+{
+  return (flags & SQON_OUTPUT_BINARY) ? 1 : 0;
+}
 
-      fields.postgres = res;
-      if (!arr)
-	{
-	  rc = check_pk (type, fields, num_fields, pk);
-	  if (rc)
-	    break;
-	}
+int
+res_send_postgres (PGconn *conn, const char *query, unsigned int flags)
+{
+  if (flags & SQON_OUTPUT_BINARY)
+    return PQsendQueryParams (conn, query, 0, NULL, NULL, NULL, NULL, 1);
 
-      int num_rows = PQntuples (res);
-      for (int i = 0; i < num_rows; ++i)
-	{
-	  row.postgres = i;
-	  rc = make_json_row (type, fields, row, root, arr, num_fields, pk);
-	  if (rc)
-	    break;
-	}
-      break;
+  return PQsendQuery (conn, query);
+}
 
-    default:
-      rc = SQON_UNSUPPORTED;
-      break;
+int
+res_empty (char **out)
+{
+  *out = sqon_malloc ((SQON_EMPTY_RESULT_LEN + 1) * sizeof (char));
+  if (NULL == *out)
+    return SQON_MEMORYERROR;
+
+  strcpy (*out, SQON_EMPTY_RESULT);
+  return 0;
+}
+
+int
+res_query (sqon_DatabaseServer *srv, const char *query, char **out,
+	   const char *pk)
+{
+  int rc;
+  struct result_writer w;
+
+  if (NULL == out)
+    return backend_get (srv->type)->query (srv, query, NULL);
+
+  result_writer_init (&w, srv->type, pk, srv->output);
+
+  rc = w.backend->query (srv, query, &w);
+  if (!rc)
+    {
+      *out = buffer_finish (&w.buf);
+      if (NULL == *out)
+	rc = SQON_MEMORYERROR;
     }
 
+  result_writer_free (&w);
+  return rc;
+}
+
+int
+res_to_json (uint8_t type, void *res, char **out, const char *pk,
+	     unsigned int flags)
+{
+  int rc;
+  struct result_writer w;
+
+  result_writer_init (&w, type, pk, flags);
+
+  if (NULL == w.backend)
+    rc = SQON_UNSUPPORTED;
+  else
+    rc = result_writer_result (&w, res);
+
   if (!rc)
     {
-      *out = json_dumps (root, JSON_PRESERVE_ORDER);
+      *out = buffer_finish (&w.buf);
       if (NULL == *out)
 	rc = SQON_MEMORYERROR;
     }
 
-  json_decref (root);
+  result_writer_free (&w);
   return rc;
 }
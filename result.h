@@ -20,27 +20,208 @@
 
 #include <mysql/mysql.h>
 #include <postgresql/libpq-fe.h>
+#include <sqlite3.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+#include "buffer.h"
+#include "compress.h"
+#include "keyset.h"
+#include "pgbinary.h"
+#include "sqon.h"
+
+/* Result of a statement which returns no result set */
+#define SQON_EMPTY_RESULT "[]"
+#define SQON_EMPTY_RESULT_LEN (sizeof (SQON_EMPTY_RESULT) - 1)
 
 union res
 {
   MYSQL_RES *mysql;
   PGresult *postgres;
+  sqlite3_stmt *sqlite;
 };
 
 union fields
 {
   MYSQL_FIELD *mysql;
   PGresult *postgres;
+  sqlite3_stmt *sqlite;
 };
 
+/* SQLite's current row is that of its statement, so it has no member */
 union row
 {
   MYSQL_ROW mysql;
   int postgres;
 };
 
+struct backend;
+
+/* Writes one non-NULL value of a column */
+typedef int (*value_writer) (struct buffer *buf, const char *value,
+			     size_t len);
+
+/* How one column is written, worked out once per result */
+struct column
+{
+  size_t index;
+  /* separator and quoted name, written ahead of the value */
+  const char *prefix;
+  size_t prefix_len;
+  value_decoder decode;
+  value_writer write;
+};
+
+/* Incremental JSON serializer for result sets. Rows may be fed from one
+   result or from many (such as libpq's single-row mode), and the buffer may
+   be drained between rows by the caller. */
+struct result_writer
+{
+  struct arena arena;
+  struct buffer buf;
+  struct keyset keys;
+  const struct backend *backend;
+  bool arr;
+  const char *pk;
+  unsigned int flags;
+  struct column *columns;
+  size_t num_columns;
+  struct column key;
+  struct buffer scratch;
+  size_t num_fields;
+  size_t num_rows;
+  /* applied by result_writer_flush(), when active */
+  struct compressor compress;
+};
+
+void
+result_writer_init (struct result_writer *w, uint8_t type, const char *pk,
+		    unsigned int flags);
+
+void
+result_writer_free (struct result_writer *w);
+
+/* Sets up part to write rows of the same result as w, whose columns have
+   been planned, starting with row first_row; the rows are added to w by
+   result_writer_join(), and part may then be freed. Only w's plan is
+   shared, so w and its parts can write on different threads. */
+void
+result_writer_fork (struct result_writer *part,
+		    const struct result_writer *w, size_t first_row);
+
+/* Appends the rows written by part, which follow those already in w, and
+   checks that their keys are not in w too. */
+int
+result_writer_join (struct result_writer *w, const struct result_writer *part);
+
+int
+result_writer_begin (struct result_writer *w);
+
+/* Plans the columns of a result. Given those of another result, its rows
+   are written after the rows already there; columnar output then needs the
+   same columns in the same order. */
+int
+result_writer_fields (struct result_writer *w, union fields fields,
+		      size_t num_fields);
+
+int
+result_writer_row (struct result_writer *w, union fields fields,
+		   union row row, const unsigned long *lengths);
+
+int
+result_writer_end (struct result_writer *w);
+
+/* Writes a whole result of the writer's type, from begin to end. */
+int
+result_writer_result (struct result_writer *w, void *res);
+
+/* Throws away what has been written, so that another result can be. */
+void
+result_writer_reset (struct result_writer *w);
+
+/* Compresses what is flushed from now on; format is an enum
+   sqon_compression, of which SQON_COMPRESS_NONE does nothing. */
+int
+result_writer_compress (struct result_writer *w, uint8_t format, int level);
+
+/* Hands what has been written so far to cb and empties the buffer. */
+int
+result_writer_flush (struct result_writer *w, sqon_StreamCallback cb,
+		     void *userdata);
+
+/* The last flush, which also ends the compressed stream if there is one */
+int
+result_writer_finish (struct result_writer *w, sqon_StreamCallback cb,
+		      void *userdata);
+
+/* Helpers for a backend's write_row: a row is opened (with its key, unless
+   the result is an array), given the value of each planned column in order,
+   and closed. A NULL value is written as null. */
+int
+result_writer_open_row (struct result_writer *w, const char *key,
+			size_t key_len);
+
+int
+result_writer_value (struct result_writer *w, const struct column *c,
+		     const char *value, size_t len);
+
+int
+result_writer_close_row (struct result_writer *w);
+
+/* Turns a value the server sent in binary format back into text, if the
+   column has a decoder; the text lives until the next call. */
+int
+result_writer_decode (struct result_writer *w, const struct column *c,
+		      const char **value, size_t *len);
+
+/* Value writers for a backend's plan_column */
+int
+res_write_string (struct buffer *buf, const char *value, size_t len);
+
+/* A number, unless it has no JSON form, such as NaN */
+int
+res_write_number (struct buffer *buf, const char *value, size_t len);
+
+/* t or f, as PostgreSQL prints booleans */
+int
+res_write_bool_text (struct buffer *buf, const char *value, size_t len);
+
+/* Raw bytes, as MySQL sends BIT values; true if any bit is set */
+int
+res_write_bool_bits (struct buffer *buf, const char *value, size_t len);
+
+/* An integer, false if zero */
+int
+res_write_bool_int (struct buffer *buf, const char *value, size_t len);
+
+/* A JSON document the server has already checked */
+int
+res_write_raw (struct buffer *buf, const char *value, size_t len);
+
+/* Exported, as it always has been, though not declared in sqon.h */
+__attribute__ ((visibility ("default")))
+int
+res_to_json (uint8_t type, void *res, char **out, const char *pk,
+	     unsigned int flags);
+
+/* The libpq resultFormat to request for the given output flags */
+int
+res_format (unsigned int flags);
+
+/* PQsendQuery(), unless the flags want binary results, which only
+   PQsendQueryParams() can ask for */
+int
+res_send_postgres (PGconn *conn, const char *query, unsigned int flags);
+
+/* Allocates a copy of the empty result. */
+int
+res_empty (char **out);
+
+/* sqon_query() on a connected srv */
 int
-res_to_json (uint8_t type, void *res, char **out, const char *pk);
+res_query (sqon_DatabaseServer *srv, const char *query, char **out,
+	   const char *pk);
 
 #endif
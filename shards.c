@@ -0,0 +1,360 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "async.h"
+#include "backend.h"
+#include "result.h"
+#include "sqon.h"
+
+#define MIN_SHARDS 8
+
+struct shard
+{
+  sqon_DatabaseServer *srv;
+  unsigned int timeout_ms;
+  int rc;
+  /* while a query runs */
+  sqon_Async *q;
+  bool done;
+};
+
+struct sqon_shard_group
+{
+  struct shard *shards;
+  size_t num_shards;
+  size_t cap;
+};
+
+static int64_t
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+sqon_ShardGroup *
+sqon_shards_new (void)
+{
+  sqon_ShardGroup *g = sqon_malloc (sizeof (sqon_ShardGroup));
+  if (NULL == g)
+    return NULL;
+
+  g->shards = NULL;
+  g->num_shards = 0;
+  g->cap = 0;
+  return g;
+}
+
+void
+sqon_shards_free (sqon_ShardGroup *g)
+{
+  if (g->shards)
+    sqon_free (g->shards);
+
+  sqon_free (g);
+}
+
+int
+sqon_shards_add (sqon_ShardGroup *g, sqon_DatabaseServer *srv,
+		 unsigned int timeout_ms)
+{
+  struct shard *s;
+
+  if (g->num_shards == g->cap)
+    {
+      size_t cap = g->cap ? g->cap * 2 : MIN_SHARDS;
+
+      if (cap > SIZE_MAX / sizeof (struct shard))
+	return SQON_OVERFLOW;
+
+      s = sqon_malloc (cap * sizeof (struct shard));
+      if (NULL == s)
+	return SQON_MEMORYERROR;
+
+      if (g->shards)
+	{
+	  memcpy (s, g->shards, g->num_shards * sizeof (struct shard));
+	  sqon_free (g->shards);
+	}
+
+      g->shards = s;
+      g->cap = cap;
+    }
+
+  s = &g->shards[g->num_shards++];
+  s->srv = srv;
+  s->timeout_ms = timeout_ms;
+  s->rc = 0;
+  s->q = NULL;
+  s->done = true;
+  return 0;
+}
+
+int
+sqon_shard_error (const sqon_ShardGroup *g, size_t i)
+{
+  return g->shards[i].rc;
+}
+
+static int
+from_poll (short revents)
+{
+  /* errors and hangups are only found out by trying */
+  if (revents & (POLLERR | POLLHUP | POLLNVAL))
+    return SQON_WAIT_READ | SQON_WAIT_WRITE;
+
+  return ((revents & POLLIN) ? SQON_WAIT_READ : 0)
+    | ((revents & POLLOUT) ? SQON_WAIT_WRITE : 0);
+}
+
+/* Marks a shard done once its query has completed. */
+static void
+advance (struct shard *s, int events)
+{
+  void *res;
+
+  if (!sqon_async_advance (s->q, events))
+    return;
+
+  s->rc = async_result (s->q, &res);
+  s->done = true;
+}
+
+/* Runs every shard's query until each has completed or timed out, counting
+   from start. A shard which times out has its socket shut down, so that
+   freeing the query does not wait for the server; its connection is opened
+   again when next used. */
+static int
+wait_shards (sqon_ShardGroup *g, int64_t start)
+{
+  size_t i, n;
+  int64_t now, deadline;
+  int timeout, events;
+  bool ready;
+  struct pollfd *fds;
+  struct shard **polled;
+
+  fds = sqon_malloc (g->num_shards * sizeof (struct pollfd));
+  polled = sqon_malloc (g->num_shards * sizeof (struct shard *));
+  if (NULL == fds || NULL == polled)
+    {
+      if (fds)
+	sqon_free (fds);
+      if (polled)
+	sqon_free (polled);
+      return SQON_MEMORYERROR;
+    }
+
+  for (;;)
+    {
+      n = 0;
+      timeout = -1;
+      ready = false;
+      now = now_ms ();
+
+      for (i = 0; i < g->num_shards; ++i)
+	{
+	  struct shard *s = &g->shards[i];
+
+	  if (s->done)
+	    continue;
+
+	  deadline = start + s->timeout_ms;
+	  if (s->timeout_ms && now >= deadline)
+	    {
+	      shutdown (sqon_async_fd (s->q), SHUT_RDWR);
+	      s->rc = SQON_TIMEOUT;
+	      s->done = true;
+	      continue;
+	    }
+
+	  events = sqon_async_events (s->q);
+	  if (!events)
+	    {
+	      /* nothing to wait for; look again without sleeping */
+	      advance (s, 0);
+	      ready = true;
+	      continue;
+	    }
+
+	  fds[n].fd = sqon_async_fd (s->q);
+	  fds[n].events = ((events & SQON_WAIT_READ) ? POLLIN : 0)
+	    | ((events & SQON_WAIT_WRITE) ? POLLOUT : 0);
+	  fds[n].revents = 0;
+	  polled[n++] = s;
+
+	  if (s->timeout_ms && (timeout < 0 || deadline - now < timeout))
+	    timeout = (int) (deadline - now);
+	}
+
+      if (!n)
+	{
+	  if (ready)
+	    continue;
+
+	  break;
+	}
+
+      if (poll (fds, n, ready ? 0 : timeout) < 0)
+	continue;
+
+      for (i = 0; i < n; ++i)
+	if (fds[i].revents)
+	  advance (polled[i], from_poll (fds[i].revents));
+    }
+
+  sqon_free (fds);
+  sqon_free (polled);
+  return 0;
+}
+
+/* Writes the rows of every shard which succeeded, in the order the shards
+   were added, as one result; the keys of all of them must be unique. */
+static int
+merge_shards (sqon_ShardGroup *g, char **out, const char *pk)
+{
+  int rc = 0;
+  size_t i;
+  bool begun = false;
+  void *res;
+  struct result_writer w;
+
+  for (i = 0; !rc && i < g->num_shards; ++i)
+    {
+      struct shard *s = &g->shards[i];
+
+      if (s->rc || NULL == s->q || async_result (s->q, &res) || NULL == res)
+	continue;
+
+      if (!begun)
+	{
+	  result_writer_init (&w, s->srv->type, pk, s->srv->output);
+	  rc = result_writer_begin (&w);
+	  begun = true;
+	}
+
+      /* shards may be of different kinds, as each result is planned on its
+	 own */
+      w.backend = backend_get (s->srv->type);
+
+      if (!rc)
+	rc = w.backend->write_result (&w, res);
+    }
+
+  if (!begun)
+    return res_empty (out);
+
+  if (!rc)
+    rc = result_writer_end (&w);
+
+  if (!rc)
+    {
+      *out = buffer_finish (&w.buf);
+      if (NULL == *out)
+	rc = SQON_MEMORYERROR;
+    }
+
+  result_writer_free (&w);
+  return rc;
+}
+
+int
+sqon_query_shards (sqon_ShardGroup *g, const char *query, char **out,
+		   const char *primary_key)
+{
+  int rc, first_error = 0;
+  size_t i, failed = 0;
+  int64_t start = now_ms ();
+
+  *out = NULL;
+
+  /* connecting blocks, so it is done for every shard before waiting on any
+     of them; each shard's time runs from the start, and what is left of it
+     limits its connect */
+  for (i = 0; i < g->num_shards; ++i)
+    {
+      struct shard *s = &g->shards[i];
+      unsigned int connect_timeout = s->srv->connect_timeout_ms;
+      int64_t left = start + s->timeout_ms - now_ms ();
+
+      s->q = NULL;
+      s->done = true;
+
+      if (s->timeout_ms && left <= 0)
+	{
+	  s->rc = SQON_TIMEOUT;
+	  continue;
+	}
+
+      if (s->timeout_ms)
+	s->srv->connect_timeout_ms = (unsigned int) left;
+
+      s->rc = sqon_query_async (s->srv, query, NULL, NULL, NULL, &s->q);
+      s->srv->connect_timeout_ms = connect_timeout;
+
+      if (s->rc && s->timeout_ms && now_ms () >= start + s->timeout_ms)
+	s->rc = SQON_TIMEOUT;
+
+      s->done = (s->rc != 0);
+    }
+
+  rc = wait_shards (g, start);
+
+  for (i = 0; i < g->num_shards; ++i)
+    {
+      struct shard *s = &g->shards[i];
+
+      if (rc && !s->done)
+	s->rc = rc;
+
+      if (s->rc)
+	{
+	  if (!failed++)
+	    first_error = s->rc;
+	}
+    }
+
+  if (!rc && failed < g->num_shards)
+    rc = merge_shards (g, out, primary_key);
+
+  for (i = 0; i < g->num_shards; ++i)
+    {
+      if (g->shards[i].q)
+	sqon_async_free (g->shards[i].q);
+
+      g->shards[i].q = NULL;
+      g->shards[i].done = true;
+    }
+
+  if (rc)
+    return rc;
+
+  if (failed == g->num_shards && failed)
+    return first_error;
+
+  return failed ? SQON_INCOMPLETE : 0;
+}
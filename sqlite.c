@@ -0,0 +1,477 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sqlite3.h>
+#include <string.h>
+
+#include "backend.h"
+#include "buffer.h"
+#include "meta.h"
+#include "result.h"
+#include "sqon.h"
+
+/* The database is a file (or a URI such as file:ref.db?mode=ro) in this
+   process; there is no server to log in to. */
+static int
+open_sqlite (sqon_DatabaseServer *srv)
+{
+  const char *path = srv->database ? srv->database : srv->host;
+
+  return sqlite3_open_v2 (path, (sqlite3 **) &srv->com,
+			  SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE
+			  | SQLITE_OPEN_URI, NULL);
+}
+
+static void
+close_sqlite (sqon_DatabaseServer *srv)
+{
+  sqlite3_close_v2 (srv->com);
+}
+
+static int
+ping_sqlite (sqon_DatabaseServer *srv)
+{
+  /* an open handle cannot be dropped from under us */
+  (void) srv;
+  return 0;
+}
+
+static int
+step_sqlite (sqlite3_stmt *stmt)
+{
+  int rc;
+
+  while ((rc = sqlite3_step (stmt)) == SQLITE_ROW)
+    ;
+
+  return SQLITE_DONE == rc ? 0 : rc;
+}
+
+/* Steps through the rows of stmt into w, handing w's buffer to cb every
+   chunk_rows rows if cb is given. */
+static int
+rows_sqlite (struct result_writer *w, sqlite3_stmt *stmt,
+	     sqon_StreamCallback cb, void *userdata, size_t chunk_rows)
+{
+  int rc;
+  size_t n = 0;
+  union fields fields;
+  union row row;
+
+  fields.sqlite = stmt;
+  row.mysql = NULL;
+
+  rc = result_writer_fields (w, fields, sqlite3_column_count (stmt));
+  while (!rc)
+    {
+      rc = sqlite3_step (stmt);
+      if (SQLITE_DONE == rc)
+	return 0;
+
+      if (SQLITE_ROW != rc)
+	return rc;
+
+      rc = result_writer_row (w, fields, row, NULL);
+      if (!rc && cb && ++n % chunk_rows == 0)
+	rc = result_writer_flush (w, cb, userdata);
+    }
+
+  return rc;
+}
+
+/* Runs each statement of the query in turn; the result is that of the
+   last, as with PostgreSQL. */
+static int
+query_sqlite (sqon_DatabaseServer *srv, const char *query,
+	      struct result_writer *w)
+{
+  int rc = 0;
+  const char *tail = query;
+  sqlite3_stmt *stmt;
+
+  while (!rc && *tail)
+    {
+      rc = sqlite3_prepare_v2 (srv->com, tail, -1, &stmt, &tail);
+      /* NULL for blanks and comments */
+      if (rc || NULL == stmt)
+	continue;
+
+      if (w)
+	result_writer_reset (w);
+
+      if (w && sqlite3_column_count (stmt))
+	rc = result_writer_result (w, stmt);
+      else
+	rc = step_sqlite (stmt);
+
+      sqlite3_finalize (stmt);
+    }
+
+  if (!rc && w && !w->buf.len)
+    rc = buffer_append (&w->buf, SQON_EMPTY_RESULT, SQON_EMPTY_RESULT_LEN);
+
+  return rc;
+}
+
+/* Prepares a query which must be one statement, as when rows are handed out
+   as it steps, leaving no time to run the rest of a query after it */
+static int
+prepare_one (sqon_DatabaseServer *srv, const char *query,
+	     sqlite3_stmt **stmt)
+{
+  int rc;
+  const char *tail;
+  sqlite3_stmt *next = NULL;
+
+  rc = sqlite3_prepare_v2 (srv->com, query, -1, stmt, &tail);
+  if (rc)
+    return rc;
+
+  rc = sqlite3_prepare_v2 (srv->com, tail, -1, &next, NULL);
+  if (!rc && (NULL == *stmt || next))
+    rc = SQON_BADPARAMS;
+
+  sqlite3_finalize (next);
+  if (rc)
+    {
+      sqlite3_finalize (*stmt);
+      *stmt = NULL;
+    }
+
+  return rc;
+}
+
+static int
+stream_sqlite (sqon_DatabaseServer *srv, const char *query,
+	       struct result_writer *w, sqon_StreamCallback cb,
+	       void *userdata, size_t chunk_rows)
+{
+  int rc;
+  sqlite3_stmt *stmt;
+
+  rc = prepare_one (srv, query, &stmt);
+  if (rc)
+    return rc;
+
+  if (!sqlite3_column_count (stmt))
+    {
+      rc = step_sqlite (stmt);
+      if (!rc)
+	rc = buffer_append (&w->buf, SQON_EMPTY_RESULT, SQON_EMPTY_RESULT_LEN);
+    }
+  else
+    {
+      rc = result_writer_begin (w);
+      if (!rc)
+	rc = rows_sqlite (w, stmt, cb, userdata, chunk_rows);
+      if (!rc)
+	rc = result_writer_end (w);
+    }
+
+  if (!rc)
+    rc = result_writer_flush (w, cb, userdata);
+
+  sqlite3_finalize (stmt);
+  return rc;
+}
+
+/* Quotes are doubled; nothing else is special in an SQL string literal. */
+static int
+escape_sqlite (sqon_DatabaseServer *srv, const char *in, char *out)
+{
+  (void) srv;
+
+  for (; *in; ++in)
+    {
+      if ('\'' == *in)
+	*out++ = '\'';
+      *out++ = *in;
+    }
+
+  *out = '\0';
+  return 0;
+}
+
+static int
+cursor_open_sqlite (sqon_DatabaseServer *srv, const char *query, void **cur)
+{
+  int rc;
+  sqlite3_stmt *stmt;
+
+  rc = prepare_one (srv, query, &stmt);
+  if (!rc && !sqlite3_column_count (stmt))
+    {
+      sqlite3_finalize (stmt);
+      rc = SQON_NOCOLUMNS;
+    }
+
+  if (!rc)
+    *cur = stmt;
+
+  return rc;
+}
+
+/* Never called again after the statement is done, which would start it
+   over */
+static int
+cursor_fetch_sqlite (sqon_DatabaseServer *srv, void *cur,
+		     struct result_writer *w, size_t n, size_t *rows)
+{
+  int rc;
+  sqlite3_stmt *stmt = cur;
+  union fields fields;
+  union row row;
+
+  (void) srv;
+  fields.sqlite = stmt;
+  row.mysql = NULL;
+
+  rc = result_writer_begin (w);
+  if (!rc)
+    rc = result_writer_fields (w, fields, sqlite3_column_count (stmt));
+
+  for (*rows = 0; !rc && *rows < n; ++*rows)
+    {
+      rc = sqlite3_step (stmt);
+      if (SQLITE_DONE == rc)
+	{
+	  rc = 0;
+	  break;
+	}
+
+      if (SQLITE_ROW != rc)
+	break;
+
+      rc = result_writer_row (w, fields, row, NULL);
+    }
+
+  if (!rc)
+    rc = result_writer_end (w);
+
+  return rc;
+}
+
+static void
+cursor_close_sqlite (sqon_DatabaseServer *srv, void *cur)
+{
+  (void) srv;
+  sqlite3_finalize (cur);
+}
+
+static int
+load_sqlite (sqon_DatabaseServer *srv, const char *query,
+	     struct table_meta *m)
+{
+  int rc;
+  size_t n = 0;
+  sqlite3_stmt *stmt;
+
+  rc = sqlite3_prepare_v2 (srv->com, query, -1, &stmt, NULL);
+  if (rc)
+    return rc;
+
+  /* the arrays are sized before any column is added */
+  while ((rc = sqlite3_step (stmt)) == SQLITE_ROW)
+    ++n;
+
+  if (SQLITE_DONE == rc)
+    {
+      /* an unknown table has no columns rather than being an error */
+      rc = n ? meta_alloc_columns (m, n) : SQON_NOCOLUMNS;
+      sqlite3_reset (stmt);
+    }
+
+  /* cid, name, type, notnull, dflt_value, pk; pk numbers the key's
+     columns from 1 */
+  while (!rc && (rc = sqlite3_step (stmt)) == SQLITE_ROW)
+    rc = meta_add_column (m, (const char *) sqlite3_column_text (stmt, 1),
+			  (const char *) sqlite3_column_text (stmt, 2),
+			  1 == sqlite3_column_int (stmt, 5));
+
+  if (SQLITE_DONE == rc)
+    rc = 0;
+
+  sqlite3_finalize (stmt);
+  return rc;
+}
+
+static const char *
+field_name_sqlite (union fields fields, size_t i)
+{
+  return sqlite3_column_name (fields.sqlite, (int) i);
+}
+
+/* Whether the declared type holds word, ignoring case, as SQLite itself
+   matches them to find a column's affinity */
+static bool
+decl_has (const char *decl, const char *word)
+{
+  size_t i, len = strlen (word);
+
+  for (; *decl; ++decl)
+    {
+      for (i = 0; i < len; ++i)
+	if ((decl[i] & ~0x20) != word[i])
+	  break;
+
+      if (i == len)
+	return true;
+    }
+
+  return false;
+}
+
+/* NULL for a column with no declared type, such as an expression, which
+   is written by the type of each value */
+static value_writer
+sqlite_writer (const char *decl)
+{
+  if (NULL == decl || '\0' == *decl || decl_has (decl, "BLOB"))
+    return NULL;
+
+  if (decl_has (decl, "BOOL"))
+    return res_write_bool_int;
+
+  if (decl_has (decl, "CHAR") || decl_has (decl, "CLOB")
+      || decl_has (decl, "TEXT"))
+    return res_write_string;
+
+  /* INTEGER, REAL and NUMERIC affinity; SQLite keeps whatever text it
+     cannot convert, which stays a string */
+  return res_write_number;
+}
+
+static int
+plan_sqlite (struct result_writer *w, union fields fields, size_t i,
+	     struct column *c)
+{
+  c->index = i;
+  c->decode = NULL;
+  c->write = res_write_string;
+
+  if (w->flags & SQON_OUTPUT_TYPED)
+    c->write = sqlite_writer (sqlite3_column_decltype (fields.sqlite,
+						       (int) i));
+
+  return 0;
+}
+
+/* The text of a column of the current row; NULL if the value is NULL */
+static const char *
+value_sqlite (sqlite3_stmt *stmt, int i, size_t *len)
+{
+  const char *value;
+
+  if (SQLITE_NULL == sqlite3_column_type (stmt, i))
+    return NULL;
+
+  /* the length is only known once the value is converted */
+  value = (const char *) sqlite3_column_text (stmt, i);
+  *len = sqlite3_column_bytes (stmt, i);
+
+  return value ? value : "";
+}
+
+static int
+row_sqlite (struct result_writer *w, union fields fields, union row row,
+	    const unsigned long *lengths)
+{
+  sqlite3_stmt *stmt = fields.sqlite;
+  const struct column *c, *end = w->columns + w->num_columns;
+  const char *value;
+  size_t len = 0;
+  int rc;
+
+  (void) row;
+  (void) lengths;
+
+  if (w->arr)
+    {
+      rc = result_writer_open_row (w, NULL, 0);
+    }
+  else
+    {
+      /* a NULL key cannot be represented in an object, so the row is left
+	 out */
+      value = value_sqlite (stmt, (int) w->key.index, &len);
+      if (NULL == value)
+	return 0;
+
+      rc = result_writer_open_row (w, value, len);
+    }
+
+  for (c = w->columns; !rc && c < end; ++c)
+    {
+      const struct column *col = c;
+      struct column typed;
+
+      /* the type must be read before value_sqlite() converts the value to
+	 text, after which SQLite leaves it undefined */
+      if (NULL == c->write)
+	{
+	  typed = *c;
+	  switch (sqlite3_column_type (stmt, (int) c->index))
+	    {
+	    case SQLITE_INTEGER:
+	    case SQLITE_FLOAT:
+	      typed.write = res_write_number;
+	      break;
+
+	    default:
+	      typed.write = res_write_string;
+	      break;
+	    }
+	  col = &typed;
+	}
+
+      value = value_sqlite (stmt, (int) c->index, &len);
+      rc = result_writer_value (w, col, value, len);
+    }
+
+  if (!rc)
+    rc = result_writer_close_row (w);
+
+  return rc;
+}
+
+static int
+result_sqlite (struct result_writer *w, void *res)
+{
+  return rows_sqlite (w, res, NULL, NULL, 0);
+}
+
+const struct backend sqlite_backend = {
+  .open = open_sqlite,
+  .close = close_sqlite,
+  .ping = ping_sqlite,
+  .query = query_sqlite,
+  .stream = stream_sqlite,
+  .escape = escape_sqlite,
+  .meta_query = "PRAGMA table_info('%s')",
+  .load_meta = load_sqlite,
+  .replica_lag = NULL,
+  .ident_quote = '"',
+  .booleans = { "0", "1" },
+  .bulk_load = NULL,
+  .cursor_open = cursor_open_sqlite,
+  .cursor_fetch = cursor_fetch_sqlite,
+  .cursor_close = cursor_close_sqlite,
+  .field_name = field_name_sqlite,
+  .plan_column = plan_sqlite,
+  .write_row = row_sqlite,
+  .write_result = result_sqlite
+};
@@ -15,50 +15,79 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <jansson.h>
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
 #include <mysql/mysql.h>
-#include <postgresql/libpq-fe.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "backend.h"
+#include "meta.h"
 #include "sqon.h"
 #include "result.h"
+#include "stmt.h"
+#include "workers.h"
 
-#define empty "[]"
-#define emptylen strlen (empty)
+/* reconnect attempts back off from 100 ms up to about 51 s */
+#define BACKOFF_BASE_MS 100
+#define BACKOFF_MAX_SHIFT 10
 
-static void *
+/* rows serialized between compressing into a caller's sqon_Buffer */
+#define BUFFER_CHUNK_ROWS 256
+
+/* memset() called through a volatile pointer, so that poisoning memory which
+   is about to be freed is not optimized out */
+static void *(*const volatile volatile_memset) (void *, int, size_t) = memset;
+
+void *
 safe_memset (void *v, int c, size_t n)
 {
-  volatile char *p = v;
-  while (n--)
-    *p++ = c;
-
-  return v;
+  return volatile_memset (v, c, n);
 }
 
+/* Stored in the beginning of every block of the default allocator */
+struct block_header
+{
+  _Alignas (max_align_t) size_t n;
+  bool sensitive;
+};
+
+static enum sqon_alloc_policy alloc_policy = SQON_ALLOC_SECURE;
+
 static void *
-stored_length_malloc (size_t n)
+header_malloc (size_t n, bool sensitive)
 {
-  /* Store the memory area size in the beginning of the block */
-  void *v = malloc (n + sizeof (size_t));
+  struct block_header *h;
+
+  if (n > SIZE_MAX - sizeof (struct block_header))
+    return NULL;
 
-  if (NULL == v)
+  h = malloc (n + sizeof (struct block_header));
+  if (NULL == h)
     return NULL;
 
-  *((size_t *) v) = n;
-  return v + sizeof (size_t);
+  h->n = n;
+  h->sensitive = sensitive;
+  return h + 1;
+}
+
+static void *
+stored_length_malloc (size_t n)
+{
+  return header_malloc (n, false);
 }
 
 static void
 stored_length_free (void *v)
 {
-  size_t n;
+  struct block_header *h = (struct block_header *) v - 1;
 
-  v -= sizeof (size_t);
-  n = *((size_t *) v);
+  if (SQON_ALLOC_SECURE == alloc_policy || h->sensitive)
+    safe_memset (h, 0xDF, h->n + sizeof (struct block_header));
 
-  safe_memset (v, 0xDF, n + sizeof (size_t));
-  free (v);
+  free (h);
 }
 
 static void *(*used_malloc) (size_t n) = stored_length_malloc;
@@ -70,6 +99,15 @@ sqon_malloc (size_t n)
   return (*used_malloc) (n);
 }
 
+void *
+sqon_malloc_sensitive (size_t n)
+{
+  if (used_malloc == stored_length_malloc)
+    return header_malloc (n, true);
+
+  return (*used_malloc) (n);
+}
+
 void
 sqon_free (void *v)
 {
@@ -79,7 +117,14 @@ sqon_free (void *v)
 void
 sqon_init (void)
 {
-  json_set_alloc_funcs (sqon_malloc, sqon_free);
+  mysql_library_init (0, NULL, NULL);
+}
+
+void
+sqon_cleanup (void)
+{
+  workers_stop ();
+  mysql_library_end ();
 }
 
 void
@@ -90,17 +135,86 @@ sqon_set_alloc_funcs (void *(*new_malloc) (size_t n),
   used_free = new_free;
 }
 
+void
+sqon_set_alloc_policy (enum sqon_alloc_policy policy)
+{
+  alloc_policy = policy;
+}
+
 static void *
 mkbuf (const char *s)
 {
   return sqon_malloc ((strlen (s) + 1) * sizeof (char));
 }
 
+static int64_t
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+open_session (sqon_DatabaseServer *srv)
+{
+  return backend_get (srv->type)->open (srv);
+}
+
+static void
+close_session (sqon_DatabaseServer *srv)
+{
+  if (NULL == srv->com)
+    return;
+
+  stmt_cache_detach (srv);
+  backend_get (srv->type)->close (srv);
+  srv->com = NULL;
+}
+
+static int
+reconnect (sqon_DatabaseServer *srv)
+{
+  int rc;
+  int64_t now = now_ms ();
+
+  /* after a failure, fail fast until the backoff period has passed */
+  if (srv->persistent && srv->failures && now < srv->retry_at)
+    return SQON_CONNECTERR;
+
+  close_session (srv);
+  rc = open_session (srv);
+  if (!rc)
+    {
+      srv->failures = 0;
+      return 0;
+    }
+
+  close_session (srv);
+
+  if (srv->failures < BACKOFF_MAX_SHIFT)
+    ++srv->failures;
+  srv->retry_at = now + (BACKOFF_BASE_MS << (srv->failures - 1));
+
+  return rc;
+}
+
 sqon_DatabaseServer *
 sqon_new_connection (enum sqon_database_type type, const char *host,
 		     const char *user, const char *passwd,
 		     const char *database, const char *port)
 {
+  /* an argument the backend does not need may be left out */
+  if (NULL == host)
+    host = "";
+  if (NULL == user)
+    user = "";
+  if (NULL == passwd)
+    passwd = "";
+  if (NULL == port)
+    port = "0";
+
   const char *realport = port;
   if (!strcmp (realport, "0"))
     switch (type)
@@ -124,7 +238,8 @@ sqon_new_connection (enum sqon_database_type type, const char *host,
       return NULL;
     }
 
-  char *tpasswd = mkbuf (passwd);
+  char *tpasswd = sqon_malloc_sensitive ((strlen (passwd) + 1)
+					 * sizeof (char));
   if (NULL == tpasswd)
     {
       sqon_free (thost);
@@ -179,7 +294,17 @@ sqon_new_connection (enum sqon_database_type type, const char *host,
     strcpy (tdb, database);
   strcpy (tport, realport);
 
+  out->com = NULL;
   out->connections = 0;
+  out->persistent = false;
+  out->failures = 0;
+  out->retry_at = 0;
+  out->connect_timeout_ms = 0;
+  out->stmts = NULL;
+  out->meta = NULL;
+  out->output = 0;
+  out->compression = SQON_COMPRESS_NONE;
+  out->compress_level = Z_DEFAULT_COMPRESSION;
   out->type = type;
   out->host = thost;
   out->user = tuser;
@@ -193,8 +318,12 @@ sqon_new_connection (enum sqon_database_type type, const char *host,
 void
 sqon_free_connection (sqon_DatabaseServer *srv)
 {
+  srv->persistent = false;
   while (srv->connections)
     sqon_close (srv);
+  close_session (srv);
+  stmt_cache_free (srv);
+  meta_cache_free (srv);
 
   sqon_free (srv->host);
   sqon_free (srv->user);
@@ -210,44 +339,16 @@ sqon_connect (sqon_DatabaseServer *srv)
 {
   int rc = 0;
 
-  if (++(srv->connections) == 1)
-    switch (srv->type)
-      {
-      case SQON_DBCONN_MYSQL:
-	srv->com = mysql_init (NULL);
-
-	const char *real_end = srv->port + strlen (srv->port);
-	char *end;
-	unsigned long port = strtoul (srv->port, &end, 10);
-	if (end != real_end)
-	  {
-	    rc = SQON_CONNECTERR;
-	    break;
-	  }
-
-	if (NULL == mysql_real_connect (srv->com, srv->host, srv->user,
-					srv->passwd, srv->database, port, NULL,
-					CLIENT_MULTI_STATEMENTS))
-	  {
-	    rc = (int) mysql_errno (srv->com);
-	  }
-	break;
-
-      case SQON_DBCONN_POSTGRES:
-	srv->com = PQsetdbLogin (srv->host, srv->port, "", "", srv->database,
-				 srv->user, srv->passwd);
-
-	if ((rc = PQstatus (srv->com)) == CONNECTION_OK)
-	  rc = 0;
-	break;
+  if (NULL == backend_get (srv->type))
+    return SQON_UNSUPPORTED;
 
-      default:
-	rc = SQON_UNSUPPORTED;
-	--srv->connections;
-	break;
-      }
+  if (++(srv->connections) == 1)
+    {
+      if (NULL == srv->com || sqon_ping (srv))
+	rc = reconnect (srv);
+    }
 
-  if (rc && rc != SQON_UNSUPPORTED)
+  if (rc)
     sqon_close (srv);
 
   return rc;
@@ -256,18 +357,45 @@ sqon_connect (sqon_DatabaseServer *srv)
 void
 sqon_close (sqon_DatabaseServer *srv)
 {
-  if (--(srv->connections) == 0)
-    switch (srv->type)
-      {
-      case SQON_DBCONN_MYSQL:
-	mysql_close (srv->com);
-	mysql_library_end ();
-	break;
+  if (--(srv->connections) == 0 && !srv->persistent)
+    close_session (srv);
+}
 
-      case SQON_DBCONN_POSTGRES:
-	PQfinish (srv->com);
-	break;
-      }
+void
+sqon_set_persistent (sqon_DatabaseServer *srv, bool persistent)
+{
+  srv->persistent = persistent;
+
+  if (!persistent && !srv->connections)
+    close_session (srv);
+}
+
+void
+sqon_set_output (sqon_DatabaseServer *srv, unsigned int flags)
+{
+  srv->output = flags;
+}
+
+void
+sqon_set_compression (sqon_DatabaseServer *srv,
+		      enum sqon_compression format, int level)
+{
+  srv->compression = format;
+  srv->compress_level = level;
+}
+
+int
+sqon_ping (sqon_DatabaseServer *srv)
+{
+  const struct backend *b = backend_get (srv->type);
+
+  if (NULL == b)
+    return SQON_UNSUPPORTED;
+
+  if (NULL == srv->com)
+    return SQON_CONNECTERR;
+
+  return b->ping (srv);
 }
 
 int
@@ -275,187 +403,156 @@ sqon_query (sqon_DatabaseServer *srv, const char *query, char **out,
 	    const char *pk)
 {
   int rc;
-  union res res;
-
-  res.mysql = NULL;
 
   rc = sqon_connect (srv);
   if (rc)
     return rc;
 
-  switch (srv->type)
-    {
-    case SQON_DBCONN_MYSQL:
-      if (mysql_query (srv->com, query))
-	{
-	  rc = mysql_errno (srv->com);
-	  sqon_close (srv);
-	  return rc;
-	}
-      break;
+  rc = res_query (srv, query, out, pk);
 
-    case SQON_DBCONN_POSTGRES:
-      res.postgres = PQexec (srv->com, query);
-      rc = PQresultStatus (res.postgres);
-
-      if (rc != PGRES_COMMAND_OK && rc != PGRES_TUPLES_OK)
-	{
-	  sqon_close (srv);
-	  return rc;
-	}
-      break;
+  sqon_close (srv);
+  return rc;
+}
 
-    default:
-      return SQON_UNSUPPORTED;
-    }
+/* Streams on a connected srv, compressing if it is set to */
+static int
+run_stream (sqon_DatabaseServer *srv, const char *query,
+	    sqon_StreamCallback cb, void *userdata, size_t chunk_rows,
+	    const char *pk)
+{
+  int rc;
+  struct result_writer w;
 
-  if (NULL != out)
-    {
-      switch (srv->type)
-	{
-	case SQON_DBCONN_MYSQL:
-	  res.mysql = mysql_store_result (srv->com);
-	  sqon_close (srv);
-	  if (NULL == res.mysql)
-	    {
-	      rc = (int) mysql_errno (srv->com);
-	      if (rc)
-		return rc;
-	      *out = sqon_malloc ((emptylen + 1) * sizeof (char));
-	      strcpy (*out, empty);
-	    }
-	  else
-	    {
-	      rc = res_to_json (SQON_DBCONN_MYSQL, res.mysql, out, pk);
-	    }
-	  mysql_free_result (res.mysql);
-	  break;
-
-	case SQON_DBCONN_POSTGRES:
-	  rc = res_to_json (SQON_DBCONN_POSTGRES, res.postgres, out, pk);
-	  break;
-	}
-    }
-  else
-    {
-      sqon_close (srv);
-    }
+  result_writer_init (&w, srv->type, pk, srv->output);
 
-  switch (srv->type)
-    {
-    case SQON_DBCONN_POSTGRES:
-      PQclear (res.postgres);
-      break;
-    }
+  rc = result_writer_compress (&w, srv->compression, srv->compress_level);
+  if (!rc)
+    rc = w.backend->stream (srv, query, &w, cb, userdata, chunk_rows);
+  if (!rc)
+    rc = result_writer_finish (&w, cb, userdata);
 
+  result_writer_free (&w);
   return rc;
 }
 
 int
-sqon_get_primary_key (sqon_DatabaseServer *srv, const char *table, char **out)
+sqon_query_stream (sqon_DatabaseServer *srv, const char *query,
+		   sqon_StreamCallback cb, void *userdata, size_t chunk_rows,
+		   const char *pk)
 {
   int rc;
-  char *query, *esc_table;
-  size_t qlen = 1;
-  const char *fmt, *key_column;
 
-  switch (srv->type)
-    {
-    case SQON_DBCONN_MYSQL:
-      fmt = "SHOW KEYS FROM %s WHERE Key_name = 'PRIMARY'";
-      key_column = "Column_name";
-      break;
-
-    case SQON_DBCONN_POSTGRES:
-      fmt = "SELECT a.attname FROM pg_index i "
-	"JOIN pg_attribute a ON a.attrelid = i.indrelid "
-	  "AND a.attnum = ANY(i.indkey) "
-	"WHERE i.indrelid = '%s'::regclass AND i.indisprimary";
-      key_column = "attname";
-      break;
-
-    default:
-      return SQON_UNSUPPORTED;
-    }
+  if (!chunk_rows)
+    chunk_rows = 1;
 
-  rc = sqon_escape (srv, table, &esc_table, false);
+  rc = sqon_connect (srv);
   if (rc)
-    {
-      sqon_free (esc_table);
-      return rc;
-    }
+    return rc;
 
-  qlen += strlen (fmt);
-  qlen += strlen (esc_table);
+  rc = run_stream (srv, query, cb, userdata, chunk_rows, pk);
 
-  query = sqon_malloc (qlen * sizeof (char));
-  if (NULL == query)
-    {
-      sqon_free (esc_table);
-      return SQON_MEMORYERROR;
-    }
+  sqon_close (srv);
+  return rc;
+}
 
-  rc = snprintf (query, qlen, fmt, esc_table);
-  sqon_free (esc_table);
-  if ((size_t) rc >= qlen)
-    {
-      sqon_free (query);
-      return SQON_OVERFLOW;
-    }
+static int
+append_buffer (const char *data, size_t len, void *userdata)
+{
+  return buffer_append (userdata, data, len);
+}
+
+int
+sqon_query_buffer (sqon_DatabaseServer *srv, const char *query,
+		   sqon_Buffer *out, const char *pk)
+{
+  int rc;
+  struct result_writer w;
+  struct buffer buf;
+
+  /* len is 0 on every failure, including this one */
+  out->len = 0;
 
   rc = sqon_connect (srv);
   if (rc)
+    return rc;
+
+  if (srv->compression != SQON_COMPRESS_NONE)
     {
-      sqon_free (query);
-      return rc;
+      /* only the compressed result goes in the caller's memory; the
+	 serializer's own buffer is emptied every BUFFER_CHUNK_ROWS rows */
+      buf.data = out->data;
+      buf.len = 0;
+      buf.cap = out->cap;
+
+      rc = run_stream (srv, query, append_buffer, &buf, BUFFER_CHUNK_ROWS,
+		       pk);
     }
+  else
+    {
+      /* the serializer writes straight into the caller's memory */
+      result_writer_init (&w, srv->type, pk, srv->output);
+      w.buf.data = out->data;
+      w.buf.cap = out->cap;
 
-  char *res;
-  rc = sqon_query (srv, query, &res, NULL);
-  sqon_free (query);
-  if (rc)
-    return rc;
-
-  json_t *res_set = json_loads (res, 0, NULL);
-  sqon_free (res);
-  if (NULL == res_set)
-    return SQON_MEMORYERROR;
+      rc = w.backend->query (srv, query, &w);
 
-  json_t *res_obj = json_array_get (res_set, 0);
-  if (NULL == res_obj)
-    {
-      json_decref (res_set);
-      return SQON_NOPK;
+      buf = w.buf;
+      buffer_init (&w.buf);
+      result_writer_free (&w);
     }
 
-  const char *primary_key = json_string_value (json_object_get (res_obj,
-								key_column));
+  sqon_close (srv);
+
+  if (!rc)
+    rc = buffer_reserve (&buf, 0);
+  if (!rc)
+    buf.data[buf.len] = '\0';
+
+  out->data = buf.data;
+  out->len = rc ? 0 : buf.len;
+  out->cap = buf.cap;
+  return rc;
+}
+
+static int
+write_fd (const char *json, size_t len, void *userdata)
+{
+  const int *fd = userdata;
+  ssize_t n;
 
-  *out = sqon_malloc ((strlen (primary_key) + 1) * sizeof (char));
-  if (NULL == *out)
+  while (len)
     {
-      json_decref (res_set);
-      return SQON_MEMORYERROR;
-    }
+      n = write (*fd, json, len);
+      if (n < 0)
+	{
+	  if (EINTR == errno)
+	    continue;
+
+	  return SQON_IOERROR;
+	}
 
-  strcpy (*out, primary_key);
-  json_decref (res_set);
+      json += n;
+      len -= (size_t) n;
+    }
 
   return 0;
 }
 
+int
+sqon_query_fd (sqon_DatabaseServer *srv, const char *query, int fd,
+	       size_t chunk_rows, const char *pk)
+{
+  return sqon_query_stream (srv, query, write_fd, &fd, chunk_rows, pk);
+}
+
 int
 sqon_escape (sqon_DatabaseServer *srv, const char *in, char **out, bool quote)
 {
   int rc;
-  size_t extra = 1 + (quote ? 2 : 0);
-  char *temp, *quoted;
-  union
-  {
-    unsigned long ul;
-  } written;
-
-  temp = sqon_malloc ((strlen (in) * 2 + extra) * sizeof (char));
+  size_t len;
+  char *temp;
+
+  temp = sqon_malloc_sensitive ((strlen (in) * 2 + 1) * sizeof (char));
   if (NULL == temp)
     return SQON_MEMORYERROR;
 
@@ -466,61 +563,25 @@ sqon_escape (sqon_DatabaseServer *srv, const char *in, char **out, bool quote)
       return rc;
     }
 
-  switch (srv->type)
-    {
-    case SQON_DBCONN_MYSQL:
-      written.ul = mysql_real_escape_string (srv->com, temp, in, strlen (in));
-      written.ul += quote ? 3 : 1;
+  rc = backend_get (srv->type)->escape (srv, in, temp);
+  sqon_close (srv);
 
-      *out = sqon_malloc (written.ul * sizeof (char));
+  if (!rc)
+    {
+      len = strlen (temp) + 1 + (quote ? 2 : 0);
+      *out = sqon_malloc_sensitive (len * sizeof (char));
       if (NULL == *out)
-	{
-	  rc = SQON_MEMORYERROR;
-	  break;
-	}
+	rc = SQON_MEMORYERROR;
+    }
 
+  if (!rc)
+    {
       if (quote)
-	snprintf (*out, written.ul, "'%s'", temp);
+	snprintf (*out, len, "'%s'", temp);
       else
 	strcpy (*out, temp);
-      break;
-
-    case SQON_DBCONN_POSTGRES:
-      quoted = PQescapeLiteral (srv->com, in, strlen (in));
-      if (NULL == quoted)
-	{
-	  rc = SQON_MEMORYERROR;
-	  break;
-	}
-
-      if (quote)
-	{
-	  strcpy (temp, strstr (quoted, "'"));
-	}
-      else
-	{
-	  quoted[strlen (quoted) - 1] = '\0';
-	  strcpy (temp, strstr (quoted, "'") + 1);
-	}
-      PQfreemem (quoted);
-
-      *out = sqon_malloc ((strlen (temp) + 1) * sizeof (char));
-      if (NULL == *out)
-	{
-	  rc = SQON_MEMORYERROR;
-	  break;
-	}
-
-      strcpy (*out, temp);
-      break;
-
-    default:
-      rc = SQON_UNSUPPORTED;
-      break;
     }
 
-  sqon_close (srv);
-
   sqon_free (temp);
   return rc;
 }
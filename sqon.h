@@ -17,7 +17,7 @@
 
 /**
  * @file sqon.h
- * @version 1.2
+ * @version 2.0
  * @date 07/21/2015
  * @author David McMackins II
  * @brief C implementation for Delwink's SQON
@@ -33,7 +33,7 @@
 /**
  * @brief libsqon software version
  */
-#define SQON_VERSION "1.2.0"
+#define SQON_VERSION "2.0.0"
 
 /**
  * @brief Information about the libsqon copyright holders and license.
@@ -61,6 +61,12 @@
 
 __BEGIN_DECLS
 
+/* libsqon is built with hidden visibility; only what is declared here is
+   exported */
+#ifdef __GNUC__
+# pragma GCC visibility push(default)
+#endif
+
 /**
  * @brief Error codes returned on failure.
  */
@@ -69,11 +75,17 @@ enum sqon_error
   SQON_MEMORYERROR = -12,
   SQON_OVERFLOW    = -13,
   SQON_UNSUPPORTED = -14,
+  SQON_ENCODING    = -15,
+  SQON_TIMEOUT     = -16,
+  SQON_BADPARAMS   = -17,
+  SQON_IOERROR     = -18,
+  SQON_INCOMPLETE  = -19,
 
   SQON_CONNECTERR  = -20,
   SQON_NOCOLUMNS   = -21,
   SQON_NOPK        = -23,
-  SQON_PKNOTUNIQUE = -24
+  SQON_PKNOTUNIQUE = -24,
+  SQON_NOSTMT      = -25
 };
 
 /**
@@ -84,6 +96,16 @@ enum sqon_error
 void *
 sqon_malloc (size_t n);
 
+/**
+ * @brief Allocates memory for data which must not outlive its use, such as
+ * passwords; it is poisoned when freed whatever the allocation policy.
+ * @param n Number of bytes to allocate on the heap.
+ * @return Pointer to n bytes of available memory, to be freed with
+ * sqon_free().
+ */
+void *
+sqon_malloc_sensitive (size_t n);
+
 /**
  * @brief Frees memory allocated with sqon_malloc().
  * @param v Pointer returned by earlier call to sqon_malloc().
@@ -97,6 +119,32 @@ sqon_free (void *v);
 void
 sqon_init (void);
 
+/**
+ * @brief Releases resources held by supporting libraries and stops worker
+ * threads; call once after all connections have been freed.
+ */
+void
+sqon_cleanup (void);
+
+/**
+ * @brief How the default allocator treats memory being freed.
+ */
+enum sqon_alloc_policy
+{
+  /** Every block is poisoned before it is freed (the default). */
+  SQON_ALLOC_SECURE,
+  /** Only blocks from sqon_malloc_sensitive() are poisoned. */
+  SQON_ALLOC_FAST
+};
+
+/**
+ * @brief Selects the allocation policy of the default allocator; has no
+ * effect on functions given to sqon_set_alloc_funcs().
+ * @param policy The new policy.
+ */
+void
+sqon_set_alloc_policy (enum sqon_alloc_policy policy);
+
 /**
  * @brief Changes the memory management functions used internally.
  * @param new_malloc The new malloc() function to be used.
@@ -106,6 +154,20 @@ void
 sqon_set_alloc_funcs (void *(*new_malloc) (size_t n),
 		      void (*new_free) (void *v));
 
+/**
+ * @brief Spreads the serialization of large PostgreSQL results over several
+ * threads, which write ranges of rows side by side; the output is the same
+ * as when a single thread writes it, and primary keys are checked for
+ * uniqueness across the whole result. Streamed results are not affected.
+ * Call while no queries are running, as the worker threads are restarted.
+ * @param threads Threads to use, including the one which made the query; 0
+ * for one per online processor, or 1 (the default) for no worker threads.
+ * @param min_rows Results with fewer rows than this (10000 by default) are
+ * written by the querying thread alone.
+ */
+void
+sqon_set_parallel (unsigned int threads, size_t min_rows);
+
 /**
  * @brief The universal database connection auxiliary structure for libsqon.
  */
@@ -113,6 +175,15 @@ typedef struct
 {
   void *com;
   uint64_t connections;
+  bool persistent;
+  uint32_t failures;
+  int64_t retry_at;
+  unsigned int connect_timeout_ms;
+  void *stmts;
+  void *meta;
+  unsigned int output;
+  uint8_t compression;
+  int compress_level;
   uint8_t type;
   char *host;
   char *user;
@@ -127,17 +198,84 @@ typedef struct
 enum sqon_database_type
 {
   SQON_DBCONN_MYSQL = 1,
-  SQON_DBCONN_POSTGRES
+  SQON_DBCONN_POSTGRES,
+
+  /**
+   * A database file opened in process by SQLite, named by the database
+   * argument of sqon_new_connection() (or by host, if database is NULL),
+   * which may also be ":memory:" or a "file:" URI such as
+   * "file:ref.db?mode=ro". The other arguments are unused and can be NULL,
+   * as in sqon_new_connection(SQON_DBCONN_SQLITE, ":memory:", NULL, NULL,
+   * NULL, NULL). An in-memory database lasts only as long as the
+   * connection, so make it persistent.
+   * Prepared statements, asynchronous queries and binary output are not
+   * supported; sqon_query_stream() takes a single statement.
+   */
+  SQON_DBCONN_SQLITE
+};
+
+/**
+ * @brief Flags changing the JSON produced by queries.
+ */
+enum sqon_output_flag
+{
+  /**
+   * Numeric columns become JSON numbers, boolean columns (PostgreSQL boolean
+   * and MySQL BIT(1)) become true or false, and JSON columns are embedded
+   * as they are, rather than every value being a string. Values with no
+   * JSON number form, such as NaN, stay strings.
+   */
+  SQON_OUTPUT_TYPED = 1,
+
+  /**
+   * PostgreSQL sends results in its binary format, which libsqon decodes
+   * itself, sparing the server from formatting numbers and dates as text.
+   * Supported column types are boolean, bytea, the integer, floating point
+   * and numeric types, oid, date, timestamp, timestamptz, uuid and the text,
+   * JSON and XML types; a result with any other type fails with
+   * SQON_UNSUPPORTED, so cast such columns to text. Floating point values may
+   * be written in different notation than text results would use, and
+   * timestamptz values are shown in UTC. Queries sent this way must be
+   * single statements. Ignored by MySQL.
+   */
+  SQON_OUTPUT_BINARY = 2,
+
+  /**
+   * Column names are written once rather than in every row:
+   * {"columns": ["a", "b"], "rows": [["1", "x"], ["2", "y"]]}. With a
+   * primary key, rows is an object keyed by it and the key column is left
+   * out of columns and rows alike: {"columns": ["b"], "rows": {"1": ["x"]}}.
+   * Statements which return no result set still give [].
+   */
+  SQON_OUTPUT_COLUMNAR = 4
+};
+
+/**
+ * @brief Formats in which results can be compressed as they are produced.
+ */
+enum sqon_compression
+{
+  SQON_COMPRESS_NONE = 0,
+
+  /** zlib format (RFC 1950), as HTTP's Content-Encoding: deflate */
+  SQON_COMPRESS_DEFLATE,
+
+  /** gzip format (RFC 1952) */
+  SQON_COMPRESS_GZIP
 };
 
 /**
  * @brief Constructs a database connection.
  * @param type Connection type constant, such as SQON_DBCONN_MYSQL.
- * @param host The hostname or IP address of the database server.
- * @param user The username with which to authenticate with the database server.
- * @param passwd The password by which to be authenticated.
+ * @param host The hostname or IP address of the database server; NULL is the
+ * same as "".
+ * @param user The username with which to authenticate with the database server;
+ * NULL is the same as "".
+ * @param passwd The password by which to be authenticated; NULL is the same as
+ * "".
  * @param database The name of the database to be used; can be NULL.
- * @param port String representation of the port number (can be 0 for default).
+ * @param port String representation of the port number (can be 0 or NULL for
+ * default).
  * @return A new database connection object which much be freed with
  * sqon_free_connection() or NULL on failure.
  */
@@ -168,6 +306,49 @@ sqon_connect (sqon_DatabaseServer *srv);
 void
 sqon_close (sqon_DatabaseServer *srv);
 
+/**
+ * @brief Sets whether the connection stays open when not in use.
+ * @param srv Initialized database connection object.
+ * @param persistent If true, the session outlives sqon_close() and is reused
+ * by later calls, being checked with sqon_ping() first and reopened if it
+ * has failed; repeated failures to reopen back off exponentially. If false,
+ * the session is closed once no calls are using it (the default).
+ */
+void
+sqon_set_persistent (sqon_DatabaseServer *srv, bool persistent);
+
+/**
+ * @brief Sets the form of the JSON results of a connection.
+ * @param srv Initialized database connection object.
+ * @param flags Bitwise OR of enum sqon_output_flag values; 0 for the default
+ * of string values.
+ */
+void
+sqon_set_output (sqon_DatabaseServer *srv, unsigned int flags);
+
+/**
+ * @brief Compresses the results of sqon_query_stream(), sqon_query_fd() and
+ * sqon_query_buffer() while they are serialized, so that the uncompressed
+ * JSON is never held in full. Other queries are not compressed.
+ * @param srv Initialized database connection object.
+ * @param format Compressed format; SQON_COMPRESS_NONE (the default) turns
+ * compression off.
+ * @param level zlib compression level, from 1 (fastest) to 9 (smallest), 0
+ * for none or -1 for zlib's default; an invalid level makes queries fail
+ * with SQON_BADPARAMS.
+ */
+void
+sqon_set_compression (sqon_DatabaseServer *srv,
+		      enum sqon_compression format, int level);
+
+/**
+ * @brief Checks that an open connection is still usable.
+ * @param srv Connected database connection object.
+ * @return Zero if the connection is alive; nonzero otherwise.
+ */
+int
+sqon_ping (sqon_DatabaseServer *srv);
+
 /**
  * @brief Query the database.
  * @param srv Initialized database connection object.
@@ -183,6 +364,408 @@ int
 sqon_query (sqon_DatabaseServer *srv, const char *query, char **out,
 	    const char *primary_key);
 
+/**
+ * @brief Receives a piece of a streamed query result.
+ * @param json Next fragment of the JSON-formatted result; not terminated.
+ * @param len Length of the fragment in bytes.
+ * @param userdata The pointer given to sqon_query_stream().
+ * @return Zero to continue; nonzero to stop the query, which will then return
+ * this value.
+ */
+typedef int (*sqon_StreamCallback) (const char *json, size_t len,
+				    void *userdata);
+
+/**
+ * @brief Query the database, receiving the result as it arrives.
+ * @param srv Initialized database connection object.
+ * @param query UTF-8 encoded SQL statement; only one, as of several
+ * sqon_query() gives the result of the last on PostgreSQL and SQLite, which
+ * cannot be known until the others have run. On PostgreSQL a second result
+ * fails the query with SQON_BADPARAMS, after cb may have been given part of
+ * the first; SQLite refuses it before running anything. MySQL, whose
+ * sqon_query() gives the result of the first, streams that one and then
+ * runs the rest, returning the first error among them.
+ * @param cb Function to be given the result in order; the concatenation of
+ * all fragments is the same JSON that sqon_query() would have produced, or
+ * that JSON compressed if set by sqon_set_compression().
+ * @param userdata Pointer passed through to cb.
+ * @param chunk_rows Number of rows to gather before calling cb; 0 or 1 calls
+ * it for every row.
+ * @param primary_key Primary key expected in return value, if any (else NULL).
+ * @return Negative if input or IO error; positive if error from server; the
+ * value returned by cb if it stopped the query.
+ */
+int
+sqon_query_stream (sqon_DatabaseServer *srv, const char *query,
+		   sqon_StreamCallback cb, void *userdata, size_t chunk_rows,
+		   const char *primary_key);
+
+/**
+ * @brief Caller-owned memory receiving results from sqon_query_buffer().
+ *
+ * Start with all members zero, or with data allocated by sqon_malloc() and
+ * cap its size; release data with sqon_free(). Reusing one buffer for many
+ * queries saves allocating (and, by default, poisoning) memory for each.
+ */
+typedef struct sqon_buffer
+{
+  /** The result, NUL-terminated; grown with sqon_malloc() as needed. */
+  char *data;
+  /** Length of the result in bytes, not counting the terminator. */
+  size_t len;
+  /** Bytes allocated at data. */
+  size_t cap;
+} sqon_Buffer;
+
+/**
+ * @brief Query the database, writing the result into a caller's buffer.
+ * @param srv Initialized database connection object.
+ * @param query UTF-8 encoded SQL statement.
+ * @param out Buffer whose contents are replaced by the same JSON that
+ * sqon_query() would give, or by that JSON compressed if set by
+ * sqon_set_compression(); len is 0 on failure. A compressed result is
+ * streamed, so its query takes one statement, as for sqon_query_stream().
+ * @param primary_key Primary key expected in return value, if any (else NULL).
+ * @return As for sqon_query().
+ */
+int
+sqon_query_buffer (sqon_DatabaseServer *srv, const char *query,
+		   sqon_Buffer *out, const char *primary_key);
+
+/**
+ * @brief Query the database, writing the result to a file descriptor as it
+ * is serialized, such as to a client's socket.
+ * @param srv Initialized database connection object.
+ * @param query UTF-8 encoded SQL statement; one only, as for
+ * sqon_query_stream().
+ * @param fd Open descriptor in blocking mode; short writes are retried.
+ * @param chunk_rows Number of rows to gather before each write, as for
+ * sqon_query_stream().
+ * @param primary_key Primary key expected in return value, if any (else NULL).
+ * @return SQON_IOERROR if writing failed, with errno set; otherwise as for
+ * sqon_query_stream(). Output already written is not taken back on failure.
+ */
+int
+sqon_query_fd (sqon_DatabaseServer *srv, const char *query, int fd,
+	       size_t chunk_rows, const char *primary_key);
+
+/**
+ * @brief A query whose result is read a page at a time.
+ */
+typedef struct sqon_cursor sqon_Cursor;
+
+/**
+ * @brief Runs a query for its result to be fetched in pages, so that
+ * neither the client nor the server need hold all of it at once.
+ * @param srv Initialized database connection object, which must not be
+ * used for anything else until the cursor is closed.
+ * @param query UTF-8 encoded SQL statement returning rows; one statement
+ * only, and for PostgreSQL one which can be declared as a cursor.
+ * @param primary_key Primary key expected in each page, if any (else NULL).
+ * @param page_rows Number of rows in each page; 0 for 1000.
+ * @param out Pointer to be set to the new cursor, which must be closed with
+ * sqon_cursor_close().
+ * @return As for sqon_query(); SQON_NOCOLUMNS if the statement returns no
+ * rows.
+ *
+ * PostgreSQL declares a cursor, in a transaction begun for it if srv is not
+ * in one already, which is committed on closing. MySQL leaves the rows on
+ * the server until they are fetched, and SQLite steps the statement as
+ * pages are fetched.
+ */
+int
+sqon_cursor_open (sqon_DatabaseServer *srv, const char *query,
+		  const char *primary_key, size_t page_rows,
+		  sqon_Cursor **out);
+
+/**
+ * @brief Fetches the next page of a cursor's result.
+ * @param cur Open cursor.
+ * @param out Pointer to string which will be allocated and populated with
+ * the page's rows, formatted as sqon_query() formats a result; must free
+ * with sqon_free(). Set to NULL once every row has been fetched.
+ * @return As for sqon_query(); SQON_PKNOTUNIQUE only if a key appears twice
+ * in the same page.
+ */
+int
+sqon_cursor_fetch (sqon_Cursor *cur, char **out);
+
+/**
+ * @brief Closes a cursor, ending its query.
+ * @param cur Cursor opened by sqon_cursor_open(), or NULL.
+ *
+ * Closing before the last page still makes MySQL send the rest of the
+ * result, which is thrown away.
+ */
+void
+sqon_cursor_close (sqon_Cursor *cur);
+
+/**
+ * @brief Query one page of a result in order of a key, which can be
+ * continued later from where the page ends.
+ * @param srv Initialized database connection object.
+ * @param query UTF-8 encoded SQL statement returning rows, put into a
+ * subquery.
+ * @param key Column of the result whose values are unique and ordered, such
+ * as a primary key; the page is an object keyed by it, as for sqon_query().
+ * @param page_rows Maximum number of rows in the page; 0 for 1000.
+ * @param after Continuation token from the previous page, or NULL for the
+ * first page.
+ * @param out Pointer to string which will be allocated and populated with
+ * the page; must free with sqon_free().
+ * @param next Pointer to be set to the token to give for the next page,
+ * which must be freed with sqon_free(), or to NULL if this page is the
+ * last.
+ * @return As for sqon_query().
+ *
+ * Each page is its own query, which finds its first row through an index
+ * on the key rather than by skipping the rows before it, so pages cost the
+ * same however far in they are and no state is kept between them. The
+ * token is the value of the key in the last row of the page, compared as a
+ * string literal; SQLite only converts it for a key column with a numeric
+ * type. Rows with a NULL key are left out.
+ */
+int
+sqon_query_page (sqon_DatabaseServer *srv, const char *query,
+		 const char *key, size_t page_rows, const char *after,
+		 char **out, char **next);
+
+/**
+ * @brief Prepares a statement on the server under a name.
+ * @param srv Initialized database connection object.
+ * @param name Name by which to execute the statement with sqon_execute();
+ * replaces any statement already prepared under this name. Names starting
+ * with "sqon_" are kept for the statements of sqon_query_prepared().
+ * @param query UTF-8 encoded SQL statement.
+ * @return SQON_BADPARAMS if the name starts with "sqon_"; otherwise negative
+ * if input or IO error, positive if error from server.
+ */
+int
+sqon_prepare (sqon_DatabaseServer *srv, const char *name, const char *query);
+
+/**
+ * @brief Executes a statement prepared with sqon_prepare().
+ * @param srv Initialized database connection object.
+ * @param name Name given to sqon_prepare().
+ * @param out Pointer to string which will be allocated and populated with
+ * the same JSON as sqon_query() gives; can be NULL if no result is expected.
+ * @param primary_key Primary key expected in return value, if any (else NULL).
+ * @return SQON_NOSTMT if no statement has this name; otherwise as
+ * sqon_query().
+ */
+int
+sqon_execute (sqon_DatabaseServer *srv, const char *name, char **out,
+	      const char *primary_key);
+
+/**
+ * @brief Query the database through a cached prepared statement.
+ * @param srv Initialized database connection object.
+ * @param query UTF-8 encoded SQL statement; prepared the first time it is
+ * seen on this connection and reused after.
+ * @param out As for sqon_query().
+ * @param primary_key Primary key expected in return value, if any (else NULL).
+ * @return Negative if input or IO error; positive if error from server.
+ *
+ * Statements are kept for the life of the session, so this is best used
+ * with a persistent or pooled connection. They are prepared again
+ * automatically after a reconnect.
+ */
+int
+sqon_query_prepared (sqon_DatabaseServer *srv, const char *query, char **out,
+		     const char *primary_key);
+
+/**
+ * @brief Query the database with parameters sent apart from the SQL text.
+ * @param srv Initialized database connection object.
+ * @param query UTF-8 encoded SQL statement with placeholders in the syntax of
+ * the database engine: ? for MySQL, $1, $2, ... for PostgreSQL.
+ * @param nparams Number of placeholders in query.
+ * @param values Array of nparams values in text form; NULL elements are sent
+ * as SQL NULL. They need no escaping.
+ * @param lengths Array of the byte lengths of values, or NULL if they are all
+ * NUL-terminated; PostgreSQL always reads values up to their terminator.
+ * @param out As for sqon_query().
+ * @param primary_key Primary key expected in return value, if any (else NULL).
+ * @return SQON_BADPARAMS if nparams does not match query; otherwise as
+ * sqon_query().
+ *
+ * The statement goes through the same cache as sqon_query_prepared().
+ */
+int
+sqon_query_params (sqon_DatabaseServer *srv, const char *query,
+		   size_t nparams, const char *const *values,
+		   const size_t *lengths, char **out, const char *primary_key);
+
+/**
+ * @brief Socket readiness wanted by an asynchronous query.
+ */
+enum sqon_wait
+{
+  SQON_WAIT_READ = 1,
+  SQON_WAIT_WRITE = 2
+};
+
+typedef struct sqon_async sqon_Async;
+
+/**
+ * @brief Function called when an asynchronous query completes.
+ * @param rc As the return value of sqon_query().
+ * @param out The JSON result, to be freed with sqon_free(), or NULL if rc is
+ * nonzero.
+ * @param userdata The pointer given to sqon_query_async().
+ */
+typedef void (*sqon_AsyncCallback) (int rc, char *out, void *userdata);
+
+/**
+ * @brief Starts a query without waiting for it.
+ * @param srv Initialized database connection object, which must not be used
+ * for anything else until the query is freed.
+ * @param query UTF-8 encoded SQL statement.
+ * @param primary_key Primary key expected in the result, if any (else NULL).
+ * @param cb Function called with the result from sqon_async_advance().
+ * @param userdata Passed through to cb.
+ * @param out Set to the handle of the query, to be freed with
+ * sqon_async_free().
+ * @return Negative if input or IO error; positive if error from server. The
+ * callback is not called if this fails.
+ *
+ * Only sending and receiving are non-blocking; connecting is not, so use a
+ * persistent or pooled connection. For MySQL this requires a client library
+ * with the non-blocking API (MariaDB Connector/C); otherwise it returns
+ * SQON_UNSUPPORTED.
+ */
+int
+sqon_query_async (sqon_DatabaseServer *srv, const char *query,
+		  const char *primary_key, sqon_AsyncCallback cb,
+		  void *userdata, sqon_Async **out);
+
+/**
+ * @brief Gets the socket of an asynchronous query, for poll() or epoll.
+ * @param q Asynchronous query handle.
+ * @return File descriptor, which stays the same until the query is freed.
+ */
+int
+sqon_async_fd (const sqon_Async *q);
+
+/**
+ * @brief Gets the readiness an asynchronous query is waiting for.
+ * @param q Asynchronous query handle.
+ * @return A combination of enum sqon_wait values; 0 if the query can advance
+ * without waiting. This may change after every sqon_async_advance().
+ */
+int
+sqon_async_events (const sqon_Async *q);
+
+/**
+ * @brief Moves an asynchronous query along without blocking.
+ * @param q Asynchronous query handle.
+ * @param events The enum sqon_wait values which the socket is ready for.
+ * @return Whether the query is complete; the callback is called once, by the
+ * call which completes it.
+ */
+bool
+sqon_async_advance (sqon_Async *q, int events);
+
+/**
+ * @brief Frees an asynchronous query.
+ * @param q Asynchronous query handle.
+ *
+ * If the query is not complete, this blocks until the server is done with it
+ * and discards the result without calling the callback.
+ */
+void
+sqon_async_free (sqon_Async *q);
+
+/**
+ * @brief Runs several queries, in one round trip where the engine allows.
+ * @param srv Initialized database connection object.
+ * @param queries Array of n UTF-8 encoded SQL statements, one statement each.
+ * @param n Number of queries.
+ * @param outs Array of n pointers, each set to a string allocated and
+ * populated with the JSON result of the matching query ("[]" for statements
+ * returning no rows), or NULL to discard results.
+ * @param primary_keys Array of n primary keys expected in the results, any of
+ * them NULL, or NULL for none.
+ * @return As for sqon_query(), for the first query that failed; no results
+ * are returned if any query fails.
+ *
+ * The server stops at the first failing query. PostgreSQL runs the batch as a
+ * pipeline in a single transaction, so earlier queries are rolled back; with
+ * a libpq older than 14, which cannot pipeline, the queries are sent one at a
+ * time, still in a single transaction. Either way, a transaction the caller
+ * already has open is left for the caller to roll back. MySQL sends the batch
+ * as one multi-statement query and keeps the effects of the queries which ran
+ * before the failure. SQLite runs the queries one after another and keeps the
+ * effects of those before the failure.
+ */
+int
+sqon_query_batch (sqon_DatabaseServer *srv, const char *const *queries,
+		  size_t n, char **outs, const char *const *primary_keys);
+
+/**
+ * @brief Inserts rows given as JSON into a table, loading them in bulk where
+ * the engine allows.
+ * @param srv Initialized database connection object.
+ * @param table Name of the table, put into the statement as written; it may
+ * be qualified or quoted, so must not come from an untrusted source.
+ * @param json UTF-8 encoded JSON array of objects, one for each row, or the
+ * objects one after another, such as one per line.
+ * @return Negative if input or IO error; positive if error from server;
+ * SQON_BADPARAMS if json is not objects as described below, or
+ * SQON_ENCODING if a string holds U+0000 or half of a surrogate pair.
+ *
+ * The keys of the first object name the columns, which are quoted as
+ * identifiers; later objects may leave out any of them, inserting NULL, but
+ * may not add to them. Strings, numbers and null go to the server as text
+ * to be converted to the type of their column, true and false as it writes
+ * booleans, and nested objects and arrays as their JSON.
+ *
+ * PostgreSQL loads the rows with COPY FROM STDIN, keeping none of them if
+ * any fails. MySQL loads them with LOAD DATA LOCAL INFILE, which skips rows
+ * that would fail, as it always does for a local file. If the MySQL server
+ * refuses local files, and for SQLite, the rows are inserted by multi-row
+ * INSERT statements of up to 1000 rows, and those inserted before a failure
+ * are kept.
+ */
+int
+sqon_bulk_insert (sqon_DatabaseServer *srv, const char *table,
+		  const char *json);
+
+/**
+ * @brief Supplies input to sqon_bulk_insert_stream().
+ * @param buf Memory to be filled.
+ * @param len Size of buf in bytes.
+ * @param userdata The pointer given to sqon_bulk_insert_stream().
+ * @return Number of bytes written to buf; 0 at the end of the input, or
+ * (size_t) -1 on failure, which makes the insert fail with SQON_IOERROR.
+ */
+typedef size_t (*sqon_ReadCallback) (char *buf, size_t len, void *userdata);
+
+/**
+ * @brief Inserts rows as sqon_bulk_insert() does, reading the JSON as it is
+ * loaded, such as from a file or a socket.
+ * @param srv Initialized database connection object.
+ * @param table As for sqon_bulk_insert().
+ * @param read Function to be called for the JSON in order until it returns
+ * 0; only as much of it as one row is held in memory at once.
+ * @param userdata Pointer passed through to read.
+ * @return As for sqon_bulk_insert().
+ */
+int
+sqon_bulk_insert_stream (sqon_DatabaseServer *srv, const char *table,
+			 sqon_ReadCallback read, void *userdata);
+
+/**
+ * @brief Sets how many statements sqon_query_prepared() keeps prepared.
+ * @param srv Initialized database connection object.
+ * @param size Maximum number of cached statements, least recently used being
+ * dropped first (64 by default); 0 prepares each statement afresh and drops
+ * it once it has run. Statements named with sqon_prepare() do not count and
+ * are never dropped.
+ */
+void
+sqon_set_stmt_cache_size (sqon_DatabaseServer *srv, size_t size);
+
 /**
  * @brief Gets the primary key of a table.
  * @param srv Initialized database connection object.
@@ -190,10 +773,42 @@ sqon_query (sqon_DatabaseServer *srv, const char *query, char **out,
  * @param out Pointer to string which will be allocated and populated with the
  * table's primary key.
  * @return Negative if input or IO error; positive if error from server.
+ *
+ * The answer is cached with the table's other metadata; see
+ * sqon_invalidate_metadata().
  */
 int
 sqon_get_primary_key (sqon_DatabaseServer *srv, const char *table, char **out);
 
+/**
+ * @brief Gets the columns of a table.
+ * @param srv Initialized database connection object.
+ * @param table Name of the database table, not escaped.
+ * @param out Pointer to string which will be allocated and populated with a
+ * JSON array of objects with the "name" and "type" of each column, in table
+ * order; must free with sqon_free().
+ * @return Negative if input or IO error; positive if error from server.
+ */
+int
+sqon_get_columns (sqon_DatabaseServer *srv, const char *table, char **out);
+
+/**
+ * @brief Discards cached table metadata, such as after altering a table.
+ * @param srv Initialized database connection object.
+ * @param table Name of the table to forget, or NULL for all tables.
+ */
+void
+sqon_invalidate_metadata (sqon_DatabaseServer *srv, const char *table);
+
+/**
+ * @brief Sets how long table metadata is cached.
+ * @param srv Initialized database connection object.
+ * @param seconds Age after which metadata is read again from the catalog; 0
+ * (the default) keeps it until invalidated.
+ */
+void
+sqon_set_metadata_ttl (sqon_DatabaseServer *srv, unsigned int seconds);
+
 /**
  * @brief Properly escapes a string for the database engine.
  * @param srv Initialized database connection object.
@@ -206,6 +821,313 @@ sqon_get_primary_key (sqon_DatabaseServer *srv, const char *table, char **out);
 int
 sqon_escape (sqon_DatabaseServer *srv, const char *in, char **out, bool quote);
 
+/**
+ * @brief A thread-safe set of open connections to one database server.
+ */
+typedef struct sqon_pool sqon_Pool;
+
+/**
+ * @brief Constructs a connection pool.
+ * @param proto Database connection object describing the server; it is
+ * copied, and may be freed after this call.
+ * @param min_size Number of connections opened immediately and kept open
+ * regardless of idleness.
+ * @param max_size Maximum number of connections open at once.
+ * @param idle_timeout Seconds after which an unused connection beyond
+ * min_size is closed; 0 keeps idle connections open.
+ * @return A new pool which must be freed with sqon_pool_free() or NULL on
+ * failure.
+ */
+sqon_Pool *
+sqon_pool_new (const sqon_DatabaseServer *proto, size_t min_size,
+	       size_t max_size, unsigned int idle_timeout);
+
+/**
+ * @brief Destructs a connection pool, closing its connections.
+ * @param pool Pool whose connections have all been released.
+ */
+void
+sqon_pool_free (sqon_Pool *pool);
+
+/**
+ * @brief Takes a connection out of the pool.
+ * @param pool Initialized connection pool.
+ * @param out Pointer to be set to a connected database connection object,
+ * usable by the calling thread until given to sqon_pool_release().
+ * @param timeout_ms Milliseconds to wait for a connection when all are in
+ * use; 0 does not wait, and a negative value waits indefinitely.
+ * @return Zero on success; SQON_TIMEOUT if no connection became available;
+ * otherwise an error from sqon_connect().
+ */
+int
+sqon_pool_acquire (sqon_Pool *pool, sqon_DatabaseServer **out,
+		   long timeout_ms);
+
+/**
+ * @brief Returns a connection to the pool.
+ * @param pool The pool from which srv was acquired.
+ * @param srv Database connection object returned by sqon_pool_acquire().
+ */
+void
+sqon_pool_release (sqon_Pool *pool, sqon_DatabaseServer *srv);
+
+/**
+ * @brief A thread-safe cache of query results, which may be shared by any
+ * number of connection objects.
+ */
+typedef struct sqon_cache sqon_Cache;
+
+/**
+ * @brief Constructs a result cache.
+ * @param max_bytes Memory the cached results may take up, including their
+ * keys and bookkeeping; the least recently used are evicted to stay within
+ * it.
+ * @param ttl_ms Milliseconds for which a result is served by default; 0
+ * keeps results until they are evicted or invalidated.
+ * @return A new cache which must be freed with sqon_cache_free() or NULL on
+ * failure.
+ */
+sqon_Cache *
+sqon_cache_new (size_t max_bytes, unsigned int ttl_ms);
+
+/**
+ * @brief Destructs a result cache.
+ * @param cache Cache no longer in use by any thread.
+ */
+void
+sqon_cache_free (sqon_Cache *cache);
+
+/**
+ * @brief Query the database, unless the same query has a cached result.
+ * @param srv Initialized database connection object.
+ * @param cache Initialized result cache.
+ * @param query UTF-8 encoded SQL statement, which should only read.
+ * @param out Pointer to string which will be allocated and populated with
+ * JSON-formatted results from the query.
+ * @param primary_key Primary key expected in return value, if any (else NULL).
+ * @param tag Name under which to group the result for
+ * sqon_cache_invalidate_tag(), or NULL.
+ * @param ttl_ms Milliseconds for which the result is served; 0 for the
+ * cache's default.
+ * @return As for sqon_query(); failures are not cached.
+ *
+ * Results are looked up by the server (its type, host, port, database and
+ * user), the output flags, the query text and the primary key, so that
+ * copies of a connection object, such as those of a pool, share them. A hit
+ * is answered without connecting. Two threads missing on the same query at
+ * once both run it.
+ */
+int
+sqon_query_cached (sqon_DatabaseServer *srv, sqon_Cache *cache,
+		   const char *query, char **out, const char *primary_key,
+		   const char *tag, unsigned int ttl_ms);
+
+/**
+ * @brief Discards cached results by query text, such as after a write.
+ * Results of cached queries still running at the time are not stored, since
+ * they may predate the write.
+ * @param cache Initialized result cache.
+ * @param prefix Beginning of the queries whose results are discarded, such
+ * as "SELECT * FROM users"; NULL discards everything.
+ */
+void
+sqon_cache_invalidate (sqon_Cache *cache, const char *prefix);
+
+/**
+ * @brief Discards the cached results stored under a tag. As with
+ * sqon_cache_invalidate(), results of cached queries still running at the
+ * time are not stored.
+ * @param cache Initialized result cache.
+ * @param tag Tag given to sqon_query_cached().
+ */
+void
+sqon_cache_invalidate_tag (sqon_Cache *cache, const char *tag);
+
+/**
+ * @brief A set of connections to servers which each hold part of the same
+ * data, such as customers split by ID, queried as one.
+ */
+typedef struct sqon_shard_group sqon_ShardGroup;
+
+/**
+ * @brief Constructs an empty shard group.
+ * @return A new group which must be freed with sqon_shards_free() or NULL on
+ * failure.
+ */
+sqon_ShardGroup *
+sqon_shards_new (void);
+
+/**
+ * @brief Destructs a shard group; its connections are not freed.
+ * @param g Shard group.
+ */
+void
+sqon_shards_free (sqon_ShardGroup *g);
+
+/**
+ * @brief Adds a shard to a group.
+ * @param g Shard group.
+ * @param srv Initialized database connection object, which must stay valid
+ * while the group is used and, during sqon_query_shards(), must not be used
+ * for anything else. As for sqon_query_async(), it should be persistent or
+ * pooled.
+ * @param timeout_ms Milliseconds from the start of sqon_query_shards() after
+ * which this shard is abandoned and fails with SQON_TIMEOUT, whether it is
+ * still connecting or querying; 0 for no limit. The client libraries limit
+ * a connect only to whole seconds, rounded up (libpq waits at least 2), so
+ * a connect can overrun a timeout by that much.
+ * @return Zero on success; SQON_MEMORYERROR on failure.
+ */
+int
+sqon_shards_add (sqon_ShardGroup *g, sqon_DatabaseServer *srv,
+		 unsigned int timeout_ms);
+
+/**
+ * @brief Runs a query on every shard of a group at once and merges the
+ * results.
+ * @param g Shard group with at least one shard.
+ * @param query UTF-8 encoded SQL statement.
+ * @param out Pointer to string which will be allocated and populated with
+ * one JSON result holding the rows of every shard which succeeded, in the
+ * order the shards were added, formatted by the output flags of the first
+ * of them; NULL if no shard succeeded.
+ * @param primary_key Primary key expected in return value, if any (else
+ * NULL); it must be unique across all the shards.
+ * @return Zero if every shard succeeded; SQON_INCOMPLETE if some failed, in
+ * which case out holds the result of the others and sqon_shard_error()
+ * tells which; the error of the first shard if all failed; otherwise an
+ * error in merging, such as SQON_PKNOTUNIQUE, with out NULL.
+ *
+ * Shards are queried as by sqon_query_async(), so they must be MySQL (with
+ * the non-blocking client API) or PostgreSQL connections; others fail with
+ * SQON_UNSUPPORTED. Connecting blocks, so shards without an open connection
+ * connect one after another before any query is sent; the queries then run
+ * at once. So the call takes as long as those connects together plus its
+ * slowest query, within the shards' timeouts. A shard which times out has
+ * its connection dropped, to be opened again when it is next used.
+ */
+int
+sqon_query_shards (sqon_ShardGroup *g, const char *query, char **out,
+		   const char *primary_key);
+
+/**
+ * @brief Gets how a shard fared in the last sqon_query_shards() on its
+ * group.
+ * @param g Shard group.
+ * @param i Index of the shard, counting from 0 in the order of adding.
+ * @return Zero if it succeeded; otherwise its error, as for sqon_query().
+ */
+int
+sqon_shard_error (const sqon_ShardGroup *g, size_t i);
+
+/**
+ * @brief Where a statement run on a cluster is sent.
+ */
+enum sqon_route
+{
+  /** Reads to a replica and everything else to the primary, judged from the
+      statement's text; when unsure, the primary. */
+  SQON_ROUTE_AUTO = 0,
+
+  /** A replica, or the primary if none can be used */
+  SQON_ROUTE_READ,
+
+  /** The primary */
+  SQON_ROUTE_WRITE
+};
+
+/**
+ * @brief A thread-safe set of connection pools to one primary server and
+ * any number of its read-only replicas.
+ */
+typedef struct sqon_cluster sqon_Cluster;
+
+/**
+ * @brief Constructs a cluster with no replicas.
+ * @param primary Database connection object describing the primary; it is
+ * copied, and may be freed after this call.
+ * @param max_size Maximum number of connections open at once to each server.
+ * @param max_lag_ms Milliseconds a replica may be behind the primary and
+ * still be read from, as it reports once a second; 0 does not check.
+ * @return A new cluster which must be freed with sqon_cluster_free() or NULL
+ * on failure.
+ */
+sqon_Cluster *
+sqon_cluster_new (const sqon_DatabaseServer *primary, size_t max_size,
+		  unsigned int max_lag_ms);
+
+/**
+ * @brief Destructs a cluster, closing its connections.
+ * @param c Cluster whose connections have all been released.
+ */
+void
+sqon_cluster_free (sqon_Cluster *c);
+
+/**
+ * @brief Adds a replica to a cluster.
+ * @param c Initialized cluster.
+ * @param replica Database connection object describing the replica; it is
+ * copied, and may be freed after this call.
+ * @return Zero on success; SQON_MEMORYERROR on failure.
+ */
+int
+sqon_cluster_add_replica (sqon_Cluster *c, const sqon_DatabaseServer *replica);
+
+/**
+ * @brief Takes a connection out of the cluster, such as to run a
+ * transaction.
+ * @param c Initialized cluster.
+ * @param route SQON_ROUTE_READ for a replica; otherwise the primary.
+ * @param out Pointer to be set to a connected database connection object,
+ * usable by the calling thread until given to sqon_cluster_release(). All
+ * statements run on it go to the same server, so a transaction begun on a
+ * connection to the primary stays there.
+ * @param timeout_ms As for sqon_pool_acquire().
+ * @return As for sqon_pool_acquire().
+ *
+ * A replica is chosen by the lowest average time of its recent queries,
+ * scaled by the number of connections already taken from it. Replicas which
+ * cannot be connected to, or which are further behind than the cluster
+ * allows, are passed over for a second; if no replica can be used, or one
+ * has no connection free within the timeout, the primary is used instead.
+ */
+int
+sqon_cluster_acquire (sqon_Cluster *c, enum sqon_route route,
+		      sqon_DatabaseServer **out, long timeout_ms);
+
+/**
+ * @brief Returns a connection to the cluster.
+ * @param c The cluster from which srv was acquired.
+ * @param srv Database connection object returned by sqon_cluster_acquire().
+ */
+void
+sqon_cluster_release (sqon_Cluster *c, sqon_DatabaseServer *srv);
+
+/**
+ * @brief Query whichever server of a cluster the statement should go to.
+ * @param c Initialized cluster.
+ * @param query UTF-8 encoded SQL statement.
+ * @param out As for sqon_query().
+ * @param primary_key Primary key expected in return value, if any (else NULL).
+ * @param route Where to send the query; SQON_ROUTE_READ or SQON_ROUTE_WRITE
+ * override the judgement of SQON_ROUTE_AUTO, such as for a SELECT calling a
+ * function which writes.
+ * @return As for sqon_query(); SQON_BADPARAMS if the statement begins or
+ * ends a transaction, which needs sqon_cluster_acquire().
+ *
+ * SQON_ROUTE_AUTO reads from a replica for a single SELECT, SHOW, EXPLAIN,
+ * DESCRIBE, VALUES, TABLE or WITH statement, unless it also writes, locks
+ * rows or draws from a sequence. A statement with a backslash anywhere goes
+ * to the primary, as servers differ on whether it escapes a quote.
+ */
+int
+sqon_cluster_query (sqon_Cluster *c, const char *query, char **out,
+		    const char *primary_key, enum sqon_route route);
+
+#ifdef __GNUC__
+# pragma GCC visibility pop
+#endif
+
 __END_DECLS
 
 #endif
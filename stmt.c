@@ -0,0 +1,448 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "backend.h"
+#include "sqon.h"
+#include "stmt.h"
+
+#define DEFAULT_LIMIT 64
+
+/* Names of cached statements start with this, which sqon_prepare() refuses */
+#define RESERVED_PREFIX "sqon_"
+
+struct stmt_entry
+{
+  char *name;
+  char *sql;
+  uint64_t hash;
+  uint64_t used;
+  bool pinned;
+  bool prepared;
+  /* the backend's handle, once prepared */
+  void *stmt;
+};
+
+/* Statements of one connection, most of them keyed by their SQL text and
+   evicted least recently used first; those named by the caller are kept
+   until replaced. */
+struct stmt_cache
+{
+  struct stmt_entry *entries;
+  size_t count;
+  size_t cap;
+  size_t limit;
+  uint64_t tick;
+  uint64_t next_id;
+};
+
+static uint64_t
+hash_sql (const char *sql)
+{
+  uint64_t h = 14695981039346656037ULL;
+
+  while (*sql)
+    {
+      h ^= (unsigned char) *sql++;
+      h *= 1099511628211ULL;
+    }
+
+  return h;
+}
+
+static char *
+copy_str (const char *s)
+{
+  char *out = sqon_malloc ((strlen (s) + 1) * sizeof (char));
+
+  if (out)
+    strcpy (out, s);
+
+  return out;
+}
+
+static struct stmt_cache *
+get_cache (sqon_DatabaseServer *srv)
+{
+  struct stmt_cache *cache = srv->stmts;
+
+  if (cache)
+    return cache;
+
+  cache = sqon_malloc (sizeof (struct stmt_cache));
+  if (NULL == cache)
+    return NULL;
+
+  cache->entries = NULL;
+  cache->count = 0;
+  cache->cap = 0;
+  cache->limit = DEFAULT_LIMIT;
+  cache->tick = 0;
+  cache->next_id = 0;
+
+  srv->stmts = cache;
+  return cache;
+}
+
+static int
+prepare_entry (sqon_DatabaseServer *srv, struct stmt_entry *e)
+{
+  int rc;
+  const struct backend *be = backend_get (srv->type);
+
+  if (NULL == be->prepare)
+    return SQON_UNSUPPORTED;
+
+  rc = be->prepare (srv, e->name, e->sql, &e->stmt);
+  if (!rc)
+    e->prepared = true;
+
+  return rc;
+}
+
+static void
+release_entry (sqon_DatabaseServer *srv, struct stmt_entry *e,
+	       bool deallocate)
+{
+  if (!e->prepared)
+    return;
+
+  backend_get (srv->type)->release (srv, e->stmt, deallocate);
+  e->stmt = NULL;
+  e->prepared = false;
+}
+
+static void
+remove_entry (struct stmt_cache *cache, size_t i)
+{
+  sqon_free (cache->entries[i].name);
+  sqon_free (cache->entries[i].sql);
+
+  cache->entries[i] = cache->entries[--cache->count];
+}
+
+static void
+evict (sqon_DatabaseServer *srv, struct stmt_cache *cache, size_t limit)
+{
+  for (;;)
+    {
+      size_t i, lru = cache->count, unpinned = 0;
+
+      for (i = 0; i < cache->count; ++i)
+	{
+	  if (cache->entries[i].pinned)
+	    continue;
+
+	  ++unpinned;
+	  if (lru == cache->count
+	      || cache->entries[i].used < cache->entries[lru].used)
+	    lru = i;
+	}
+
+      if (unpinned <= limit)
+	break;
+
+      release_entry (srv, &cache->entries[lru], true);
+      remove_entry (cache, lru);
+    }
+}
+
+static struct stmt_entry *
+find_sql (struct stmt_cache *cache, const char *sql)
+{
+  uint64_t hash = hash_sql (sql);
+  size_t i;
+
+  for (i = 0; i < cache->count; ++i)
+    if (cache->entries[i].hash == hash && !strcmp (cache->entries[i].sql, sql))
+      return &cache->entries[i];
+
+  return NULL;
+}
+
+/* Finds a statement named by the caller; cached ones are not theirs to
+   execute. */
+static struct stmt_entry *
+find_name (struct stmt_cache *cache, const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < cache->count; ++i)
+    if (cache->entries[i].pinned && !strcmp (cache->entries[i].name, name))
+      return &cache->entries[i];
+
+  return NULL;
+}
+
+static int
+add_entry (sqon_DatabaseServer *srv, struct stmt_cache *cache,
+	   const char *name, const char *sql, struct stmt_entry **out)
+{
+  char genname[32];
+  bool pinned = (NULL != name);
+  struct stmt_entry *e;
+
+  if (!pinned)
+    {
+      /* room for the new entry, which with a limit of 0 is dropped once
+	 it has run */
+      evict (srv, cache, cache->limit ? cache->limit - 1 : 0);
+
+      snprintf (genname, sizeof genname, RESERVED_PREFIX "%llu",
+		(unsigned long long) cache->next_id++);
+      name = genname;
+    }
+
+  if (cache->count == cache->cap)
+    {
+      size_t cap = cache->cap ? cache->cap * 2 : 8;
+      struct stmt_entry *entries = sqon_malloc (cap * sizeof (*entries));
+
+      if (NULL == entries)
+	return SQON_MEMORYERROR;
+
+      if (cache->entries)
+	{
+	  memcpy (entries, cache->entries, cache->count * sizeof (*entries));
+	  sqon_free (cache->entries);
+	}
+
+      cache->entries = entries;
+      cache->cap = cap;
+    }
+
+  e = &cache->entries[cache->count];
+  e->name = copy_str (name);
+  e->sql = copy_str (sql);
+  if (NULL == e->name || NULL == e->sql)
+    {
+      if (e->name)
+	sqon_free (e->name);
+      if (e->sql)
+	sqon_free (e->sql);
+      return SQON_MEMORYERROR;
+    }
+
+  e->hash = hash_sql (sql);
+  e->used = ++cache->tick;
+  e->pinned = pinned;
+  e->prepared = false;
+  e->stmt = NULL;
+
+  ++cache->count;
+  *out = e;
+  return 0;
+}
+
+static int
+execute_entry (sqon_DatabaseServer *srv, struct stmt_entry *e,
+	       size_t nparams, const char *const *values,
+	       const size_t *lengths, char **out, const char *pk)
+{
+  int rc;
+
+  if (!e->prepared)
+    {
+      rc = prepare_entry (srv, e);
+      if (rc)
+	return rc;
+    }
+
+  return backend_get (srv->type)->execute (srv, e->stmt, nparams, values,
+					   lengths, out, pk);
+}
+
+int
+sqon_prepare (sqon_DatabaseServer *srv, const char *name, const char *query)
+{
+  int rc;
+  struct stmt_cache *cache;
+  struct stmt_entry *e;
+
+  if (!strncmp (name, RESERVED_PREFIX, sizeof RESERVED_PREFIX - 1))
+    return SQON_BADPARAMS;
+
+  rc = sqon_connect (srv);
+  if (rc)
+    return rc;
+
+  cache = get_cache (srv);
+  if (NULL == cache)
+    {
+      sqon_close (srv);
+      return SQON_MEMORYERROR;
+    }
+
+  e = find_name (cache, name);
+  if (e && !strcmp (e->sql, query))
+    {
+      sqon_close (srv);
+      return 0;
+    }
+
+  if (e)
+    {
+      release_entry (srv, e, true);
+      remove_entry (cache, e - cache->entries);
+    }
+
+  rc = add_entry (srv, cache, name, query, &e);
+  if (!rc)
+    {
+      rc = prepare_entry (srv, e);
+      if (rc)
+	remove_entry (cache, e - cache->entries);
+    }
+
+  sqon_close (srv);
+  return rc;
+}
+
+int
+sqon_execute (sqon_DatabaseServer *srv, const char *name, char **out,
+	      const char *pk)
+{
+  int rc;
+  struct stmt_cache *cache = srv->stmts;
+  struct stmt_entry *e;
+
+  if (NULL == cache || NULL == (e = find_name (cache, name)))
+    return SQON_NOSTMT;
+
+  rc = sqon_connect (srv);
+  if (rc)
+    return rc;
+
+  e->used = ++cache->tick;
+  rc = execute_entry (srv, e, 0, NULL, NULL, out, pk);
+
+  sqon_close (srv);
+  return rc;
+}
+
+static int
+query_cached (sqon_DatabaseServer *srv, const char *query, size_t nparams,
+	      const char *const *values, const size_t *lengths, char **out,
+	      const char *pk)
+{
+  int rc;
+  struct stmt_cache *cache;
+  struct stmt_entry *e;
+
+  rc = sqon_connect (srv);
+  if (rc)
+    return rc;
+
+  cache = get_cache (srv);
+  if (NULL == cache)
+    {
+      sqon_close (srv);
+      return SQON_MEMORYERROR;
+    }
+
+  e = find_sql (cache, query);
+  if (NULL == e)
+    {
+      rc = add_entry (srv, cache, NULL, query, &e);
+
+      /* do not keep statements which the server refuses */
+      if (!rc)
+	{
+	  rc = prepare_entry (srv, e);
+	  if (rc)
+	    remove_entry (cache, e - cache->entries);
+	}
+    }
+
+  if (!rc)
+    {
+      e->used = ++cache->tick;
+      rc = execute_entry (srv, e, nparams, values, lengths, out, pk);
+
+      /* with no room in the cache, the statement lasts only this query */
+      if (!cache->limit && !e->pinned)
+	{
+	  release_entry (srv, e, true);
+	  remove_entry (cache, e - cache->entries);
+	}
+    }
+
+  sqon_close (srv);
+  return rc;
+}
+
+int
+sqon_query_prepared (sqon_DatabaseServer *srv, const char *query, char **out,
+		     const char *pk)
+{
+  return query_cached (srv, query, 0, NULL, NULL, out, pk);
+}
+
+int
+sqon_query_params (sqon_DatabaseServer *srv, const char *query,
+		   size_t nparams, const char *const *values,
+		   const size_t *lengths, char **out, const char *pk)
+{
+  return query_cached (srv, query, nparams, values, lengths, out, pk);
+}
+
+void
+sqon_set_stmt_cache_size (sqon_DatabaseServer *srv, size_t size)
+{
+  struct stmt_cache *cache = get_cache (srv);
+
+  if (NULL == cache)
+    return;
+
+  cache->limit = size;
+  evict (srv, cache, size);
+}
+
+void
+stmt_cache_detach (sqon_DatabaseServer *srv)
+{
+  struct stmt_cache *cache = srv->stmts;
+  size_t i;
+
+  if (NULL == cache)
+    return;
+
+  for (i = 0; i < cache->count; ++i)
+    release_entry (srv, &cache->entries[i], false);
+}
+
+void
+stmt_cache_free (sqon_DatabaseServer *srv)
+{
+  struct stmt_cache *cache = srv->stmts;
+
+  if (NULL == cache)
+    return;
+
+  stmt_cache_detach (srv);
+
+  while (cache->count)
+    remove_entry (cache, cache->count - 1);
+
+  if (cache->entries)
+    sqon_free (cache->entries);
+
+  sqon_free (cache);
+  srv->stmts = NULL;
+}
@@ -0,0 +1,31 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DELWINK_SQON_STMT_H
+#define DELWINK_SQON_STMT_H
+
+#include "sqon.h"
+
+/* Releases the server-side statements of srv's session, which is about to
+   be closed; they are prepared again when next used. */
+void
+stmt_cache_detach (sqon_DatabaseServer *srv);
+
+void
+stmt_cache_free (sqon_DatabaseServer *srv);
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Checks each escape scan kernel the build has against the scalar one, and
+   all of them against known answers, on edge cases and random input. Exits
+   non-zero on the first difference. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "escape.h"
+
+#define MAX_LEN 160
+
+typedef const unsigned char *(*scan_fn) (const unsigned char *,
+					 const unsigned char *);
+
+struct kernel
+{
+  const char *name;
+  scan_fn scan;
+};
+
+static struct kernel kernels[3];
+static size_t num_kernels;
+
+static unsigned long failures;
+
+static void
+add_kernels (void)
+{
+  kernels[num_kernels++] = (struct kernel) { "scalar", escape_scan_scalar };
+#ifdef ESCAPE_SSE2
+  kernels[num_kernels++] = (struct kernel) { "sse2", escape_scan_sse2 };
+#endif
+#ifdef ESCAPE_AVX2
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    kernels[num_kernels++] = (struct kernel) { "avx2", escape_scan_avx2 };
+  else
+    fprintf (stderr, "escape: CPU has no AVX2; not testing that kernel\n");
+#endif
+}
+
+static void
+dump (const unsigned char *s, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; ++i)
+    fprintf (stderr, "%02X", s[i]);
+  fputc ('\n', stderr);
+}
+
+/* Every kernel must stop at want, given as an offset from s, or at the
+   scalar kernel's answer if want is negative. */
+static void
+check (const unsigned char *s, size_t n, long want)
+{
+  size_t i;
+
+  if (want < 0)
+    want = escape_scan_scalar (s, s + n) - s;
+
+  for (i = 0; i < num_kernels; ++i)
+    {
+      long got = kernels[i].scan (s, s + n) - s;
+
+      if (got != want)
+	{
+	  if (!failures++)
+	    {
+	      fprintf (stderr, "escape: %s stopped at %ld instead of %ld in ",
+		       kernels[i].name, got, want);
+	      dump (s, n);
+	    }
+	}
+    }
+}
+
+/* Same, from every start in s */
+static void
+check_all_starts (const unsigned char *s, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i <= n; ++i)
+    check (s + i, n - i, -1);
+}
+
+/* Puts seq at each offset of a clean buffer of each length, across the 16 and
+   32 byte block boundaries; want is where the scan stops relative to seq, or
+   negative if it runs to the end. */
+static void
+check_placed (const char *seq, size_t seq_len, long want)
+{
+  unsigned char buf[MAX_LEN];
+  size_t n, at;
+
+  for (n = seq_len; n <= 2 * 32 + 8; ++n)
+    for (at = 0; at + seq_len <= n; ++at)
+      {
+	memset (buf, 'a', n);
+	memcpy (buf + at, seq, seq_len);
+	check (buf, n, want < 0 ? (long) n : (long) at + want);
+      }
+}
+
+static void
+check_edges (void)
+{
+  static const struct
+  {
+    const char *seq;
+    size_t len;
+    long stop;
+  } cases[] = {
+    { "\"", 1, 0 },
+    { "\\", 1, 0 },
+    { "\x00", 1, 0 },
+    { "\x01", 1, 0 },
+    { "\n", 1, 0 },
+    { "\x1F", 1, 0 },
+    { " ", 1, -1 },
+    { "~", 1, -1 },
+    { "\x7F", 1, -1 },
+    /* a lone continuation byte, and the lowest and highest lead bytes */
+    { "\x80", 1, 0 },
+    { "\xBF", 1, 0 },
+    { "\xC0\x80", 2, 0 },
+    { "\xC1\xBF", 2, 0 },
+    { "\xF5\x80\x80\x80", 4, 0 },
+    { "\xFF", 1, 0 },
+    /* valid sequences of each length */
+    { "\xC2\x80", 2, -1 },
+    { "\xC3\xA9", 2, -1 },
+    { "\xDF\xBF", 2, -1 },
+    { "\xE0\xA0\x80", 3, -1 },
+    { "\xE2\x82\xAC", 3, -1 },
+    { "\xEF\xBF\xBF", 3, -1 },
+    { "\xF0\x90\x80\x80", 4, -1 },
+    { "\xF0\x9F\x98\x80", 4, -1 },
+    { "\xF4\x8F\xBF\xBF", 4, -1 },
+    /* overlong, surrogate, beyond U+10FFFF, and a bad continuation */
+    { "\xE0\x80\xAF", 3, 0 },
+    { "\xF0\x80\x80\xAF", 4, 0 },
+    { "\xED\xA0\x80", 3, 0 },
+    { "\xED\xBF\xBF", 3, 0 },
+    { "\xF4\x90\x80\x80", 4, 0 },
+    { "\xC3\x41", 2, 0 },
+    { "\xE2\x82\x41", 3, 0 },
+    /* a valid run ending in something to escape or an invalid byte */
+    { "\xC3\xA9\xE2\x82\xAC\"", 6, 5 },
+    { "\xC3\xA9\xE2\x82\xAC\x80", 6, 5 },
+    { "\xC3\xA9\\\xC3\xA9", 5, 2 },
+  };
+  size_t i;
+
+  for (i = 0; i < sizeof (cases) / sizeof (cases[0]); ++i)
+    check_placed (cases[i].seq, cases[i].len, cases[i].stop);
+
+  /* a sequence cut short by the end of the input */
+  {
+    static const char *cut[] = { "\xC3", "\xE2\x82", "\xF0\x9F\x98" };
+    unsigned char buf[MAX_LEN];
+    size_t n, len;
+
+    for (i = 0; i < sizeof (cut) / sizeof (cut[0]); ++i)
+      for (len = strlen (cut[i]), n = len; n <= 2 * 32 + 8; ++n)
+	{
+	  memset (buf, 'a', n);
+	  memcpy (buf + n - len, cut[i], len);
+	  check (buf, n, (long) (n - len));
+	}
+  }
+
+  check (NULL, 0, 0);
+}
+
+/* Bytes mostly clean ASCII, with some of each kind of byte the kernels treat
+   differently, and whole UTF-8 sequences so valid runs get long. */
+static size_t
+random_fill (unsigned char *buf, size_t n)
+{
+  static const char *utf8[] = {
+    "\xC3\xA9", "\xE2\x82\xAC", "\xF0\x9F\x98\x80", "\xE6\x97\xA5"
+  };
+  size_t i = 0;
+
+  while (i < n)
+    {
+      int r = rand () % 100;
+
+      if (r < 70)
+	{
+	  buf[i++] = 'a' + rand () % 26;
+	}
+      else if (r < 90)
+	{
+	  const char *seq = utf8[rand () % 4];
+	  size_t len = strlen (seq);
+
+	  if (i + len > n)
+	    break;
+
+	  memcpy (buf + i, seq, len);
+	  i += len;
+	}
+      else if (r < 97)
+	{
+	  static const unsigned char special[] = { '"', '\\', 0, '\n', 0x1F,
+						   0x7F, 0x20 };
+
+	  buf[i++] = special[rand () % sizeof (special)];
+	}
+      else
+	{
+	  buf[i++] = rand () % 256;
+	}
+    }
+
+  return i;
+}
+
+static void
+check_random (void)
+{
+  unsigned char buf[MAX_LEN];
+  int iter;
+
+  srand (1);
+
+  for (iter = 0; iter < 20000 && !failures; ++iter)
+    check_all_starts (buf, random_fill (buf, rand () % MAX_LEN));
+}
+
+int
+main (void)
+{
+  add_kernels ();
+  check_edges ();
+  check_random ();
+
+  if (failures)
+    {
+      fprintf (stderr, "escape: %lu failures\n", failures);
+      return 1;
+    }
+
+  return 0;
+}
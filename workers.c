@@ -0,0 +1,228 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "sqon.h"
+#include "workers.h"
+
+#define DEFAULT_MIN_ROWS 10000
+
+struct job
+{
+  worker_fn fn;
+  void *arg;
+  size_t parts;
+  size_t next;
+  size_t done;
+  struct job *link;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+
+/* jobs with parts not yet handed out, oldest first */
+static struct job *queue = NULL;
+
+static unsigned int max_threads = 1;
+static size_t min_rows = DEFAULT_MIN_ROWS;
+static pthread_t *threads = NULL;
+static size_t num_threads = 0;
+static bool stopping = false;
+
+/* Hands out the next part of j; the lock is held. */
+static size_t
+take_part (struct job *j)
+{
+  struct job **p;
+  size_t part = j->next++;
+
+  if (j->next == j->parts)
+    {
+      for (p = &queue; *p != j; p = &(*p)->link)
+	;
+
+      *p = j->link;
+    }
+
+  return part;
+}
+
+/* Runs part of j without the lock, which is held on entry and return. */
+static void
+run_part (struct job *j, size_t part)
+{
+  pthread_mutex_unlock (&lock);
+  j->fn (j->arg, part);
+  pthread_mutex_lock (&lock);
+
+  if (++j->done == j->parts)
+    pthread_cond_broadcast (&finished);
+}
+
+static void *
+worker (void *arg)
+{
+  struct job *j;
+
+  (void) arg;
+
+  pthread_mutex_lock (&lock);
+
+  for (;;)
+    {
+      while (!stopping && NULL == queue)
+	pthread_cond_wait (&work, &lock);
+
+      if (stopping)
+	break;
+
+      j = queue;
+      run_part (j, take_part (j));
+    }
+
+  pthread_mutex_unlock (&lock);
+  return NULL;
+}
+
+/* Starts the workers which are missing, if it can; the lock is held. */
+static void
+start (void)
+{
+  size_t want = max_threads - 1;
+
+  if (!want)
+    return;
+
+  if (NULL == threads)
+    {
+      threads = sqon_malloc (want * sizeof (pthread_t));
+      if (NULL == threads)
+	return;
+    }
+
+  while (num_threads < want)
+    {
+      if (pthread_create (&threads[num_threads], NULL, worker, NULL))
+	break;
+
+      ++num_threads;
+    }
+}
+
+size_t
+workers_parts (size_t num_rows)
+{
+  size_t parts;
+
+  pthread_mutex_lock (&lock);
+
+  parts = (max_threads > 1 && num_rows >= min_rows) ? max_threads : 1;
+  if (parts > num_rows)
+    parts = num_rows ? num_rows : 1;
+
+  pthread_mutex_unlock (&lock);
+  return parts;
+}
+
+void
+workers_run (worker_fn fn, void *arg, size_t parts)
+{
+  struct job j, **p;
+
+  j.fn = fn;
+  j.arg = arg;
+  j.parts = parts;
+  j.next = 0;
+  j.done = 0;
+  j.link = NULL;
+
+  if (parts < 2)
+    {
+      if (parts)
+	fn (arg, 0);
+
+      return;
+    }
+
+  pthread_mutex_lock (&lock);
+  start ();
+
+  for (p = &queue; *p; p = &(*p)->link)
+    ;
+
+  *p = &j;
+  pthread_cond_broadcast (&work);
+
+  /* the caller takes parts like any worker, then waits for those still
+     running elsewhere */
+  while (j.next < j.parts)
+    run_part (&j, take_part (&j));
+
+  while (j.done < j.parts)
+    pthread_cond_wait (&finished, &lock);
+
+  pthread_mutex_unlock (&lock);
+}
+
+void
+workers_stop (void)
+{
+  size_t i;
+
+  pthread_mutex_lock (&lock);
+  stopping = true;
+  pthread_cond_broadcast (&work);
+  pthread_mutex_unlock (&lock);
+
+  for (i = 0; i < num_threads; ++i)
+    pthread_join (threads[i], NULL);
+
+  pthread_mutex_lock (&lock);
+
+  if (threads)
+    sqon_free (threads);
+
+  threads = NULL;
+  num_threads = 0;
+  stopping = false;
+  pthread_mutex_unlock (&lock);
+}
+
+void
+sqon_set_parallel (unsigned int threads_wanted, size_t rows)
+{
+  long cpus;
+
+  if (!threads_wanted)
+    {
+      cpus = sysconf (_SC_NPROCESSORS_ONLN);
+      threads_wanted = cpus > 0 ? (unsigned int) cpus : 1;
+    }
+
+  workers_stop ();
+
+  pthread_mutex_lock (&lock);
+  max_threads = threads_wanted;
+  min_rows = rows;
+  pthread_mutex_unlock (&lock);
+}
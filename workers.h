@@ -0,0 +1,42 @@
+/*
+ *  Structured Query Object Notation (SQON) - C API
+ *  Copyright (C) 2015 Delwink, LLC
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as published by
+ *  the Free Software Foundation, version 3 only.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DELWINK_SQON_WORKERS_H
+#define DELWINK_SQON_WORKERS_H
+
+#include <stddef.h>
+
+/* Process-wide pool of threads, sized by sqon_set_parallel(), which share
+   out the parts of jobs. The thread running a job works on it too, so a job
+   finishes even when no worker could be started. */
+typedef void (*worker_fn) (void *arg, size_t part);
+
+/* Number of parts to split num_rows rows into: 1 unless threads have been
+   asked for and there are at least as many rows as the threshold */
+size_t
+workers_parts (size_t num_rows);
+
+/* Calls fn for every part from 0 to parts - 1, in any order and on any of
+   the threads; returns once all are done. */
+void
+workers_run (worker_fn fn, void *arg, size_t parts);
+
+/* Joins the worker threads; the next job starts them again. */
+void
+workers_stop (void);
+
+#endif